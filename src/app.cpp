@@ -44,9 +44,7 @@ App::App(Settings set, Platform* plt)
     } else if(loaded_scene) {
 
         info("Rendering scene...");
-        err = gui.get_render().headless_render(gui.get_animate(), scene, set.output_file,
-                                               set.animate, set.w, set.h, set.s, set.ls, set.d,
-                                               set.exp, set.w_from_ar);
+        err = gui.get_render().headless_render(gui.get_animate(), scene, set.render);
 
         if(!err.empty())
             warn("Error rendering scene: %s", err.c_str());
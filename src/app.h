@@ -22,16 +22,8 @@ public:
         std::string env_map_file;
         bool headless = false;
 
-        // If headless is true, use all of these
-        std::string output_file = "out.png";
-        int w = 640;
-        int h = 360;
-        int s = 128;
-        int ls = 16;
-        int d = 4;
-        bool animate = false;
-        float exp = 1.0f;
-        bool w_from_ar = false;
+        // If headless is true, use these
+        Gui::Headless_Settings render;
     };
 
     App(Settings set, Platform* plt = nullptr);
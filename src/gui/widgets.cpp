@@ -1,10 +1,16 @@
 
 #include <imgui/imgui.h>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <map>
 #include <nfd/nfd.h>
 #include <sf_libs/stb_image_write.h>
 #include <sstream>
+#include <thread>
 
 #include "animate.h"
 #include "manager.h"
@@ -550,7 +556,7 @@ void Widget_Camera::generate_cage() {
     cam_cage.add(br, bl, Gui::Color::black);
 }
 
-Widget_Render::Widget_Render(Vec2 dim) : pathtracer(*this, dim) {
+Widget_Render::Widget_Render(Vec2 dim) : io_pool(1), pathtracer(*this, dim) {
     out_w = (size_t)dim.x / 2;
     out_h = (size_t)dim.y / 2;
 }
@@ -577,13 +583,37 @@ void Widget_Render::begin(Scene& scene, Widget_Camera& cam, Camera& user_cam) {
     static const char* method_names[] = {"Rasterize", "Path Trace"};
     ImGui::Combo("Method", &method, method_names, 2);
 
-    ImGui::InputInt("Width", &out_w, 1, 100);
-    ImGui::InputInt("Height", &out_h, 1, 100);
+    edited |= ImGui::InputInt("Width", &out_w, 1, 100);
+    edited |= ImGui::InputInt("Height", &out_h, 1, 100);
 
     if(method == 1) {
-        ImGui::InputInt("Samples", &out_samples, 1, 100);
-        ImGui::InputInt("Area Light Samples", &out_area_samples, 1, 100);
-        ImGui::InputInt("Max Ray Depth", &out_depth, 1, 32);
+        edited |= ImGui::InputInt("Samples", &out_samples, 1, 100);
+        edited |= ImGui::InputInt("Area Light Samples", &out_area_samples, 1, 100);
+        edited |= ImGui::InputInt("Max Ray Depth", &out_depth, 1, 32);
+        edited |= ImGui::InputFloat("Noise Threshold", &noise_threshold, 0.01f, 0.1f, "%.3f");
+        edited |= ImGui::InputFloat("Time Limit (s)", &time_limit, 1.0f, 10.0f, "%.1f");
+        edited |= ImGui::Checkbox("Wavefront Integrator", &wavefront);
+        static const char* sampler_names[] = {"Random", "Sobol"};
+        edited |= ImGui::Combo("Sampler", &sampler, sampler_names, 2);
+        edited |= ImGui::InputInt("Seed", &seed);
+        edited |= ImGui::Checkbox("Denoise", &denoise);
+        edited |= ImGui::Checkbox("Interactive Preview", &interactive);
+        if(ImGui::CollapsingHeader("Layers (saved to EXR)")) {
+            edited |= ImGui::Checkbox("Direct", &layers.direct);
+            ImGui::SameLine();
+            edited |= ImGui::Checkbox("Indirect", &layers.indirect);
+            ImGui::SameLine();
+            edited |= ImGui::Checkbox("Per Light", &layers.lights);
+            edited |= ImGui::Checkbox("Depth", &layers.depth);
+            ImGui::SameLine();
+            edited |= ImGui::Checkbox("Object ID", &layers.object);
+            ImGui::SameLine();
+            edited |= ImGui::Checkbox("Material ID", &layers.material);
+            if(layers.splits() && !wavefront) {
+                ImGui::TextWrapped("The direct, indirect and per light layers are only rendered "
+                                   "by the wavefront integrator.");
+            }
+        }
         ImGui::SliderFloat("Exposure", &exposure, 0.01f, 10.0f, "%.2f", 2.5f);
     } else {
         ImGui::Combo("Samples", (int*)&msaa.samples, GL::Sample_Count_Names, msaa.n_options());
@@ -595,9 +625,12 @@ void Widget_Render::begin(Scene& scene, Widget_Camera& cam, Camera& user_cam) {
     out_samples = std::max(1, out_samples);
     out_area_samples = std::max(1, out_area_samples);
     out_depth = std::max(1, out_depth);
+    noise_threshold = std::max(0.0f, noise_threshold);
+    time_limit = std::max(0.0f, time_limit);
 
     if(ImGui::Button("Set Width via AR")) {
         out_w = (size_t)std::ceil(cam.get_ar() * out_h);
+        edited = true;
     }
     ImGui::SameLine();
     if(ImGui::Button("Set AR via W/H")) {
@@ -605,71 +638,141 @@ void Widget_Render::begin(Scene& scene, Widget_Camera& cam, Camera& user_cam) {
     }
 }
 
+void Widget_Render::apply_settings() {
+    pathtracer.set_noise_threshold(noise_threshold);
+    pathtracer.set_time_limit(time_limit);
+    pathtracer.set_wavefront(wavefront);
+    pathtracer.set_sampler((RNG::Sequence)sampler, (uint32_t)seed);
+    pathtracer.set_denoise(denoise);
+
+    // Only the wavefront integrator splits radiance into layers
+    PT::Layers selected = layers;
+    if(!wavefront) selected.direct = selected.indirect = selected.lights = false;
+    pathtracer.set_layers(selected);
+}
+
+std::string Widget_Render::frame_path(int frame) const {
+    std::stringstream str;
+    str << std::setfill('0') << std::setw(4) << frame;
+#ifdef _WIN32
+    return folder + "\\" + str.str() + ".png";
+#else
+    return folder + "/" + str.str() + ".png";
+#endif
+}
+
+// The rasterizer's images are stored bottom row first. They are flipped here
+// rather than with stbi_flip_vertically_on_write, whose flag is shared by every
+// thread writing images.
+static void flip_rows(std::vector<unsigned char>& data, size_t w, size_t h) {
+    size_t row = w * 4;
+    for(size_t j = 0; j < h / 2; j++) {
+        std::swap_ranges(data.begin() + j * row, data.begin() + (j + 1) * row,
+                         data.begin() + (h - 1 - j) * row);
+    }
+}
+
+std::string Widget_Render::write_frame(std::function<std::string()> write) {
+
+    // Frames are encoded and written one at a time on the I/O thread. Only a
+    // couple may be waiting, so that a slow disk can't pile up finished frames.
+    writes.push_back(io_pool.enqueue(std::move(write)));
+    while(!writes.empty()) {
+        if(writes.size() <= 2 &&
+           writes.front().wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            break;
+        std::string err = writes.front().get();
+        writes.pop_front();
+        if(!err.empty()) return err;
+    }
+    return {};
+}
+
+std::string Widget_Render::finish_writes() {
+    std::string ret;
+    while(!writes.empty()) {
+        std::string err = writes.front().get();
+        writes.pop_front();
+        if(ret.empty()) ret = err;
+    }
+    return ret;
+}
+
 std::string Widget_Render::step(Animate& animate, Scene& scene) {
 
     if(animating) {
 
         if(next_frame == max_frame) {
             animating = false;
-            return {};
+            return finish_writes();
         }
         if(folder.empty()) {
             animating = false;
             return "No output folder!";
         }
 
-        Camera cam = animate.set_time(scene, (float)next_frame);
-        animate.step_sim(scene);
-
         if(method == 0) {
+            Camera cam = animate.set_time(scene, (float)next_frame);
+            animate.step_sim(scene);
+
             std::vector<unsigned char> data;
 
             Renderer::get().save(scene, cam, out_w, out_h, out_samples);
             Renderer::get().saved(data);
-
-            std::stringstream str;
-            str << std::setfill('0') << std::setw(4) << next_frame;
-#ifdef _WIN32
-            std::string path = folder + "\\" + str.str() + ".png";
-#else
-            std::string path = folder + "/" + str.str() + ".png";
-#endif
-
-            stbi_flip_vertically_on_write(true);
-            if(!stbi_write_png(path.c_str(), (int)out_w, (int)out_h, 4, data.data(),
-                               (int)out_w * 4)) {
+            flip_rows(data, out_w, out_h);
+
+            std::string err = write_frame(
+                [path = frame_path(next_frame), w = out_w, h = out_h, data = std::move(data)]() {
+                    if(!stbi_write_png(path.c_str(), w, h, 4, data.data(), w * 4))
+                        return std::string("Failed to write output!");
+                    return std::string();
+                });
+            if(!err.empty()) {
                 animating = false;
-                return "Failed to write output!";
+                return err;
             }
 
             next_frame++;
         } else {
 
+            // The next frame's scene is built while this one traces, and is ready
+            // to start rendering as soon as this one is handed off to be written.
             if(init) {
+                Camera cam = animate.set_time(scene, (float)next_frame);
+                animate.step_sim(scene);
                 pathtracer.begin_render(scene, cam);
+                next_cam.reset();
                 init = false;
             }
 
+            if(!next_cam && next_frame + 1 < max_frame) {
+                next_cam = animate.set_time(scene, (float)(next_frame + 1));
+                animate.step_sim(scene);
+                pathtracer.prepare_scene(scene);
+            }
+
             if(!pathtracer.in_progress()) {
-                std::vector<unsigned char> data;
+                auto image = std::make_shared<HDR_Image>(pathtracer.get_output().copy());
 
-                pathtracer.get_output().tonemap_to(data, exposure);
-                std::stringstream str;
-                str << std::setfill('0') << std::setw(4) << next_frame;
-#ifdef _WIN32
-                std::string path = folder + "\\" + str.str() + ".png";
-#else
-                std::string path = folder + "/" + str.str() + ".png";
-#endif
+                if(next_cam) {
+                    pathtracer.begin_prepared(*next_cam);
+                    next_cam.reset();
+                }
 
-                stbi_flip_vertically_on_write(false);
-                if(!stbi_write_png(path.c_str(), (int)out_w, (int)out_h, 4, data.data(),
-                                   (int)out_w * 4)) {
+                std::string err = write_frame([path = frame_path(next_frame), w = out_w, h = out_h,
+                                               image, e = exposure]() {
+                    std::vector<unsigned char> data;
+                    image->tonemap_to(data, e);
+                    if(!stbi_write_png(path.c_str(), w, h, 4, data.data(), w * 4))
+                        return std::string("Failed to write output!");
+                    return std::string();
+                });
+                if(!err.empty()) {
+                    pathtracer.cancel();
                     animating = false;
-                    return "Failed to write output!";
+                    return err;
                 }
 
-                pathtracer.begin_render(scene, cam);
                 next_frame++;
             }
         }
@@ -721,7 +824,9 @@ void Widget_Render::animate(Scene& scene, Widget_Camera& cam, Camera& user_cam,
             if(method == 1) {
                 init = true;
                 ray_log.clear();
+                pathtracer.cancel();
                 pathtracer.set_sizes(out_w, out_h, out_samples, out_area_samples, out_depth);
+                apply_settings();
             }
         }
     }
@@ -754,6 +859,23 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
 
     begin(scene, cam, user_cam);
 
+    // Interactive previews follow the render camera and scene as they're edited,
+    // and start over whenever a setting is
+    bool preview = method == 1 && interactive && !animating;
+    if(preview) {
+        if(edited) {
+            pathtracer.cancel();
+            pathtracer.set_sizes(out_w, out_h, out_samples, out_area_samples, out_depth);
+            apply_settings();
+        }
+        if(pathtracer.preview(scene, cam.get(), edited)) {
+            has_rendered = true;
+            ret = true;
+            ray_log.clear();
+        }
+        edited = false;
+    }
+
     ImGui::Separator();
     ImGui::Text("Render");
 
@@ -766,7 +888,7 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
         ImGui::SameLine();
         ImGui::ProgressBar(pathtracer.progress());
 
-    } else {
+    } else if(!preview) {
 
         if(ImGui::Button("Start Render")) {
 
@@ -775,6 +897,7 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
                 ret = true;
                 ray_log.clear();
                 pathtracer.set_sizes(out_w, out_h, out_samples, out_area_samples, out_depth);
+                apply_settings();
                 pathtracer.begin_render(scene, cam.get());
             } else {
                 Renderer::get().save(scene, cam.get(), out_w, out_h, out_samples);
@@ -785,35 +908,38 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
     ImGui::SameLine();
     if(ImGui::Button("Save Image")) {
         char* path = nullptr;
-        NFD_SaveDialog("png", nullptr, &path);
+        NFD_SaveDialog(method == 1 ? "png;exr" : "png", nullptr, &path);
         if(path) {
 
             std::string spath(path);
-            if(!postfix(spath, ".png")) {
+            bool exr = method == 1 && postfix(spath, ".exr");
+            if(!exr && !postfix(spath, ".png")) {
                 spath += ".png";
             }
 
             std::vector<unsigned char> data;
 
-            if(method == 1) {
+            if(exr) {
+                err = pathtracer.save_exr(spath);
+            } else if(method == 1) {
                 pathtracer.get_output().tonemap_to(data, exposure);
-                stbi_flip_vertically_on_write(false);
             } else {
                 Renderer::get().saved(data);
-                stbi_flip_vertically_on_write(true);
+                flip_rows(data, out_w, out_h);
             }
 
-            if(!stbi_write_png(spath.c_str(), (int)out_w, (int)out_h, 4, data.data(),
-                               (int)out_w * 4)) {
+            if(!exr && !stbi_write_png(spath.c_str(), (int)out_w, (int)out_h, 4, data.data(),
+                                       (int)out_w * 4)) {
                 err = "Failed to write png!";
             }
             free(path);
         }
     }
 
-    if(method == 1 && has_rendered) {
+    if(method == 1 && has_rendered && !preview) {
         ImGui::SameLine();
         if(ImGui::Button("Add Samples")) {
+            apply_settings();
             pathtracer.begin_render(scene, cam.get(), true);
         }
     }
@@ -840,21 +966,64 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
 }
 
 std::string Widget_Render::headless(Animate& animate, Scene& scene, const Camera& cam,
-                                    std::string output, bool a, int w, int h, int s, int ls, int d,
-                                    float exp) {
+                                    const Headless_Settings& set) {
+
+    RNG::Sequence sequence;
+    if(set.sampler == "random") {
+        sequence = RNG::Sequence::random;
+    } else if(set.sampler == "sobol") {
+        sequence = RNG::Sequence::sobol;
+    } else {
+        return "Unknown sampler " + set.sampler + " (expected random or sobol)";
+    }
+
+    PT::Layers layers;
+    std::string layers_err = layers.parse(set.layers);
+    if(!layers_err.empty()) return layers_err;
+    bool exr = postfix(set.output_file, ".exr");
+    if(set.animate && !set.jobs_dir.empty()) {
+        return "--jobs_dir can't be used with --animate, as jobs split a single frame and "
+               "each frame's simulation carries on from the last.";
+    }
+    if(!set.jobs_dir.empty() && (!set.checkpoint.empty() || set.resume || set.time_limit > 0.0f)) {
+        warn("--time_limit, --checkpoint and --resume are ignored with --jobs_dir, as each job "
+             "saves its own result.");
+    }
+    if(layers.splits() && !set.wavefront) {
+        return "The direct, indirect and lights layers need --wavefront, as only the wavefront "
+               "integrator splits radiance by light path.";
+    }
+    if(layers.any() && (set.animate || !exr)) {
+        warn("Layers are only written to single-frame EXR outputs.");
+    }
 
     info("Render settings:");
-    info("\twidth: %d", w);
-    info("\theight: %d", h);
-    info("\tsamples: %d", s);
-    info("\tlight samples: %d", ls);
-    info("\tmax depth: %d", d);
-    info("\texposure: %f", exp);
+    info("\twidth: %d", set.w);
+    info("\theight: %d", set.h);
+    info("\tsamples: %d", set.s);
+    info("\tlight samples: %d", set.ls);
+    info("\tmax depth: %d", set.d);
+    info("\texposure: %f", set.exp);
+    info("\tnoise threshold: %f", set.noise);
+    info("\ttime limit: %fs", set.time_limit);
+    info("\tintegrator: %s", set.wavefront ? "wavefront" : "recursive");
+    info("\tsampler: %s (seed %d)", set.sampler.c_str(), set.seed);
+    info("\tdenoise: %s", set.denoise ? "yes" : "no");
+    if(!set.layers.empty()) info("\tlayers: %s", set.layers.c_str());
+    if(!set.checkpoint.empty()) info("\tcheckpoint: %s", set.checkpoint.c_str());
+    if(!set.jobs_dir.empty())
+        info("\tjobs: %s (%s)", set.jobs_dir.c_str(), set.coordinator ? "coordinator" : "worker");
     info("\trender threads: %u", std::thread::hardware_concurrency());
 
-    out_w = w;
-    out_h = h;
-    pathtracer.set_sizes(w, h, s, ls, d);
+    out_w = set.w;
+    out_h = set.h;
+    pathtracer.set_sizes(set.w, set.h, set.s, set.ls, set.d);
+    pathtracer.set_noise_threshold(set.noise);
+    pathtracer.set_time_limit(set.time_limit);
+    pathtracer.set_wavefront(set.wavefront);
+    pathtracer.set_sampler(sequence, (uint32_t)set.seed);
+    pathtracer.set_denoise(set.denoise);
+    pathtracer.set_layers(layers);
 
     auto print_progress = [](float f) {
         std::cout << "Progress: [";
@@ -874,34 +1043,72 @@ std::string Widget_Render::headless(Animate& animate, Scene& scene, const Camera
     };
 
     std::cout << std::fixed << std::setw(2) << std::setprecision(2) << std::setfill('0');
-    if(a) {
+    if(set.animate) {
 
         method = 1;
         init = true;
         animating = true;
         max_frame = animate.n_frames();
         next_frame = 0;
-        folder = output;
+        folder = set.output_file;
         while(next_frame < max_frame) {
             std::string err = step(animate, scene);
             if(!err.empty()) return err;
             print_progress(((float)next_frame + pathtracer.progress()) / (max_frame + 1));
             std::this_thread::sleep_for(std::chrono::milliseconds(250));
         }
+        std::string err = finish_writes();
+        if(!err.empty()) return err;
         std::cout << std::endl;
 
     } else {
 
-        pathtracer.begin_render(scene, cam);
-        while(pathtracer.in_progress()) {
-            print_progress(pathtracer.progress());
-            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        if(!set.jobs_dir.empty()) {
+            std::string err = render_jobs(scene, cam, set.jobs_dir, set.coordinator,
+                                          std::max(set.jobs, 1));
+            if(!err.empty()) return err;
+            if(!set.coordinator) return {};
+        } else {
+            bool resumed = false;
+            if(set.resume && !set.checkpoint.empty()) {
+                std::string err = pathtracer.resume(scene, cam, set.checkpoint);
+                if(err.empty()) {
+                    info("Resumed from checkpoint (%.1f samples per pixel).",
+                         pathtracer.average_samples());
+                    resumed = true;
+                } else {
+                    warn("Could not resume: %s", err.c_str());
+                }
+            }
+            if(!resumed) pathtracer.begin_render(scene, cam);
+
+            auto save = [&]() {
+                std::string err = pathtracer.save_checkpoint(set.checkpoint);
+                if(!err.empty()) warn("Failed to save checkpoint: %s", err.c_str());
+            };
+
+            auto saved = std::chrono::steady_clock::now();
+            while(pathtracer.in_progress()) {
+                print_progress(pathtracer.progress());
+                std::this_thread::sleep_for(std::chrono::milliseconds(250));
+
+                auto now = std::chrono::steady_clock::now();
+                if(!set.checkpoint.empty() &&
+                   std::chrono::duration<float>(now - saved).count() >= set.checkpoint_interval) {
+                    save();
+                    saved = now;
+                }
+            }
+            std::cout << std::endl;
+            if(!set.checkpoint.empty()) save();
+            info("Average samples per pixel: %.1f", pathtracer.average_samples());
         }
-        std::cout << std::endl;
+
+        if(exr) return pathtracer.save_exr(set.output_file);
 
         std::vector<unsigned char> data;
-        pathtracer.get_output().tonemap_to(data, exp);
-        if(!stbi_write_png(output.c_str(), w, h, 4, data.data(), w * 4)) {
+        pathtracer.get_output().tonemap_to(data, set.exp);
+        if(!stbi_write_png(set.output_file.c_str(), set.w, set.h, 4, data.data(), set.w * 4)) {
             return "Failed to write output!";
         }
     }
@@ -909,6 +1116,182 @@ std::string Widget_Render::headless(Animate& animate, Scene& scene, const Camera
     return {};
 }
 
+std::string Widget_Render::render_jobs(Scene& scene, const Camera& cam, const std::string& dir,
+                                       bool coordinator, int n_jobs) {
+
+    // Processes rendering one frame share a directory. The coordinator splits
+    // the image into bands, writing a file for each and then a manifest giving
+    // their number. Every process, the coordinator included, claims bands by
+    // renaming their files, which only one process can do, and saves each band
+    // it renders as a checkpoint. The coordinator merges those into the image,
+    // then removes the files, so the next frame's workers wait for a new manifest.
+    auto file = [&dir](const std::string& name) {
+#ifdef _WIN32
+        return dir + "\\" + name;
+#else
+        return dir + "/" + name;
+#endif
+    };
+    auto job = [&](int i) { return file("job_" + std::to_string(i)); };
+    auto claimed = [&](int i) { return file("job_" + std::to_string(i) + ".claimed"); };
+    auto result = [&](int i) { return file("result_" + std::to_string(i)); };
+    std::string manifest = file("manifest");
+
+    // While rendering a band, a process rewrites its claim with a count every
+    // heartbeat seconds. Machines' clocks may differ, so the coordinator times
+    // claims by its own clock, taking one that stays the same for stale seconds
+    // to have been left by a process that died, and renders that band itself.
+    using Clock = std::chrono::steady_clock;
+    constexpr float heartbeat = 5.0f, stale = 60.0f, manifest_timeout = 600.0f;
+    auto seconds_since = [](Clock::time_point t) {
+        return std::chrono::duration<float>(Clock::now() - t).count();
+    };
+
+    // The first row and row count of band i
+    auto band = [&](int i) {
+        int rows = (out_h + n_jobs - 1) / n_jobs;
+        return std::make_pair(i * rows, std::max(std::min(rows, out_h - i * rows), 0));
+    };
+
+    if(coordinator) {
+        std::remove(manifest.c_str());
+
+        // An earlier run that was cut short may have left jobs and results, and
+        // may have split the frame into more of them
+        std::error_code ec;
+        std::vector<std::filesystem::path> stale;
+        for(const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+            std::string name = entry.path().filename().string();
+            if(name.rfind("job_", 0) == 0 || name.rfind("result_", 0) == 0)
+                stale.push_back(entry.path());
+        }
+        for(const auto& path : stale) std::filesystem::remove(path, ec);
+
+        for(int i = 0; i < n_jobs; i++) {
+            std::ofstream out(job(i));
+            out << band(i).first << " " << band(i).second << std::endl;
+            if(!out.good()) return "Failed to write " + job(i) + "!";
+        }
+
+        {
+            std::ofstream out(manifest + ".tmp");
+            out << n_jobs << std::endl;
+            if(!out.good()) return "Failed to write " + manifest + "!";
+        }
+        if(std::rename((manifest + ".tmp").c_str(), manifest.c_str()))
+            return "Failed to write " + manifest + "!";
+
+    } else {
+        info("Waiting for jobs in %s...", dir.c_str());
+        Clock::time_point start = Clock::now();
+        while(!(std::ifstream(manifest) >> n_jobs)) {
+            if(seconds_since(start) >= manifest_timeout) {
+                return "No jobs were posted in " + dir + " within " +
+                       std::to_string((int)manifest_timeout) + " seconds.";
+            }
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+    }
+
+    // The scene is built for the first band rendered here, and kept for the rest
+    bool built = false;
+    auto render_band = [&](int i, int y, int h) {
+        info("Rendering job %d of %d (rows %d to %d)", i + 1, n_jobs, y, y + h);
+
+        // The claim is refreshed from its own thread, so a long scene build
+        // doesn't look like a process that died
+        std::atomic<bool> done = false;
+        std::thread beat([&, i, y, h]() {
+            Clock::time_point last = Clock::now();
+            int beats = 0;
+            while(!done) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                if(seconds_since(last) >= heartbeat) {
+                    std::ofstream(claimed(i)) << y << " " << h << " " << ++beats << std::endl;
+                    last = Clock::now();
+                }
+            }
+        });
+
+        pathtracer.set_region(0, y, out_w, h);
+        pathtracer.begin_render(scene, cam, built);
+        built = true;
+        while(pathtracer.in_progress()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        std::string err = pathtracer.save_checkpoint(result(i));
+
+        done = true;
+        beat.join();
+        return err;
+    };
+
+    for(int i = 0; i < n_jobs; i++) {
+        if(std::rename(job(i).c_str(), claimed(i).c_str())) continue;
+
+        int y = 0, h = 0;
+        std::ifstream(claimed(i)) >> y >> h;
+        std::string err = render_band(i, y, h);
+        if(!err.empty()) return err;
+    }
+
+    if(!coordinator) return {};
+
+    // Every band has been claimed by now, so each is either done or being rendered
+    struct Pending {
+        std::string claim;
+        Clock::time_point changed;
+    };
+    std::map<int, Pending> pending;
+    for(int i = 0; i < n_jobs; i++) {
+        if(!std::ifstream(result(i)).is_open()) pending[i] = {{}, Clock::now()};
+    }
+    if(!pending.empty()) info("Waiting for %zu of %d jobs...", pending.size(), n_jobs);
+
+    while(!pending.empty()) {
+        for(auto entry = pending.begin(); entry != pending.end();) {
+            auto& [i, wait] = *entry;
+            if(std::ifstream(result(i)).is_open()) {
+                entry = pending.erase(entry);
+                continue;
+            }
+
+            std::stringstream claim;
+            claim << std::ifstream(claimed(i)).rdbuf();
+            if(claim.str() != wait.claim) {
+                wait.claim = claim.str();
+                wait.changed = Clock::now();
+            } else if(seconds_since(wait.changed) >= stale) {
+                warn("Job %d of %d was abandoned; rendering it here.", i + 1, n_jobs);
+                std::string err = render_band(i, band(i).first, band(i).second);
+                if(!err.empty()) return err;
+                entry = pending.erase(entry);
+                continue;
+            }
+            entry++;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    }
+
+    std::vector<std::string> results;
+    for(int i = 0; i < n_jobs; i++) results.push_back(result(i));
+    std::string err = pathtracer.merge_checkpoints(scene, cam, results);
+    if(!err.empty()) return err;
+    while(pathtracer.in_progress()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    info("Merged %d jobs.", n_jobs);
+
+    // The manifest goes first, so that no worker starts on what is left
+    std::remove(manifest.c_str());
+    for(int i = 0; i < n_jobs; i++) {
+        std::remove(job(i).c_str());
+        std::remove(claimed(i).c_str());
+        std::remove(result(i).c_str());
+    }
+    return {};
+}
+
 void Widget_Render::render_log(const Mat4& view) const {
     std::lock_guard<std::mutex> lock(log_mut);
     Renderer::get().lines(ray_log, view);
@@ -73,6 +73,32 @@ private:
     void generate_cage();
 };
 
+// Settings of a render made without opening the GUI
+struct Headless_Settings {
+    std::string output_file = "out.png";
+    int w = 640;
+    int h = 360;
+    int s = 128;
+    int ls = 16;
+    int d = 4;
+    bool animate = false;
+    float exp = 1.0f;
+    bool w_from_ar = false;
+    float noise = 0.0f;
+    float time_limit = 0.0f;
+    std::string checkpoint;
+    float checkpoint_interval = 60.0f;
+    bool resume = false;
+    std::string jobs_dir;
+    bool coordinator = false;
+    int jobs = 16;
+    bool wavefront = false;
+    int seed = 0;
+    std::string sampler = "random";
+    bool denoise = false;
+    std::string layers;
+};
+
 class Widget_Render {
 public:
     Widget_Render(Vec2 dim);
@@ -83,8 +109,8 @@ public:
     void animate(Scene& scene, Widget_Camera& cam, Camera& user_cam, int max_frame);
     std::string step(Animate& animate, Scene& scene);
 
-    std::string headless(Animate& animate, Scene& scene, const Camera& cam, std::string output,
-                         bool a, int w, int h, int s, int ls, int d, float exp);
+    std::string headless(Animate& animate, Scene& scene, const Camera& cam,
+                         const Headless_Settings& set);
 
     void log_ray(const Ray& ray, float t, Spectrum color = Spectrum{1.0f});
     void render_log(const Mat4& view) const;
@@ -107,14 +133,27 @@ public:
 
 private:
     void begin(Scene& scene, Widget_Camera& cam, Camera& user_cam);
+    void apply_settings();
+    std::string frame_path(int frame) const;
+    std::string write_frame(std::function<std::string()> write);
+    std::string finish_writes();
+    std::string render_jobs(Scene& scene, const Camera& cam, const std::string& dir,
+                            bool coordinator, int jobs);
 
     mutable std::mutex log_mut;
     GL::Lines ray_log;
 
     int out_w, out_h, out_samples = 32, out_area_samples = 8, out_depth = 4;
-    float exposure = 1.0f;
+    float exposure = 1.0f, noise_threshold = 0.0f, time_limit = 0.0f;
+    bool wavefront = false, denoise = false;
+    PT::Layers layers;
+    int seed = 0, sampler = 0;
 
     bool has_rendered = false;
+
+    // Whether to preview interactively, and whether the settings have been
+    // edited since the preview last applied them
+    bool interactive = false, edited = true;
     bool render_window = false, render_window_focus = false;
 
     int method = 1;
@@ -124,6 +163,13 @@ private:
     char output_path[256] = {};
     std::string folder;
 
+    // Camera for the frame after next_frame, once its scene has been prepared
+    std::optional<Camera> next_cam;
+
+    // Writes of finished animation frames, in frame order
+    Thread_Pool io_pool;
+    std::deque<std::future<std::string>> writes;
+
     GL::MSAA msaa;
     PT::Pathtracer pathtracer;
 };
@@ -26,13 +26,15 @@ struct Ray {
         return point + t * dir;
     }
 
-    /// Move ray into the space defined by this tranform matrix
-    void transform(const Mat4& trans) {
+    /// Move ray into the space defined by this tranform matrix, returning the
+    /// factor by which distances along it were scaled
+    float transform(const Mat4& trans) {
         point = trans * point;
         dir = trans.rotate(dir);
         float d = dir.norm();
         dist_bounds *= d;
         dir /= d;
+        return d;
     }
 
     /// The origin or starting point of this ray
@@ -13,16 +13,52 @@ int main(int argc, char** argv) {
     args.add_option("-s,--scene", settings.scene_file, "Scene file to load");
     args.add_option("--env_map", settings.env_map_file, "Override scene environment map");
     args.add_flag("--headless", settings.headless, "Path-trace scene without opening the GUI");
-    args.add_option("-o,--output", settings.output_file, "Image file to write (if headless)");
-    args.add_flag("--animate", settings.animate, "Output animation frames (if headless)");
-    args.add_option("--width", settings.w, "Output image width (if headless)");
-    args.add_option("--height", settings.h, "Output image height (if headless)");
-    args.add_flag("--use_ar", settings.w_from_ar,
+    args.add_option("-o,--output", settings.render.output_file,
+                    "Image file to write (if headless)");
+    args.add_flag("--animate", settings.render.animate, "Output animation frames (if headless)");
+    args.add_option("--width", settings.render.w, "Output image width (if headless)");
+    args.add_option("--height", settings.render.h, "Output image height (if headless)");
+    args.add_flag("--use_ar", settings.render.w_from_ar,
                   "Compute output image width based on camera AR (if headless)");
-    args.add_option("--depth", settings.d, "Maximum ray depth (if headless)");
-    args.add_option("--samples", settings.s, "Pixel samples (if headless)");
-    args.add_option("--exposure", settings.exp, "Output exposure (if headless)");
-    args.add_option("--area_samples", settings.ls, "Area light samples (if headless)");
+    args.add_option("--depth", settings.render.d, "Maximum ray depth (if headless)");
+    args.add_option("--samples", settings.render.s, "Pixel samples (if headless)");
+    args.add_option("--exposure", settings.render.exp, "Output exposure (if headless)");
+    args.add_option("--area_samples", settings.render.ls, "Area light samples (if headless)");
+    args.add_option("--noise_threshold", settings.render.noise,
+                    "Stop sampling regions once their relative error is below this (if headless)");
+    auto time_limit = args.add_option(
+        "--time_limit", settings.render.time_limit,
+        "Render for this many seconds instead of a fixed sample count (if headless)");
+    auto checkpoint = args.add_option("--checkpoint", settings.render.checkpoint,
+                                      "File to periodically save render progress to (if headless)");
+    auto interval = args.add_option("--checkpoint_interval", settings.render.checkpoint_interval,
+                                    "Seconds between checkpoints (if headless)");
+    auto resume = args.add_flag("--resume", settings.render.resume,
+                                "Continue the render saved in the checkpoint file (if headless)");
+
+    // Jobs save their own checkpoints, and a time limit would apply to each job
+    // a process renders rather than to the frame
+    args.add_option("--jobs_dir", settings.render.jobs_dir,
+                    "Directory shared with other processes rendering the same frame (if headless, "
+                    "not with --animate, --time_limit or checkpoints)")
+        ->excludes(time_limit)
+        ->excludes(checkpoint)
+        ->excludes(interval)
+        ->excludes(resume);
+    args.add_flag("--coordinator", settings.render.coordinator,
+                  "Split the frame into jobs in --jobs_dir and write the merged result");
+    args.add_option("--jobs", settings.render.jobs, "Number of jobs to split the frame into");
+    args.add_flag("--wavefront", settings.render.wavefront,
+                  "Trace with the batched wavefront integrator (if headless)");
+    args.add_option("--seed", settings.render.seed,
+                    "Seed of the render's samples; equal seeds give equal images (if headless)");
+    args.add_option("--sampler", settings.render.sampler,
+                    "Sample sequence: random or sobol (if headless)");
+    args.add_flag("--denoise", settings.render.denoise,
+                  "Denoise the output, guided by first-hit features (if headless)");
+    args.add_option("--layers", settings.render.layers,
+                    "Comma-separated render layers to write to an .exr output: direct, indirect, "
+                    "lights (these three need --wavefront), depth, object, material (if headless)");
 
     CLI11_PARSE(args, argc, argv);
 
@@ -28,9 +28,17 @@ struct BSDF_Lambertian {
     BSDF_Lambertian(Spectrum albedo) : albedo(albedo) {
     }
 
+    // Discrete BSDFs are deltas, which light sampling can never hit; sided
+    // ones treat back-faces differently from front-faces.
+    static constexpr bool discrete = false, sided = false;
+
     BSDF_Sample sample(Vec3 out_dir) const;
     Spectrum evaluate(Vec3 out_dir, Vec3 in_dir) const;
 
+    // The density with which sample(out_dir) gives in_dir, for weighting it
+    // against light sampling (zero for discrete BSDFs)
+    float pdf(Vec3 out_dir, Vec3 in_dir) const;
+
     Spectrum albedo;
     Samplers::Hemisphere::Uniform sampler;
 };
@@ -40,8 +48,11 @@ struct BSDF_Mirror {
     BSDF_Mirror(Spectrum reflectance) : reflectance(reflectance) {
     }
 
+    static constexpr bool discrete = true, sided = false;
+
     BSDF_Sample sample(Vec3 out_dir) const;
     Spectrum evaluate(Vec3 out_dir, Vec3 in_dir) const;
+    float pdf(Vec3 out_dir, Vec3 in_dir) const;
 
     Spectrum reflectance;
 };
@@ -52,8 +63,11 @@ struct BSDF_Refract {
         : transmittance(transmittance), index_of_refraction(ior) {
     }
 
+    static constexpr bool discrete = true, sided = true;
+
     BSDF_Sample sample(Vec3 out_dir) const;
     Spectrum evaluate(Vec3 out_dir, Vec3 in_dir) const;
+    float pdf(Vec3 out_dir, Vec3 in_dir) const;
 
     Spectrum transmittance;
     float index_of_refraction;
@@ -65,8 +79,11 @@ struct BSDF_Glass {
         : transmittance(transmittance), reflectance(reflectance), index_of_refraction(ior) {
     }
 
+    static constexpr bool discrete = true, sided = true;
+
     BSDF_Sample sample(Vec3 out_dir) const;
     Spectrum evaluate(Vec3 out_dir, Vec3 in_dir) const;
+    float pdf(Vec3 out_dir, Vec3 in_dir) const;
 
     Spectrum transmittance;
     Spectrum reflectance;
@@ -78,8 +95,11 @@ struct BSDF_Diffuse {
     BSDF_Diffuse(Spectrum radiance) : radiance(radiance) {
     }
 
+    static constexpr bool discrete = false, sided = false;
+
     BSDF_Sample sample(Vec3 out_dir) const;
     Spectrum evaluate(Vec3 out_dir, Vec3 in_dir) const;
+    float pdf(Vec3 out_dir, Vec3 in_dir) const;
 
     Spectrum radiance;
     Samplers::Hemisphere::Uniform sampler;
@@ -114,22 +134,36 @@ public:
             underlying);
     }
 
+    float pdf(Vec3 out_dir, Vec3 in_dir) const {
+        return std::visit(
+            overloaded{[&out_dir, &in_dir](const auto& b) { return b.pdf(out_dir, in_dir); }},
+            underlying);
+    }
+
+    // The color of the light the surface passes on, for the denoiser's albedo
+    // buffer. Emitters count as white, so that their light is kept as it is.
+    Spectrum albedo() const {
+        return std::visit(
+            overloaded{[](const BSDF_Lambertian& b) { return b.albedo; },
+                       [](const BSDF_Mirror& b) { return b.reflectance; },
+                       [](const BSDF_Glass& b) { return (b.reflectance + b.transmittance) * 0.5f; },
+                       [](const BSDF_Diffuse&) { return Spectrum(1.0f); },
+                       [](const BSDF_Refract& b) { return b.transmittance; }},
+            underlying);
+    }
+
     bool is_discrete() const {
-        return std::visit(overloaded{[](const BSDF_Lambertian&) { return false; },
-                                     [](const BSDF_Mirror&) { return true; },
-                                     [](const BSDF_Glass&) { return true; },
-                                     [](const BSDF_Diffuse&) { return false; },
-                                     [](const BSDF_Refract&) { return true; }},
-                          underlying);
+        return std::visit([](const auto& b) { return b.discrete; }, underlying);
     }
 
     bool is_sided() const {
-        return std::visit(overloaded{[](const BSDF_Lambertian&) { return false; },
-                                     [](const BSDF_Mirror&) { return false; },
-                                     [](const BSDF_Glass&) { return true; },
-                                     [](const BSDF_Diffuse&) { return false; },
-                                     [](const BSDF_Refract&) { return true; }},
-                          underlying);
+        return std::visit([](const auto& b) { return b.sided; }, underlying);
+    }
+
+    // Call f with the underlying BSDF, so that shading many hits of one material
+    // dispatches once rather than for every call
+    template<typename F> decltype(auto) visit(F&& f) const {
+        return std::visit(std::forward<F>(f), underlying);
     }
 
 private:
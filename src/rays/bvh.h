@@ -3,16 +3,50 @@
 
 #include "../lib/mathlib.h"
 #include "../platform/gl.h"
+#include "../util/thread_pool.h"
 
 #include "trace.h"
+#include <type_traits>
 
 namespace PT {
 
+// Number of rays traced together by BVH::hit_packet
+constexpr size_t PACKET_SIZE = 8;
+
+// Primitives (i.e. Objects) that can find their closest hit as a Hit_Record and
+// build its Trace separately. BVHs of them defer that to the closest hit.
+template<typename P, typename = void> struct Has_Deferred_Hit : std::false_type {};
+template<typename P>
+struct Has_Deferred_Hit<P, std::void_t<decltype(std::declval<const P&>().surface(
+                               std::declval<const Ray&>(), std::declval<const Hit_Record&>()))>>
+    : std::true_type {};
+
 template<typename Primitive> class BVH {
 public:
     BVH() = default;
-    BVH(std::vector<Primitive>&& primitives, size_t max_leaf_size = 1);
-    void build(std::vector<Primitive>&& primitives, size_t max_leaf_size = 1);
+    BVH(std::vector<Primitive>&& primitives, size_t max_leaf_size = 1,
+        Thread_Pool* pool = nullptr);
+
+    // If a pool is given, large builds split their work into tasks on it. This
+    // may be called from a task already running on that pool.
+    void build(std::vector<Primitive>&& primitives, size_t max_leaf_size = 1,
+               Thread_Pool* pool = nullptr);
+
+    // Wall-clock seconds spent in each stage of the last build
+    struct Build_Stats {
+        float bounds = 0.0f, split = 0.0f, reorder = 0.0f, layout = 0.0f;
+    };
+    const Build_Stats& build_stats() const {
+        return stats;
+    }
+
+    // Recompute the bounds of the existing tree after its primitives have moved,
+    // keeping its structure. If that leaves the tree's SAH cost more than
+    // REFIT_LIMIT times what it was when built, the tree is rebuilt instead, and
+    // false is returned.
+    static constexpr float REFIT_LIMIT = 1.5f;
+    bool refit(Thread_Pool* pool = nullptr);
+    float sah_cost() const;
 
     BVH(BVH&& src) = default;
     BVH& operator=(BVH&& src) = default;
@@ -23,6 +57,36 @@ public:
     BBox bbox() const;
     Trace hit(const Ray& ray) const;
 
+    // Trace a batch of rays, updating each trace with any closer hit. The first
+    // traces rays in consecutive packets, so it suits coherent rays (e.g. primary
+    // rays of one tile); the second regroups rays by direction octant first.
+    void hit(const std::vector<Ray>& rays, std::vector<Trace>& traces) const;
+    void hit_stream(const std::vector<Ray>& rays, std::vector<Trace>& traces) const;
+    void hit_packet(const Ray* rays, Trace* traces, size_t n) const;
+
+    // Whether anything blocks the ray within its dist_bounds. This stops at the
+    // first hit found and computes nothing about it, so suits shadow rays.
+    bool occluded(const Ray& ray) const;
+
+    // Walk the tree, calling leaf(ray, start, size, closest) for the primitives
+    // [start, start + size) of each leaf the ray reaches, or for packets
+    // leaf(rays, traces, n, start, size) with the rays that reached the leaf.
+    // traverse_any stops as soon as leaf(ray, start, size) returns true.
+    // Primitive types with a faster batched layout use these in place of hit().
+    // The closest hit may be kept as a Trace or a Hit_Record.
+    template<typename Record = Trace, typename Leaf>
+    Record traverse(const Ray& ray, Leaf&& leaf) const;
+    template<typename Leaf> bool traverse_any(const Ray& ray, Leaf&& leaf) const;
+    template<typename Record, typename Leaf>
+    void traverse_packet(const Ray* rays, Record* traces, size_t n, Leaf&& leaf) const;
+
+    const std::vector<Primitive>& prims() const {
+        return primitives;
+    }
+    std::vector<Primitive>& edit_prims() {
+        return primitives;
+    }
+
     BVH copy() const;
     size_t visualize(GL::Lines& lines, GL::Lines& active, size_t level, const Mat4& trans) const;
 
@@ -30,18 +94,51 @@ public:
     void clear();
 
 private:
+    // Nodes are stored depth-first: an interior node's left child directly
+    // follows it, and the index of its right child is kept in start. Leaves
+    // hold primitives [start, start + size), so only interior nodes have size 0.
     class Node {
         BBox bbox;
-        size_t start, size, l, r;
+        uint32_t start, size;
 
         bool is_leaf() const;
         friend class BVH<Primitive>;
     };
-    size_t new_node(BBox box = {}, size_t start = 0, size_t size = 0, size_t l = 0, size_t r = 0);
+    static_assert(sizeof(Node) == 32);
+
+    // The builder falls back to median splits rather than exceed this depth,
+    // which bounds the traversal stacks so they can live on the stack.
+    static constexpr size_t MAX_DEPTH = 64;
+    size_t new_node(BBox box = {}, size_t start = 0, size_t size = 0);
+
+    // Single rays traverse a four-wide copy of the tree, built from the binary
+    // nodes after each build. Child bounds are stored per axis so that one loop
+    // tests all four children. Leaf children have WIDE_LEAF set in child, with
+    // the rest holding their first primitive. Unused slots hold WIDE_LEAF with
+    // a count of zero, and are masked out before their bounds are looked at.
+    struct alignas(64) Wide_Node {
+        float min_x[4], min_y[4], min_z[4], max_x[4], max_y[4], max_z[4];
+        uint32_t child[4], count[4];
+
+        // A leaf starting at the first primitive also has child == WIDE_LEAF
+        bool empty(size_t k) const {
+            return (child[k] & WIDE_LEAF) && count[k] == 0;
+        }
+    };
+    static constexpr uint32_t WIDE_LEAF = 1u << 31;
+    void build_wide();
+    uint32_t collapse(uint32_t node);
+
+    // hit() for primitives with Has_Deferred_Hit
+    Trace hit_deferred(const Ray& ray) const;
 
     std::vector<Node> nodes;
+    std::vector<Wide_Node> wide;
     std::vector<Primitive> primitives;
     size_t root_idx = 0;
+    size_t leaf_size = 1;
+    float build_cost = 0.0f;
+    Build_Stats stats;
 };
 
 } // namespace PT
@@ -51,3 +148,4 @@ private:
 #else
 #include "../student/bvh.inl"
 #endif
+#include "bvh.inl"
@@ -0,0 +1,433 @@
+
+#include "bvh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <type_traits>
+
+namespace PT {
+
+// Primitives that can trace a whole packet themselves (e.g. an Object wrapping
+// another BVH) get the packet forwarded; others are traced one ray at a time.
+template<typename P, typename = void> struct Has_Packet_Hit : std::false_type {};
+template<typename P>
+struct Has_Packet_Hit<P, std::void_t<decltype(std::declval<const P&>().hit_packet(
+                             std::declval<const Ray*>(), std::declval<Trace*>(), size_t(0)))>>
+    : std::true_type {};
+
+template<typename Primitive> void BVH<Primitive>::build_wide() {
+    wide.clear();
+    if(nodes.empty()) return;
+    wide.reserve(nodes.size() / 2 + 1);
+    collapse((uint32_t)root_idx);
+}
+
+template<typename Primitive> uint32_t BVH<Primitive>::collapse(uint32_t idx) {
+
+    // Pull grandchildren up into this node, always opening the largest interior
+    // child, until it has four children or only leaves are left to open.
+    uint32_t kids[4] = {idx};
+    size_t n_kids = 1;
+    while(n_kids < 4) {
+        int open = -1;
+        float area = -1.0f;
+        for(size_t k = 0; k < n_kids; k++) {
+            const Node& kid = nodes[kids[k]];
+            if(!kid.is_leaf() && kid.bbox.surface_area() > area) {
+                open = (int)k;
+                area = kid.bbox.surface_area();
+            }
+        }
+        if(open < 0) break;
+
+        uint32_t parent = kids[open];
+        kids[open] = parent + 1;
+        kids[n_kids++] = nodes[parent].start;
+    }
+
+    uint32_t w = (uint32_t)wide.size();
+    wide.emplace_back();
+    for(size_t k = 0; k < 4; k++) {
+        BBox box = k < n_kids ? nodes[kids[k]].bbox : BBox();
+        wide[w].min_x[k] = box.min.x;
+        wide[w].min_y[k] = box.min.y;
+        wide[w].min_z[k] = box.min.z;
+        wide[w].max_x[k] = box.max.x;
+        wide[w].max_y[k] = box.max.y;
+        wide[w].max_z[k] = box.max.z;
+        wide[w].child[k] = WIDE_LEAF;
+        wide[w].count[k] = 0;
+    }
+
+    // Children are appended after their parent, so the array stays depth-first
+    for(size_t k = 0; k < n_kids; k++) {
+        const Node& kid = nodes[kids[k]];
+        if(kid.is_leaf()) {
+            wide[w].child[k] = WIDE_LEAF | kid.start;
+            wide[w].count[k] = kid.size;
+        } else {
+            uint32_t c = collapse(kids[k]);
+            wide[w].child[k] = c;
+        }
+    }
+    return w;
+}
+
+template<typename Primitive> float BVH<Primitive>::sah_cost() const {
+
+    // Expected cost of tracing a ray that hits the root, counting one unit per
+    // node visited and per primitive tested.
+    if(nodes.empty()) return 0.0f;
+    float cost = 0.0f;
+    for(const Node& node : nodes) {
+        cost += node.bbox.surface_area() * (node.is_leaf() ? node.size : 1.0f);
+    }
+    return cost / std::max(nodes[root_idx].bbox.surface_area(), FLT_MIN);
+}
+
+template<typename Primitive> bool BVH<Primitive>::refit(Thread_Pool* pool) {
+
+    if(nodes.empty()) return true;
+
+    // Leaves are independent, so they are bounded in parallel chunks. Each
+    // interior node then encloses its children, which come after it in the
+    // depth-first order, so one backwards pass visits children first.
+    constexpr size_t chunk_size = 1 << 12;
+    auto leaves = [this](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++) {
+            Node& node = nodes[i];
+            if(!node.is_leaf()) continue;
+            node.bbox = BBox();
+            for(size_t p = node.start; p < node.start + node.size; p++) {
+                node.bbox.enclose(primitives[p].bbox());
+            }
+        }
+    };
+
+    std::vector<std::future<void>> tasks;
+    if(pool) {
+        for(size_t b = chunk_size; b < nodes.size(); b += chunk_size) {
+            size_t e = std::min(nodes.size(), b + chunk_size);
+            tasks.push_back(pool->enqueue([&leaves, b, e]() { leaves(b, e); }));
+        }
+    }
+    leaves(0, pool ? std::min(nodes.size(), chunk_size) : nodes.size());
+    for(auto& task : tasks) {
+        while(task.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            if(!pool->run_one()) std::this_thread::yield();
+        }
+    }
+
+    for(size_t i = nodes.size(); i-- > 0;) {
+        Node& node = nodes[i];
+        if(node.is_leaf()) continue;
+        node.bbox = nodes[i + 1].bbox;
+        node.bbox.enclose(nodes[node.start].bbox);
+    }
+
+    if(sah_cost() > REFIT_LIMIT * build_cost) {
+        std::vector<Primitive> prims = std::move(primitives);
+        build(std::move(prims), leaf_size, pool);
+        return false;
+    }
+    build_wide();
+    return true;
+}
+
+template<typename Primitive>
+template<typename Record, typename Leaf>
+Record BVH<Primitive>::traverse(const Ray& ray, Leaf&& leaf) const {
+
+    Record ret;
+    if(wide.empty()) return ret;
+
+    // Children of each wide node are tested together, then pushed far to near
+    // along with the distance at which the ray enters them, so that anything
+    // behind the closest hit found so far is skipped when popped.
+    float ox = ray.point.x, oy = ray.point.y, oz = ray.point.z;
+    float ix = 1.0f / ray.dir.x, iy = 1.0f / ray.dir.y, iz = 1.0f / ray.dir.z;
+
+    struct Entry {
+        uint32_t child, count;
+        float t;
+    };
+    // Each wide level pushes at most three more entries than it pops
+    Entry stack[3 * MAX_DEPTH + 1];
+    size_t top = 0;
+    stack[top++] = {0, 0, ray.dist_bounds.x};
+
+    while(top > 0) {
+
+        Entry entry = stack[--top];
+        if(ret.hit && entry.t > ret.distance) continue;
+
+        if(entry.child & WIDE_LEAF) {
+            leaf(ray, entry.child & ~WIDE_LEAF, entry.count, ret);
+            continue;
+        }
+
+        const Wide_Node& node = wide[entry.child];
+        float max_t = ret.hit ? ret.distance : ray.dist_bounds.y;
+
+        float t_near[4];
+        bool mask[4];
+        for(size_t k = 0; k < 4; k++) {
+            float x0 = (node.min_x[k] - ox) * ix, x1 = (node.max_x[k] - ox) * ix;
+            float y0 = (node.min_y[k] - oy) * iy, y1 = (node.max_y[k] - oy) * iy;
+            float z0 = (node.min_z[k] - oz) * iz, z1 = (node.max_z[k] - oz) * iz;
+            t_near[k] = std::max(std::max(std::min(x0, x1), std::min(y0, y1)),
+                                 std::max(std::min(z0, z1), ray.dist_bounds.x));
+            float t_far = std::min(std::min(std::max(x0, x1), std::max(y0, y1)),
+                                   std::min(std::max(z0, z1), max_t));
+            mask[k] = !node.empty(k) && t_near[k] <= t_far;
+        }
+
+        size_t first = top;
+        for(size_t k = 0; k < 4; k++) {
+            if(mask[k]) stack[top++] = {node.child[k], node.count[k], t_near[k]};
+        }
+        assert(top <= 3 * MAX_DEPTH + 1);
+        std::sort(stack + first, stack + top,
+                  [](const Entry& a, const Entry& b) { return a.t > b.t; });
+    }
+    return ret;
+}
+
+template<typename Primitive>
+template<typename Leaf>
+bool BVH<Primitive>::traverse_any(const Ray& ray, Leaf&& leaf) const {
+
+    if(wide.empty()) return false;
+
+    // Any hit will do, so children are visited in whatever order they come
+    float ox = ray.point.x, oy = ray.point.y, oz = ray.point.z;
+    float ix = 1.0f / ray.dir.x, iy = 1.0f / ray.dir.y, iz = 1.0f / ray.dir.z;
+
+    std::pair<uint32_t, uint32_t> stack[3 * MAX_DEPTH + 1];
+    size_t top = 0;
+    stack[top++] = {0, 0};
+
+    while(top > 0) {
+
+        auto [child, count] = stack[--top];
+
+        if(child & WIDE_LEAF) {
+            if(leaf(ray, child & ~WIDE_LEAF, count)) return true;
+            continue;
+        }
+
+        const Wide_Node& node = wide[child];
+        for(size_t k = 0; k < 4; k++) {
+            if(node.empty(k)) continue;
+            float x0 = (node.min_x[k] - ox) * ix, x1 = (node.max_x[k] - ox) * ix;
+            float y0 = (node.min_y[k] - oy) * iy, y1 = (node.max_y[k] - oy) * iy;
+            float z0 = (node.min_z[k] - oz) * iz, z1 = (node.max_z[k] - oz) * iz;
+            float t_near = std::max(std::max(std::min(x0, x1), std::min(y0, y1)),
+                                    std::max(std::min(z0, z1), ray.dist_bounds.x));
+            float t_far = std::min(std::min(std::max(x0, x1), std::max(y0, y1)),
+                                   std::min(std::max(z0, z1), ray.dist_bounds.y));
+            if(t_near <= t_far) stack[top++] = {node.child[k], node.count[k]};
+        }
+        assert(top <= 3 * MAX_DEPTH + 1);
+    }
+    return false;
+}
+
+template<typename Primitive> bool BVH<Primitive>::occluded(const Ray& ray) const {
+    return traverse_any(ray, [this](const Ray& r, size_t start, size_t size) {
+        for(size_t p = start; p < start + size; p++) {
+            if(primitives[p].occluded(r)) return true;
+        }
+        return false;
+    });
+}
+
+template<typename Primitive>
+void BVH<Primitive>::hit(const std::vector<Ray>& rays, std::vector<Trace>& traces) const {
+    traces.resize(rays.size());
+    for(size_t i = 0; i < rays.size(); i += PACKET_SIZE) {
+        hit_packet(&rays[i], &traces[i], std::min(PACKET_SIZE, rays.size() - i));
+    }
+}
+
+template<typename Primitive>
+void BVH<Primitive>::hit_stream(const std::vector<Ray>& rays, std::vector<Trace>& traces) const {
+
+    // Bucket rays by the signs of their direction, so each packet shares an
+    // octant and tends to visit the same nodes in the same order
+    std::vector<size_t> order(rays.size());
+    size_t counts[9] = {};
+    auto octant = [](const Ray& r) {
+        return (r.dir.x < 0.0f ? 1 : 0) | (r.dir.y < 0.0f ? 2 : 0) | (r.dir.z < 0.0f ? 4 : 0);
+    };
+    for(const Ray& r : rays) counts[octant(r) + 1]++;
+    for(size_t o = 1; o < 9; o++) counts[o] += counts[o - 1];
+    for(size_t i = 0; i < rays.size(); i++) order[counts[octant(rays[i])]++] = i;
+
+    traces.resize(rays.size());
+
+    Ray packet[PACKET_SIZE];
+    Trace results[PACKET_SIZE];
+    for(size_t i = 0; i < order.size(); i += PACKET_SIZE) {
+        size_t n = std::min(PACKET_SIZE, order.size() - i);
+        for(size_t j = 0; j < n; j++) {
+            packet[j] = rays[order[i + j]];
+            results[j] = traces[order[i + j]];
+        }
+        hit_packet(packet, results, n);
+        for(size_t j = 0; j < n; j++) traces[order[i + j]] = results[j];
+    }
+}
+
+template<typename Primitive> Trace BVH<Primitive>::hit_deferred(const Ray& ray) const {
+    auto leaf = [this](const Ray& ray, size_t start, size_t size, Hit_Record& rec) {
+        for(size_t p = start; p < start + size; p++) primitives[p].closest(ray, rec, (uint32_t)p);
+    };
+    Hit_Record rec = traverse<Hit_Record>(ray, leaf);
+    return rec.hit ? primitives[rec.prim].surface(ray, rec) : Trace{};
+}
+
+template<typename Primitive>
+void BVH<Primitive>::hit_packet(const Ray* rays, Trace* traces, size_t n) const {
+
+    // Records start out clipped to the traces' hits, so any they end up with is
+    // closer, and only those get a full Trace built.
+    if constexpr(Has_Deferred_Hit<Primitive>::value) {
+        Hit_Record recs[PACKET_SIZE];
+        for(size_t i = 0; i < n; i++) {
+            recs[i].hit = traces[i].hit;
+            recs[i].distance = traces[i].distance;
+        }
+        auto leaf = [this](const Ray* active, Hit_Record* found, size_t m, size_t start,
+                           size_t size) {
+            for(size_t p = start; p < start + size; p++) {
+                primitives[p].closest_packet(active, found, m, (uint32_t)p);
+            }
+        };
+        traverse_packet(rays, recs, n, leaf);
+        for(size_t i = 0; i < n; i++) {
+            if(recs[i].prim != Hit_Record::none) {
+                traces[i] = primitives[recs[i].prim].surface(rays[i], recs[i]);
+            }
+        }
+        return;
+    }
+
+    auto leaf = [this](const Ray* active, Trace* found, size_t m, size_t start, size_t size) {
+        for(size_t p = start; p < start + size; p++) {
+            if constexpr(Has_Packet_Hit<Primitive>::value) {
+                primitives[p].hit_packet(active, found, m);
+                for(size_t j = 0; j < m; j++) {
+                    if(found[j].hit) active[j].dist_bounds.y = found[j].distance;
+                }
+            } else {
+                for(size_t j = 0; j < m; j++) {
+                    found[j] = Trace::min(found[j], primitives[p].hit(active[j]));
+                    if(found[j].hit) active[j].dist_bounds.y = found[j].distance;
+                }
+            }
+        }
+    };
+    traverse_packet(rays, traces, n, leaf);
+}
+
+template<typename Primitive>
+template<typename Record, typename Leaf>
+void BVH<Primitive>::traverse_packet(const Ray* rays, Record* traces, size_t n,
+                                     Leaf&& leaf) const {
+
+    assert(n <= PACKET_SIZE);
+    if(nodes.empty() || n == 0) return;
+
+    // Ray data is kept as structure-of-arrays so that each box test below runs
+    // over the whole packet in straight-line code the compiler can vectorize.
+    // Unused lanes get an empty interval and never report a hit.
+    float ox[PACKET_SIZE], oy[PACKET_SIZE], oz[PACKET_SIZE];
+    float ix[PACKET_SIZE], iy[PACKET_SIZE], iz[PACKET_SIZE];
+    float tmin[PACKET_SIZE], tmax[PACKET_SIZE];
+    bool mask[PACKET_SIZE];
+
+    for(size_t i = 0; i < PACKET_SIZE; i++) {
+        const Ray& r = rays[i < n ? i : 0];
+        ox[i] = r.point.x;
+        oy[i] = r.point.y;
+        oz[i] = r.point.z;
+        ix[i] = 1.0f / r.dir.x;
+        iy[i] = 1.0f / r.dir.y;
+        iz[i] = 1.0f / r.dir.z;
+        tmin[i] = i < n ? r.dist_bounds.x : FLT_MAX;
+        tmax[i] = i < n ? r.dist_bounds.y : -FLT_MAX;
+        if(i < n && traces[i].hit) tmax[i] = std::min(tmax[i], traces[i].distance);
+    }
+
+    auto test = [&](const BBox& box) {
+        bool any = false;
+        for(size_t i = 0; i < PACKET_SIZE; i++) {
+            float x0 = (box.min.x - ox[i]) * ix[i], x1 = (box.max.x - ox[i]) * ix[i];
+            float y0 = (box.min.y - oy[i]) * iy[i], y1 = (box.max.y - oy[i]) * iy[i];
+            float z0 = (box.min.z - oz[i]) * iz[i], z1 = (box.max.z - oz[i]) * iz[i];
+            float t_near = std::max(std::max(std::min(x0, x1), std::min(y0, y1)),
+                                    std::max(std::min(z0, z1), tmin[i]));
+            float t_far = std::min(std::min(std::max(x0, x1), std::max(y0, y1)),
+                                   std::min(std::max(z0, z1), tmax[i]));
+            mask[i] = t_near <= t_far;
+            any |= mask[i];
+        }
+        return any;
+    };
+
+    Ray active[PACKET_SIZE];
+    Record found[PACKET_SIZE];
+    size_t lane[PACKET_SIZE];
+
+    // Each level pushes two children and pops their parent
+    size_t stack[MAX_DEPTH + 1];
+    size_t top = 0;
+    stack[top++] = root_idx;
+
+    while(top > 0) {
+
+        size_t idx = stack[--top];
+        const Node& node = nodes[idx];
+
+        if(!test(node.bbox)) continue;
+
+        if(node.is_leaf()) {
+
+            // Gather the rays that reached this leaf, clipped to their closest hit so far
+            size_t m = 0;
+            for(size_t i = 0; i < n; i++) {
+                if(!mask[i]) continue;
+                active[m] = rays[i];
+                active[m].dist_bounds.y = tmax[i];
+                found[m] = traces[i];
+                lane[m++] = i;
+            }
+
+            leaf(active, found, m, node.start, node.size);
+
+            for(size_t j = 0; j < m; j++) {
+                traces[lane[j]] = found[j];
+                if(found[j].hit) tmax[lane[j]] = std::min(tmax[lane[j]], found[j].distance);
+            }
+
+        } else {
+
+            // Visit the child nearer to the packet first, judged along the first
+            // active ray, so later boxes are more likely to be culled by tmax
+            size_t first = 0;
+            while(first < n && !mask[first]) first++;
+            Vec3 dir = rays[first].dir;
+            size_t l = idx + 1, r = node.start;
+            float l_dist = dot(nodes[l].bbox.center(), dir);
+            float r_dist = dot(nodes[r].bbox.center(), dir);
+
+            assert(top + 2 <= MAX_DEPTH + 1);
+            stack[top++] = l_dist < r_dist ? r : l;
+            stack[top++] = l_dist < r_dist ? l : r;
+        }
+    }
+}
+
+} // namespace PT
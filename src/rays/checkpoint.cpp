@@ -0,0 +1,112 @@
+
+#include "checkpoint.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+namespace PT {
+
+bool Checkpoint::Tile::overlaps(const Tile& o) const {
+    return x < o.x + o.w && o.x < x + w && y < o.y + o.h && o.y < y + h;
+}
+
+std::string Checkpoint::save(const std::string& path) {
+
+    static_assert(sizeof(Spectrum) == 3 * sizeof(float));
+
+    header.tiles = tiles.size();
+
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if(!out.is_open()) return "Could not open " + temp + " for writing.";
+        out.write((const char*)&header, sizeof(header));
+
+        for(const Tile& tile : tiles) {
+            uint64_t bounds[] = {tile.x, tile.y, tile.w, tile.h, tile.samples, tile.layer_samples};
+            out.write((const char*)bounds, sizeof(bounds));
+            auto write = [&out](const auto& buffer) {
+                out.write((const char*)buffer.data(), buffer.size() * sizeof(buffer[0]));
+            };
+            write(tile.sums);
+            write(tile.sums_sq);
+            write(tile.layer_sums);
+            write(tile.depth);
+            write(tile.object);
+            write(tile.material);
+        }
+        if(!out.good()) return "Failed to write " + temp + ".";
+    }
+    std::remove(path.c_str());
+    if(std::rename(temp.c_str(), path.c_str())) return "Failed to rename " + temp + ".";
+    return {};
+}
+
+std::string Checkpoint::load(const std::string& path, const Header& expected, bool first_hits,
+                             const std::vector<Tile>& merged) {
+
+    std::ifstream in(path, std::ios::binary);
+    if(!in.is_open()) return "Could not open " + path + ".";
+
+    Header file;
+    in.read((char*)&file, sizeof(file));
+    if(!in.good() || std::memcmp(file.magic, expected.magic, sizeof(file.magic)))
+        return path + " is not a checkpoint.";
+    if(file.w != expected.w || file.h != expected.h)
+        return path + " was saved at a different resolution.";
+    if(file.hash != expected.hash)
+        return path + " was saved from a different scene, camera or render settings.";
+    if(file.seed != expected.seed || file.sequence != expected.sequence)
+        return path + " was saved with a different seed or sampler.";
+    if(file.wavefront != expected.wavefront)
+        return path + " was saved with a different integrator.";
+    if(file.noise_threshold != expected.noise_threshold)
+        return path + " was saved with a different noise threshold.";
+    if(file.layers != expected.layers || file.layer_colors != expected.layer_colors)
+        return path + " was saved with different render layers.";
+    if(file.tiles > file.w * file.h) return path + " is corrupt.";
+
+    // Read everything before changing anything, so a bad file leaves no trace
+    std::vector<Tile> loaded(file.tiles);
+    for(size_t i = 0; i < loaded.size(); i++) {
+        Tile& tile = loaded[i];
+        uint64_t bounds[6];
+        in.read((char*)bounds, sizeof(bounds));
+        tile.x = bounds[0];
+        tile.y = bounds[1];
+        tile.w = bounds[2];
+        tile.h = bounds[3];
+        tile.samples = bounds[4];
+        tile.layer_samples = bounds[5];
+        if(!in.good() || tile.x + tile.w > file.w || tile.y + tile.h > file.h)
+            return path + " is corrupt.";
+        for(size_t k = 0; k < i; k++) {
+            if(tile.overlaps(loaded[k])) return path + " is corrupt.";
+        }
+        for(const Tile& other : merged) {
+            if(tile.overlaps(other)) return path + " overlaps a region that is already merged.";
+        }
+
+        size_t n = tile.w * tile.h;
+        auto read = [&in](auto& buffer, size_t size) {
+            buffer.resize(size);
+            in.read((char*)buffer.data(), size * sizeof(buffer[0]));
+        };
+        read(tile.sums, n);
+        read(tile.sums_sq, n);
+        read(tile.layer_sums, n * file.layer_colors);
+        if(first_hits) {
+            read(tile.depth, n);
+            read(tile.object, n);
+            read(tile.material, n);
+        }
+        if(!in.good()) return path + " is truncated.";
+    }
+
+    header = file;
+    tiles = std::move(loaded);
+    return {};
+}
+
+} // namespace PT
@@ -0,0 +1,60 @@
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "../lib/spectrum.h"
+
+namespace PT {
+
+// The accumulated samples and layers of a render, as saved to resume or merge
+// it later. The file holds the header, then for each tile its bounds and sample
+// counts followed by its pixels' sums and sums of squares, then the sums of its
+// color layers and its first-hit layers, all in the writer's byte order. The
+// header records which layers there are, as a bit for each in the order of
+// Layers, and the settings that decide which samples are taken: a resumed render
+// only comes out the same as an uninterrupted one if it draws from the same
+// sequence and seed, traces with the same integrator and converges at the same
+// threshold.
+struct Checkpoint {
+    struct Header {
+        char magic[8] = {'C', '3', 'D', 'C', 'K', 'P', 'T', '4'};
+        uint64_t hash = 0;
+        uint64_t w = 0, h = 0, tiles = 0;
+        uint64_t layers = 0, layer_colors = 0;
+        uint32_t seed = 0, sequence = 0, wavefront = 0;
+        float noise_threshold = 0.0f;
+    };
+
+    // A tile's pixels, row by row, with layer_colors layer sums per pixel. The
+    // first-hit layers are empty unless the header selects them.
+    struct Tile {
+        uint64_t x = 0, y = 0, w = 0, h = 0;
+        uint64_t samples = 0, layer_samples = 0;
+        std::vector<Spectrum> sums, layer_sums;
+        std::vector<float> sums_sq, depth, object, material;
+
+        bool overlaps(const Tile& other) const;
+    };
+
+    Header header;
+    std::vector<Tile> tiles;
+
+    // Sets header.tiles and writes the checkpoint aside, then renames it into
+    // place, so that being killed mid-write leaves the previous one intact.
+    // Returns an error message, or an empty string on success.
+    std::string save(const std::string& path);
+
+    // Reads a checkpoint saved with the expected header (its tile count aside),
+    // with first-hit layers if first_hits. Each pixel's sums come from a single
+    // tile, so a file whose tiles overlap each other, or one of merged, such as
+    // a band merged twice, is refused rather than counting samples twice.
+    // Returns an error message, or an empty string on success; on failure, the
+    // checkpoint is left as it was.
+    std::string load(const std::string& path, const Header& expected, bool first_hits,
+                     const std::vector<Tile>& merged = {});
+};
+
+} // namespace PT
@@ -0,0 +1,127 @@
+
+#include "denoise.h"
+
+#include <thread>
+
+namespace PT {
+
+void AOVs::resize(size_t width, size_t height) {
+    w = width;
+    h = height;
+    albedo.assign(w * h, Spectrum{});
+    normal.assign(w * h, Vec3{});
+    depth.assign(w * h, 0.0f);
+}
+
+namespace {
+
+constexpr int passes = 5;
+constexpr float kernel[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+
+// How strongly each feature's differences stop the filter: luminance by multiples
+// of its standard deviation, normals by a power of their cosine, depth relative
+// to the distance it is taken at, and albedo by squared difference.
+constexpr float sigma_luma = 4.0f, sigma_normal = 64.0f, sigma_depth = 0.02f,
+                sigma_albedo = 0.02f;
+
+// Lighting is divided by an albedo of at least this, so that dark surfaces don't
+// amplify their noise
+constexpr float min_albedo = 0.01f;
+
+Spectrum demodulation(Spectrum albedo) {
+    if(albedo.luma() < min_albedo) return Spectrum(1.0f);
+    return Spectrum(std::max(albedo.r, min_albedo), std::max(albedo.g, min_albedo),
+                    std::max(albedo.b, min_albedo));
+}
+
+} // namespace
+
+void denoise(const Spectrum* color, const float* variance, const AOVs& aovs, Spectrum* out,
+             Thread_Pool* pool) {
+
+    size_t w = aovs.w, h = aovs.h, n = w * h;
+    if(!n) return;
+
+    std::vector<Spectrum> light(n), next(n), factor(n);
+    std::vector<float> var(n), next_var(n);
+    for(size_t i = 0; i < n; i++) {
+        factor[i] = demodulation(aovs.albedo[i]);
+        light[i] = Spectrum(color[i].r / factor[i].r, color[i].g / factor[i].g,
+                            color[i].b / factor[i].b);
+        float scale = factor[i].luma();
+        var[i] = variance[i] / (scale * scale);
+    }
+
+    // One pass of the filter over rows [begin, end), from light into next
+    auto filter = [&](int step, size_t begin, size_t end) {
+        for(size_t y = begin; y < end; y++) {
+            for(size_t x = 0; x < w; x++) {
+
+                size_t p = y * w + x;
+                float luma_p = light[p].luma();
+                float sigma_l = sigma_luma * std::sqrt(std::max(var[p], 0.0f)) + 1e-4f;
+                Vec3 normal_p = aovs.normal[p];
+                bool surface_p = normal_p.norm_squared() > 0.0f;
+                float sigma_z = sigma_depth * step * aovs.depth[p] + 1e-4f;
+
+                Spectrum sum;
+                float weights = 0.0f, sum_var = 0.0f;
+                for(int dy = -2; dy <= 2; dy++) {
+                    long qy = (long)y + dy * step;
+                    if(qy < 0 || qy >= (long)h) continue;
+                    for(int dx = -2; dx <= 2; dx++) {
+                        long qx = (long)x + dx * step;
+                        if(qx < 0 || qx >= (long)w) continue;
+                        size_t q = qy * w + qx;
+
+                        // Pixels that see a surface are only mixed with others that do
+                        Vec3 normal_q = aovs.normal[q];
+                        bool surface_q = normal_q.norm_squared() > 0.0f;
+                        if(surface_p != surface_q) continue;
+
+                        float weight = kernel[dx + 2] * kernel[dy + 2];
+                        if(surface_p) {
+                            float cos = std::max(dot(normal_p, normal_q), 0.0f);
+                            weight *= std::pow(cos, sigma_normal);
+                            weight *= std::exp(-std::abs(aovs.depth[p] - aovs.depth[q]) / sigma_z);
+                            Spectrum da = aovs.albedo[p] - aovs.albedo[q];
+                            weight *= std::exp(-(da.r * da.r + da.g * da.g + da.b * da.b) /
+                                               sigma_albedo);
+                        }
+                        weight *= std::exp(-std::abs(luma_p - light[q].luma()) / sigma_l);
+
+                        sum += weight * light[q];
+                        weights += weight;
+                        sum_var += weight * weight * var[q];
+                    }
+                }
+
+                // The center always has weight, so weights is never zero
+                next[p] = sum * (1.0f / weights);
+                next_var[p] = sum_var / (weights * weights);
+            }
+        }
+    };
+
+    size_t n_threads = pool ? std::max(std::thread::hardware_concurrency(), 1u) : 1;
+    size_t rows = (h + n_threads - 1) / n_threads;
+
+    for(int pass = 0; pass < passes; pass++) {
+        int step = 1 << pass;
+        if(pool) {
+            for(size_t y = 0; y < h; y += rows) {
+                size_t end = std::min(y + rows, h);
+                pool->enqueue([&filter, step, y, end]() { filter(step, y, end); });
+            }
+            pool->wait();
+        } else {
+            filter(step, 0, h);
+        }
+        std::swap(light, next);
+        std::swap(var, next_var);
+    }
+
+    for(size_t i = 0; i < n; i++) out[i] = light[i] * factor[i];
+}
+
+} // namespace PT
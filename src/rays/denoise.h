@@ -0,0 +1,35 @@
+
+#pragma once
+
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../lib/spectrum.h"
+#include "../util/thread_pool.h"
+
+namespace PT {
+
+// Arbitrary output variables: the albedo, normal and distance of the surfaces
+// first seen through each pixel of the output, averaged over a few rays per
+// pixel. Pixels that see no surface have zero in each.
+struct AOVs {
+    size_t w = 0, h = 0;
+    std::vector<Spectrum> albedo;
+    std::vector<Vec3> normal;
+    std::vector<float> depth;
+
+    void resize(size_t w, size_t h);
+};
+
+// Denoises the image color, whose pixels' luminance has the given variance, into
+// out, guided by the image's AOVs. This is an edge-avoiding a-trous wavelet filter
+// (Dammertz et al. 2010) with the variance-driven luminance weights of SVGF
+// (Schied et al. 2017): each pass spreads a 5x5 kernel twice as far as the last,
+// so a few passes cover a wide window, while the weights stop it from blurring
+// across edges in normal, depth or albedo, or between pixels whose difference is
+// more than their noise. Lighting is filtered divided by albedo, so textures stay
+// sharp. The rows of each pass are split over pool's threads, when given.
+void denoise(const Spectrum* color, const float* variance, const AOVs& aovs, Spectrum* out,
+             Thread_Pool* pool);
+
+} // namespace PT
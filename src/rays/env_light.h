@@ -19,6 +19,7 @@ struct Env_Hemisphere {
 
     Light_Sample sample() const;
     Spectrum sample_direction(Vec3 dir) const;
+    float pdf(Vec3 dir) const;
 
     Spectrum radiance;
     Samplers::Hemisphere::Uniform sampler;
@@ -31,6 +32,7 @@ struct Env_Sphere {
 
     Light_Sample sample() const;
     Spectrum sample_direction(Vec3 dir) const;
+    float pdf(Vec3 dir) const;
 
     Spectrum radiance;
     Samplers::Sphere::Uniform sampler;
@@ -43,6 +45,7 @@ struct Env_Map {
 
     Light_Sample sample() const;
     Spectrum sample_direction(Vec3 dir) const;
+    float pdf(Vec3 dir) const;
 
     HDR_Image image;
     Samplers::Sphere::Image sampler;
@@ -77,10 +80,21 @@ public:
             underlying);
     }
 
+    // The density with which sample() gives dir
+    float pdf(Vec3 dir) const {
+        return std::visit([&dir](const auto& l) { return l.pdf(dir); }, underlying);
+    }
+
     bool is_discrete() const {
         return false;
     }
 
+    // Call f with the underlying light, so that many samples can be taken from
+    // it without dispatching each one
+    template<typename F> decltype(auto) visit(F&& f) const {
+        return std::visit(std::forward<F>(f), underlying);
+    }
+
 private:
     std::variant<Env_Hemisphere, Env_Sphere, Env_Map> underlying;
 };
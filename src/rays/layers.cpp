@@ -0,0 +1,213 @@
+
+#include "pathtracer.h"
+
+#include <sf_libs/tinyexr.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <set>
+#include <sstream>
+
+namespace PT {
+
+std::string Layers::parse(const std::string& list) {
+
+    *this = {};
+    std::stringstream in(list);
+    std::string name;
+    while(std::getline(in, name, ',')) {
+        if(name == "direct") {
+            direct = true;
+        } else if(name == "indirect") {
+            indirect = true;
+        } else if(name == "lights") {
+            lights = true;
+        } else if(name == "depth") {
+            depth = true;
+        } else if(name == "object") {
+            object = true;
+        } else if(name == "material") {
+            material = true;
+        } else if(!name.empty()) {
+            return "Unknown layer " + name +
+                   " (expected direct, indirect, lights, depth, object or material)";
+        }
+    }
+    return {};
+}
+
+void Pathtracer::set_layers(const Layers& selected) {
+    layers = selected;
+}
+
+void Pathtracer::start_layers() {
+
+    size_t colors = 0;
+    size_t direct = layers.direct ? colors++ : no_layer;
+    size_t indirect = layers.indirect ? colors++ : no_layer;
+    size_t light = layers.lights && !group_names.empty() ? colors : no_layer;
+    if(light != no_layer) colors += group_names.size();
+
+    // Samples split another way can't be added to, so those layers start over
+    if(colors != layer_colors || direct != direct_layer || indirect != indirect_layer ||
+       light != light_layer || layer_accumulator.size() != out_w * out_h * colors) {
+        layer_colors = colors;
+        direct_layer = direct;
+        indirect_layer = indirect;
+        light_layer = light;
+        layer_accumulator.assign(out_w * out_h * colors, Spectrum{});
+        for(Tile& tile : tiles) tile.layer_samples = 0;
+    }
+
+    size_t first_hits = layers.depth || layers.object || layers.material ? out_w * out_h : 0;
+    if(layer_depth.size() != first_hits) {
+        layer_depth.assign(first_hits, FLT_MAX);
+        layer_object.assign(first_hits, 0.0f);
+        layer_material.assign(first_hits, 0.0f);
+    }
+}
+
+void Pathtracer::clear_layers() {
+    std::fill(layer_accumulator.begin(), layer_accumulator.end(), Spectrum{});
+    std::fill(layer_depth.begin(), layer_depth.end(), FLT_MAX);
+    std::fill(layer_object.begin(), layer_object.end(), 0.0f);
+    std::fill(layer_material.begin(), layer_material.end(), 0.0f);
+    for(Tile& tile : tiles) tile.layer_samples = 0;
+}
+
+void Pathtracer::trace_first_hits(const Tile& tile) {
+
+    // trace_pixel only returns radiance, so sample 0's camera ray is made again
+    // here as the wavefront integrator makes it
+    Vec2 wh((float)out_w, (float)out_h);
+    for(size_t y = tile.y; y < tile.y + tile.h; y++) {
+        for(size_t x = tile.x; x < tile.x + tile.w; x++) {
+            size_t idx = y * out_w + x;
+            RNG::begin_sample(sequence, seed, idx, 0);
+            Vec2 xy((float)x + RNG::unit(), (float)y + RNG::unit());
+            store_first_hit(idx, scene.hit(camera.generate_ray(xy / wh)));
+        }
+    }
+}
+
+void Pathtracer::store_first_hit(size_t idx, const Trace& hit) {
+    layer_depth[idx] = hit.hit ? hit.distance : FLT_MAX;
+    layer_object[idx] = hit.hit ? (float)hit.object : 0.0f;
+    layer_material[idx] = hit.hit ? (float)(hit.material + 1) : 0.0f;
+}
+
+std::string Pathtracer::save_exr(const std::string& path) {
+
+    const HDR_Image& image = get_output();
+    size_t n = out_w * out_h;
+
+    // The means of the color layers, copied under each tile's lock as checkpoints are
+    std::vector<Spectrum> means(n * layer_colors);
+    for(Tile& tile : tiles) {
+        std::lock_guard<std::mutex> lock(tile.mut);
+        float scale = tile.layer_samples ? 1.0f / tile.layer_samples : 0.0f;
+        for(size_t j = tile.y; j < tile.y + tile.h; j++) {
+            size_t begin = (j * out_w + tile.x) * layer_colors;
+            for(size_t i = begin; i < begin + tile.w * layer_colors; i++) {
+                means[i] = layer_accumulator[i] * scale;
+            }
+        }
+    }
+
+    // EXR images start at the top row, where ours start at the bottom
+    struct Channel {
+        std::string name;
+        bool full = false;
+        std::vector<float> pixels;
+    };
+    std::vector<Channel> channels;
+    auto add = [&](std::string name, bool full, const auto& value) {
+        Channel& c = channels.emplace_back();
+        c.name = std::move(name);
+        c.full = full;
+        c.pixels.resize(n);
+        for(size_t j = 0; j < out_h; j++) {
+            for(size_t i = 0; i < out_w; i++) {
+                c.pixels[(out_h - j - 1) * out_w + i] = value(j * out_w + i);
+            }
+        }
+    };
+    auto add_color = [&](const std::string& prefix, const auto& color) {
+        add(prefix + "R", false, [&](size_t i) { return color(i).r; });
+        add(prefix + "G", false, [&](size_t i) { return color(i).g; });
+        add(prefix + "B", false, [&](size_t i) { return color(i).b; });
+    };
+    auto add_layer = [&](const std::string& layer, size_t slot) {
+        add_color(layer + ".", [&](size_t i) { return means[i * layer_colors + slot]; });
+    };
+
+    add_color("", [&](size_t i) { return image.at(i); });
+    if(direct_layer != no_layer) add_layer("direct", direct_layer);
+    if(indirect_layer != no_layer) add_layer("indirect", indirect_layer);
+
+    // Channel names have to be unique and fit in 31 characters, so light names
+    // are cut short, and numbered if that leaves them empty or taken
+    if(light_layer != no_layer) {
+        std::set<std::string> used;
+        for(size_t g = 0; g < group_names.size(); g++) {
+            std::string name = group_names[g].substr(0, 20);
+            for(char& c : name) {
+                if(!std::isalnum((unsigned char)c) && c != '-') c = '_';
+            }
+            if(name.empty() || !used.insert(name).second) {
+                name = name.substr(0, 12) + "_" + std::to_string(g);
+                used.insert(name);
+            }
+            add_layer("light." + name, light_layer + g);
+        }
+    }
+
+    if(!layer_depth.empty()) {
+        if(layers.depth) add("depth.Z", true, [&](size_t i) { return layer_depth[i]; });
+        if(layers.object) add("object.id", true, [&](size_t i) { return layer_object[i]; });
+        if(layers.material) {
+            add("material.id", true, [&](size_t i) { return layer_material[i]; });
+        }
+    }
+
+    // OpenEXR keeps channels sorted by name
+    std::sort(channels.begin(), channels.end(),
+              [](const Channel& a, const Channel& b) { return a.name < b.name; });
+
+    std::vector<EXRChannelInfo> channel_info(channels.size());
+    std::vector<int> types(channels.size(), TINYEXR_PIXELTYPE_FLOAT), requested(channels.size());
+    std::vector<unsigned char*> images(channels.size());
+    for(size_t c = 0; c < channels.size(); c++) {
+        char* name = channel_info[c].name;
+        std::snprintf(name, sizeof(channel_info[c].name), "%s", channels[c].name.c_str());
+        requested[c] = channels[c].full ? TINYEXR_PIXELTYPE_FLOAT : TINYEXR_PIXELTYPE_HALF;
+        images[c] = (unsigned char*)channels[c].pixels.data();
+    }
+
+    EXRHeader header;
+    InitEXRHeader(&header);
+    header.num_channels = (int)channels.size();
+    header.channels = channel_info.data();
+    header.pixel_types = types.data();
+    header.requested_pixel_types = requested.data();
+    header.compression_type = out_w < 16 && out_h < 16 ? TINYEXR_COMPRESSIONTYPE_NONE
+                                                       : TINYEXR_COMPRESSIONTYPE_ZIP;
+
+    EXRImage exr;
+    InitEXRImage(&exr);
+    exr.num_channels = (int)channels.size();
+    exr.images = images.data();
+    exr.width = (int)out_w;
+    exr.height = (int)out_h;
+
+    const char* err = nullptr;
+    if(SaveEXRImageToFile(&exr, &header, path.c_str(), &err) != TINYEXR_SUCCESS) {
+        std::string err_s = err ? err : "unknown failure";
+        if(err) FreeEXRErrorMessage(err);
+        return "Failed to write " + path + ": " + err_s;
+    }
+    return {};
+}
+
+} // namespace PT
@@ -0,0 +1,33 @@
+
+#pragma once
+
+#include <string>
+
+namespace PT {
+
+// Render layers (AOVs) accumulated alongside the image for compositing. The light
+// layers split each sample's radiance by where it came from: direct holds what
+// reached the camera after at most one bounce, emitters seen directly included,
+// and indirect the rest, so the two sum to the image. lights holds a layer per
+// scene light, plus one for the environment. depth (the distance to the camera),
+// object and material (IDs, zero where nothing was hit) are taken unfiltered from
+// the first hit of each pixel's first sample.
+struct Layers {
+    bool direct = false, indirect = false, lights = false;
+    bool depth = false, object = false, material = false;
+
+    bool any() const {
+        return direct || indirect || lights || depth || object || material;
+    }
+
+    // Whether any layer splits the radiance, which only the wavefront integrator does
+    bool splits() const {
+        return direct || indirect || lights;
+    }
+
+    // Selects the layers named in a comma-separated list. Returns an error
+    // message, or an empty string on success.
+    std::string parse(const std::string& list);
+};
+
+} // namespace PT
@@ -1,5 +1,6 @@
 
 #include "light.h"
+#include "../util/rand.h"
 
 namespace PT {
 
@@ -40,9 +41,9 @@ Light_Sample Rect_Light::sample(Vec3 from) const {
     Vec3 point(sample.x - size.x / 2.0f, 0.0f, sample.y - size.y / 2.0f);
     Vec3 dir = point - from;
 
-    float cos_theta = dir.y;
     float squared_dist = dir.norm_squared();
     float dist = std::sqrt(squared_dist);
+    float cos_theta = dir.y / dist;
 
     ret.direction = dir / dist;
     ret.distance = dist;
@@ -51,4 +52,89 @@ Light_Sample Rect_Light::sample(Vec3 from) const {
     return ret;
 }
 
+float Rect_Light::pdf(Vec3 from, Vec3 point) const {
+
+    // Only samples seen from below give off light
+    Vec3 dir = point - from;
+    float squared_dist = dir.norm_squared();
+    float cos_theta = dir.y / std::sqrt(squared_dist);
+    if(cos_theta <= 0.0f) return 0.0f;
+    return squared_dist / (size.x * size.y * cos_theta);
+}
+
+Light_Sample Tri_Light::sample(Vec3 from) const {
+    Light_Sample ret;
+
+    // Uniform over the triangle's area
+    float s = std::sqrt(RNG::unit());
+    Vec3 point = v0 + (1.0f - s) * e1 + (s * RNG::unit()) * e2;
+    Vec3 dir = point - from;
+
+    Vec3 normal = cross(e1, e2);
+    float area = normal.norm() / 2.0f;
+    float squared_dist = dir.norm_squared();
+    float dist = std::sqrt(squared_dist);
+    float cos_theta = std::abs(dot(normal.unit(), dir)) / dist;
+
+    ret.direction = dir / dist;
+    ret.distance = dist;
+    ret.pdf = squared_dist / (area * cos_theta);
+    ret.radiance = radiance;
+    return ret;
+}
+
+float Tri_Light::pdf(Vec3 from, Vec3 point) const {
+
+    Vec3 dir = point - from;
+    Vec3 normal = cross(e1, e2);
+    float area = normal.norm() / 2.0f;
+    float squared_dist = dir.norm_squared();
+    float cos_theta = std::abs(dot(normal.unit(), dir)) / std::sqrt(squared_dist);
+    if(cos_theta <= 0.0f) return 0.0f;
+    return squared_dist / (area * cos_theta);
+}
+
+Light_Bounds Light::bounds() const {
+
+    Light_Bounds ret;
+    Vec3 position = trans * Vec3(0.0f);
+
+    std::visit(
+        overloaded{
+            [&](const Directional_Light&) { ret.bounded = false; },
+            [&](const Point_Light& l) {
+                ret.box.enclose(position);
+                ret.intensity = l.radiance.luma();
+            },
+            [&](const Spot_Light& l) {
+                ret.box.enclose(position);
+                ret.axis = trans.rotate(Vec3(0.0f, 1.0f, 0.0f)).unit();
+                ret.theta_o = std::min(Radians(l.angle_bounds.x / 2.0f), PI_F);
+                ret.theta_e = std::max(Radians((l.angle_bounds.y - l.angle_bounds.x) / 2.0f), 0.0f);
+                ret.intensity = l.radiance.luma();
+            },
+            [&](const Rect_Light& l) {
+                Vec3 x = trans.rotate(Vec3(l.size.x, 0.0f, 0.0f));
+                Vec3 z = trans.rotate(Vec3(0.0f, 0.0f, l.size.y));
+                Vec3 corner = position - x / 2.0f - z / 2.0f;
+                ret.box.enclose(corner);
+                ret.box.enclose(corner + x);
+                ret.box.enclose(corner + z);
+                ret.box.enclose(corner + x + z);
+                ret.axis = trans.rotate(Vec3(0.0f, -1.0f, 0.0f)).unit();
+                ret.theta_o = 0.0f;
+                ret.power = l.radiance.luma() * cross(x, z).norm();
+            },
+            [&](const Tri_Light& l) {
+                Vec3 v0 = trans * l.v0, e1 = trans.rotate(l.e1), e2 = trans.rotate(l.e2);
+                ret.box.enclose(v0);
+                ret.box.enclose(v0 + e1);
+                ret.box.enclose(v0 + e2);
+                // Emits from both sides, so it keeps the default cone of all directions
+                ret.power = l.radiance.luma() * cross(e1, e2).norm() / 2.0f;
+            }},
+        underlying);
+    return ret;
+}
+
 } // namespace PT
@@ -29,6 +29,9 @@ struct Directional_Light {
     Directional_Light(Spectrum r) : radiance(r), sampler(Vec3(0.0f, 1.0f, 0.0f)) {
     }
 
+    // Discrete lights need only one sample, as all their samples are equal
+    static constexpr bool discrete = true;
+
     Light_Sample sample(Vec3 from) const;
 
     Spectrum radiance;
@@ -40,6 +43,8 @@ struct Point_Light {
     Point_Light(Spectrum r) : radiance(r), sampler(Vec3(0.0f)) {
     }
 
+    static constexpr bool discrete = true;
+
     Light_Sample sample(Vec3 from) const;
 
     Spectrum radiance;
@@ -51,6 +56,8 @@ struct Spot_Light {
     Spot_Light(Spectrum r, Vec2 a) : radiance(r), angle_bounds(a), sampler(Vec3(0.0f)) {
     }
 
+    static constexpr bool discrete = true;
+
     Light_Sample sample(Vec3 from) const;
 
     Spectrum radiance;
@@ -63,13 +70,48 @@ struct Rect_Light {
     Rect_Light(Spectrum r, Vec2 s) : radiance(r), size(s), sampler(size) {
     }
 
+    static constexpr bool discrete = false;
+
     Light_Sample sample(Vec3 from) const;
+    float pdf(Vec3 from, Vec3 point) const;
 
     Spectrum radiance;
     Vec2 size;
     Samplers::Rect::Uniform sampler;
 };
 
+// One triangle of an emissive mesh, in world space. Like the diffuse material
+// it comes from, it emits from both sides.
+struct Tri_Light {
+
+    Tri_Light(Spectrum r, Vec3 v0, Vec3 v1, Vec3 v2)
+        : radiance(r), v0(v0), e1(v1 - v0), e2(v2 - v0) {
+    }
+
+    static constexpr bool discrete = false;
+
+    Light_Sample sample(Vec3 from) const;
+    float pdf(Vec3 from, Vec3 point) const;
+
+    Spectrum radiance;
+    Vec3 v0, e1, e2;
+};
+
+// Where a light is and which way it shines, for choosing among many lights
+// (see Light_Tree). All the light leaves its box within theta_o + theta_e of
+// axis, and within theta_o at full strength. Lights at infinity, like
+// directional lights, aren't bounded.
+struct Light_Bounds {
+    bool bounded = true;
+    BBox box;
+    Vec3 axis = Vec3(0.0f, 1.0f, 0.0f);
+    float theta_o = PI_F, theta_e = PI_F / 2.0f;
+
+    // Brightness of lights whose radiance doesn't fall off with distance (point
+    // and spot lights), and of those that fall off with its square (luma * area)
+    float intensity = 0.0f, power = 0.0f;
+};
+
 class Light {
 public:
     Light(Directional_Light&& l, Scene_ID id, const Mat4& T = Mat4::I)
@@ -88,6 +130,10 @@ public:
         : trans(T), itrans(T.inverse()), _id(id), underlying(std::move(l)) {
         has_trans = trans != Mat4::I;
     }
+    Light(Tri_Light&& l, Scene_ID id, const Mat4& T = Mat4::I)
+        : trans(T), itrans(T.inverse()), _id(id), underlying(std::move(l)) {
+        has_trans = trans != Mat4::I;
+    }
 
     Light(const Light& src) = delete;
     Light& operator=(const Light& src) = delete;
@@ -95,21 +141,22 @@ public:
     Light(Light&& src) = default;
 
     Light_Sample sample(Vec3 from) const {
-        if(has_trans) from = itrans * from;
-        Light_Sample ret =
-            std::visit(overloaded{[&from](const auto& l) { return l.sample(from); }}, underlying);
-        if(has_trans) ret.transform(trans);
-        return ret;
+        return std::visit([this, &from](const auto& l) { return sample(l, from); }, underlying);
     }
 
-    bool is_discrete() const {
-        return std::visit(overloaded{[](const Directional_Light&) { return true; },
-                                     [](const Point_Light&) { return true; },
-                                     [](const Spot_Light&) { return true; },
-                                     [](const Rect_Light&) { return false; }},
+    // The density with which sample(from) gives the direction towards point on
+    // the light, which is zero for discrete lights as no other sample finds them
+    float pdf(Vec3 from, Vec3 point) const {
+        return std::visit([this, &from, &point](const auto& l) { return pdf(l, from, point); },
                           underlying);
     }
 
+    bool is_discrete() const {
+        return std::visit([](const auto& l) { return l.discrete; }, underlying);
+    }
+
+    Light_Bounds bounds() const;
+
     Scene_ID id() const {
         return _id;
     }
@@ -120,10 +167,28 @@ public:
     }
 
 private:
+    template<typename L> Light_Sample sample(const L& light, Vec3 from) const {
+        if(has_trans) from = itrans * from;
+        Light_Sample ret = light.sample(from);
+        if(has_trans) ret.transform(trans);
+        return ret;
+    }
+    template<typename L> float pdf(const L& light, Vec3 from, Vec3 point) const {
+        if constexpr(L::discrete) {
+            return 0.0f;
+        } else {
+            if(has_trans) {
+                from = itrans * from;
+                point = itrans * point;
+            }
+            return light.pdf(from, point);
+        }
+    }
+
     bool has_trans;
     Mat4 trans, itrans;
     Scene_ID _id;
-    std::variant<Directional_Light, Point_Light, Spot_Light, Rect_Light> underlying;
+    std::variant<Directional_Light, Point_Light, Spot_Light, Rect_Light, Tri_Light> underlying;
 };
 
 } // namespace PT
@@ -0,0 +1,178 @@
+
+#include "light_tree.h"
+#include "../util/rand.h"
+
+namespace PT {
+
+void Light_Tree::build(const std::vector<Light>& lights) {
+
+    nodes.clear();
+    infinite.clear();
+    leaves.assign(lights.size(), none);
+
+    // Lights that give off no light are left out entirely
+    std::vector<std::pair<size_t, Light_Bounds>> bounded;
+    for(size_t i = 0; i < lights.size(); i++) {
+        Light_Bounds b = lights[i].bounds();
+        if(!b.bounded) {
+            infinite.push_back(i);
+        } else if(b.intensity > 0.0f || b.power > 0.0f) {
+            bounded.push_back({i, b});
+        }
+    }
+
+    if(bounded.empty()) return;
+    nodes.reserve(2 * bounded.size() - 1);
+    build(bounded, 0, bounded.size());
+}
+
+uint32_t Light_Tree::build(std::vector<std::pair<size_t, Light_Bounds>>& lights, size_t begin,
+                           size_t end) {
+
+    uint32_t idx = (uint32_t)nodes.size();
+    nodes.emplace_back();
+
+    if(end - begin == 1) {
+        nodes[idx].bounds = lights[begin].second;
+        nodes[idx].light = (uint32_t)lights[begin].first;
+        leaves[lights[begin].first] = idx;
+        return idx;
+    }
+
+    // Split at the median along the longest axis of the lights' centers
+    BBox centers;
+    for(size_t i = begin; i < end; i++) centers.enclose(lights[i].second.box.center());
+    Vec3 extent = centers.max - centers.min;
+    int axis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2;
+
+    size_t mid = (begin + end) / 2;
+    std::nth_element(lights.begin() + begin, lights.begin() + mid, lights.begin() + end,
+                     [axis](const auto& a, const auto& b) {
+                         return a.second.box.center()[axis] < b.second.box.center()[axis];
+                     });
+
+    build(lights, begin, mid);
+    uint32_t right = build(lights, mid, end);
+    nodes[idx].right = right;
+    nodes[idx].bounds = merge(nodes[idx + 1].bounds, nodes[right].bounds);
+    return idx;
+}
+
+Light_Bounds Light_Tree::merge(const Light_Bounds& a, const Light_Bounds& b) {
+
+    Light_Bounds ret;
+    ret.box = a.box;
+    ret.box.enclose(b.box);
+    ret.intensity = a.intensity + b.intensity;
+    ret.power = a.power + b.power;
+    ret.theta_e = std::max(a.theta_e, b.theta_e);
+
+    // The narrowest cone around both cones of directions: if the wider one
+    // doesn't already hold the other, its axis is turned towards the other's
+    // until both fit.
+    const Light_Bounds& wide = a.theta_o >= b.theta_o ? a : b;
+    const Light_Bounds& narrow = a.theta_o >= b.theta_o ? b : a;
+    float cos_d = clamp(dot(wide.axis, narrow.axis), -1.0f, 1.0f);
+    float theta_d = std::acos(cos_d);
+
+    ret.axis = wide.axis;
+    ret.theta_o = wide.theta_o;
+    if(std::min(theta_d + narrow.theta_o, PI_F) <= wide.theta_o) return ret;
+
+    ret.theta_o = (wide.theta_o + theta_d + narrow.theta_o) / 2.0f;
+    Vec3 ortho = narrow.axis - cos_d * wide.axis;
+    if(ret.theta_o >= PI_F || ortho.norm() < EPS_F) {
+        ret.theta_o = PI_F;
+        return ret;
+    }
+
+    float turn = ret.theta_o - wide.theta_o;
+    ret.axis = (std::cos(turn) * wide.axis + std::sin(turn) * ortho.unit()).unit();
+    return ret;
+}
+
+float Light_Tree::importance(const Light_Bounds& bounds, Vec3 point, Vec3 normal) {
+
+    Vec3 center = bounds.box.center();
+    Vec3 to_point = point - center;
+    float dist_sq = to_point.norm_squared();
+    float radius_sq = (bounds.box.max - center).norm_squared();
+
+    // Area lights fall off with distance squared, clamped to the size of the box
+    // so points near or inside it aren't given unbounded weight
+    float falloff = bounds.power > 0.0f ? bounds.power / std::max(dist_sq, radius_sq) : 0.0f;
+    float brightness = bounds.intensity + falloff;
+    if(dist_sq <= radius_sq) return brightness;
+
+    // The directions from the box to the point lie within theta_u of the
+    // direction from its center, so each angle below is reduced by that much
+    Vec3 dir = to_point / std::sqrt(dist_sq);
+    float theta_u = std::asin(std::sqrt(radius_sq / dist_sq));
+
+    float theta_w = std::acos(clamp(dot(bounds.axis, dir), -1.0f, 1.0f));
+    float theta = std::max(theta_w - bounds.theta_o - theta_u, 0.0f);
+    if(theta > bounds.theta_e) return 0.0f;
+    float cos_emit = std::max(std::cos(theta), 0.0f);
+
+    float cos_in = 1.0f;
+    if(normal.norm_squared() > 0.0f) {
+        float theta_i = std::acos(clamp(dot(normal, -dir), -1.0f, 1.0f));
+        cos_in = std::max(std::cos(std::max(theta_i - theta_u, 0.0f)), 0.0f);
+    }
+    return brightness * cos_emit * cos_in;
+}
+
+Light_Tree::Choice Light_Tree::sample(Vec3 point, Vec3 normal) const {
+
+    Choice ret;
+    if(nodes.empty()) return ret;
+
+    uint32_t idx = 0;
+    float pmf = 1.0f;
+    while(nodes[idx].right) {
+        float left = importance(nodes[idx + 1].bounds, point, normal);
+        float right = importance(nodes[nodes[idx].right].bounds, point, normal);
+        if(left + right <= 0.0f) return ret;
+
+        float p_left = left / (left + right);
+        if(RNG::unit() < p_left) {
+            idx = idx + 1;
+            pmf *= p_left;
+        } else {
+            idx = nodes[idx].right;
+            pmf *= 1.0f - p_left;
+        }
+    }
+
+    ret.light = nodes[idx].light;
+    ret.pmf = pmf;
+    return ret;
+}
+
+float Light_Tree::pmf(Vec3 point, Vec3 normal, size_t light) const {
+
+    if(light >= leaves.size() || leaves[light] == none) return 0.0f;
+    uint32_t leaf = leaves[light];
+
+    // Retraces sample's way down to the leaf, which is in the first child's
+    // subtree exactly when it comes before the second child
+    uint32_t idx = 0;
+    float pmf = 1.0f;
+    while(nodes[idx].right) {
+        float left = importance(nodes[idx + 1].bounds, point, normal);
+        float right = importance(nodes[nodes[idx].right].bounds, point, normal);
+        if(left + right <= 0.0f) return 0.0f;
+
+        float p_left = left / (left + right);
+        if(leaf < nodes[idx].right) {
+            idx = idx + 1;
+            pmf *= p_left;
+        } else {
+            idx = nodes[idx].right;
+            pmf *= 1.0f - p_left;
+        }
+    }
+    return pmf;
+}
+
+} // namespace PT
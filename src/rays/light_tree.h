@@ -0,0 +1,61 @@
+
+#pragma once
+
+#include <vector>
+
+#include "../lib/mathlib.h"
+
+#include "light.h"
+
+namespace PT {
+
+// A hierarchy over the scene's lights for choosing one of them to sample at a
+// point, with probability roughly proportional to what it could contribute
+// there, so that the cost of direct lighting grows with the depth of the tree
+// rather than the number of lights. Each node keeps the merged Light_Bounds of
+// its lights, from which the light reaching a point is estimated on the way
+// down; lights that can't reach it are never chosen.
+class Light_Tree {
+public:
+    struct Choice {
+        size_t light = 0;
+        float pmf = 0.0f;
+    };
+
+    void build(const std::vector<Light>& lights);
+
+    // Chooses one of the tree's lights to sample at point, facing normal (or zero
+    // to consider light from every direction). The pmf is zero if none can reach it.
+    Choice sample(Vec3 point, Vec3 normal) const;
+
+    // The probability that sample(point, normal) chooses the given light
+    float pmf(Vec3 point, Vec3 normal, size_t light) const;
+
+    // Lights without bounds (i.e. directional lights) are left out of the tree, to
+    // be sampled at every point.
+    const std::vector<size_t>& unbounded() const {
+        return infinite;
+    }
+
+private:
+    // Depth-first: an interior node's first child follows it, and right is the
+    // index of its second. Leaves have right = 0 and hold a single light.
+    struct Node {
+        Light_Bounds bounds;
+        uint32_t light = 0, right = 0;
+    };
+
+    static Light_Bounds merge(const Light_Bounds& a, const Light_Bounds& b);
+    static float importance(const Light_Bounds& bounds, Vec3 point, Vec3 normal);
+    uint32_t build(std::vector<std::pair<size_t, Light_Bounds>>& lights, size_t begin,
+                   size_t end);
+
+    std::vector<Node> nodes;
+    std::vector<size_t> infinite;
+
+    // The leaf holding each light, or none for lights left out of the tree
+    static constexpr uint32_t none = UINT32_MAX;
+    std::vector<uint32_t> leaves;
+};
+
+} // namespace PT
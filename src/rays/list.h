@@ -30,6 +30,13 @@ public:
         return ret;
     }
 
+    bool occluded(const Ray& ray) const {
+        for(const auto& p : prims) {
+            if(p.occluded(ray)) return true;
+        }
+        return false;
+    }
+
     void append(Primitive&& prim) {
         prims.push_back(std::move(prim));
     }
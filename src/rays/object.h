@@ -49,6 +49,110 @@ public:
             std::visit(overloaded{[&ray](const auto& o) { return o.hit(ray); }}, underlying);
         if(ret.hit) {
             ret.material = material;
+            ret.object = _id;
+            if(has_trans) ret.transform(trans, itrans.T());
+        }
+        return ret;
+    }
+
+    bool occluded(Ray ray) const {
+        if(has_trans) ray.transform(itrans);
+        return std::visit(overloaded{[&ray](const auto& o) { return o.occluded(ray); }},
+                          underlying);
+    }
+
+    void hit_packet(const Ray* rays, Trace* traces, size_t n) const {
+        Ray local[PACKET_SIZE];
+        Trace found[PACKET_SIZE];
+        for(size_t i = 0; i < n; i++) {
+            local[i] = rays[i];
+            if(has_trans) local[i].transform(itrans);
+        }
+        std::visit(overloaded{[&](const BVH<Object>& bvh) { bvh.hit_packet(local, found, n); },
+                              [&](const Tri_Mesh& mesh) { mesh.hit_packet(local, found, n); },
+                              [&](const auto& o) {
+                                  for(size_t i = 0; i < n; i++) found[i] = o.hit(local[i]);
+                              }},
+                   underlying);
+        for(size_t i = 0; i < n; i++) {
+            if(!found[i].hit) continue;
+            found[i].material = material;
+            found[i].object = _id;
+            if(has_trans) found[i].transform(trans, itrans.T());
+            traces[i] = Trace::min(traces[i], found[i]);
+        }
+    }
+
+    // Deferred hit: closest only records a hit nearer than rec's, as this object's
+    // index and, for a mesh, where on which triangle; surface then builds the Trace.
+    // Other kinds of object have no cheaper test, so they trace a full hit twice.
+    bool closest(Ray ray, Hit_Record& rec, uint32_t index) const {
+        float scale = has_trans ? ray.transform(itrans) : 1.0f;
+        if(rec.hit) ray.dist_bounds.y = std::min(ray.dist_bounds.y, rec.distance * scale);
+        Hit_Record local;
+        if(const Tri_Mesh* mesh = std::get_if<Tri_Mesh>(&underlying)) {
+            local = mesh->closest(ray);
+        } else {
+            Trace t =
+                std::visit(overloaded{[&ray](const auto& o) { return o.hit(ray); }}, underlying);
+            local.hit = t.hit;
+            local.distance = t.distance;
+            local.prim = 0;
+        }
+        if(!local.hit) return false;
+        rec = {true, local.distance / scale, index, local.prim, local.u, local.v};
+        return true;
+    }
+
+    void closest_packet(const Ray* rays, Hit_Record* recs, size_t n, uint32_t index) const {
+        Ray local[PACKET_SIZE];
+        float scale[PACKET_SIZE];
+        Hit_Record found[PACKET_SIZE];
+        for(size_t i = 0; i < n; i++) {
+            local[i] = rays[i];
+            scale[i] = has_trans ? local[i].transform(itrans) : 1.0f;
+            found[i].hit = recs[i].hit;
+            found[i].distance = recs[i].distance * scale[i];
+        }
+        if(const Tri_Mesh* mesh = std::get_if<Tri_Mesh>(&underlying)) {
+            mesh->closest_packet(local, found, n);
+        } else {
+            Trace traces[PACKET_SIZE];
+            for(size_t i = 0; i < n; i++) {
+                if(!found[i].hit) continue;
+                local[i].dist_bounds.y = std::min(local[i].dist_bounds.y, found[i].distance);
+            }
+            std::visit(
+                overloaded{[&](const BVH<Object>& bvh) { bvh.hit_packet(local, traces, n); },
+                           [&](const auto& o) {
+                               for(size_t i = 0; i < n; i++) traces[i] = o.hit(local[i]);
+                           }},
+                underlying);
+            for(size_t i = 0; i < n; i++) {
+                if(traces[i].hit) found[i] = {true, traces[i].distance, 0};
+            }
+        }
+        for(size_t i = 0; i < n; i++) {
+            if(found[i].prim == Hit_Record::none) continue;
+            recs[i] = {true, found[i].distance / scale[i], index, found[i].prim, found[i].u,
+                       found[i].v};
+        }
+    }
+
+    Trace surface(Ray ray, const Hit_Record& rec) const {
+        float scale = has_trans ? ray.transform(itrans) : 1.0f;
+        Trace ret;
+        if(const Tri_Mesh* mesh = std::get_if<Tri_Mesh>(&underlying)) {
+            Hit_Record local = rec;
+            local.distance *= scale;
+            local.prim = rec.tri;
+            ret = mesh->surface(ray, local);
+        } else {
+            ret = std::visit(overloaded{[&ray](const auto& o) { return o.hit(ray); }}, underlying);
+        }
+        if(ret.hit) {
+            ret.material = material;
+            ret.object = _id;
             if(has_trans) ret.transform(trans, itrans.T());
         }
         return ret;
@@ -4,15 +4,169 @@
 #include "../gui/render.h"
 
 #include <SDL2/SDL.h>
+#include <cstring>
+#include <iterator>
 #include <thread>
+#include <utility>
 
 namespace PT {
 
+// FNV-1a over 32-bit words, continuing from h
+static uint64_t hash_words(const void* data, size_t bytes, uint64_t h = 0xcbf29ce484222325ull) {
+    const unsigned char* p = (const unsigned char*)data;
+    for(size_t i = 0; i + 4 <= bytes; i += 4) {
+        uint32_t w;
+        std::memcpy(&w, p + i, 4);
+        h = (h ^ w) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+// Hash of a mesh's connectivity, and of that plus its vertex data
+static std::pair<uint64_t, uint64_t> mesh_hash(const GL::Mesh& mesh) {
+    size_t sizes[] = {mesh.verts().size(), mesh.indices().size()};
+    uint64_t topology = hash_words(sizes, sizeof(sizes));
+    topology = hash_words(mesh.indices().data(),
+                          mesh.indices().size() * sizeof(GL::Mesh::Index), topology);
+    uint64_t hash =
+        hash_words(mesh.verts().data(), mesh.verts().size() * sizeof(GL::Mesh::Vert), topology);
+    return {topology, hash};
+}
+
+// Continues h with the camera's view and lens
+static uint64_t hash_camera(const Camera& camera, uint64_t h) {
+    auto add = [&h](const auto& v) { h = hash_words(&v, sizeof(v), h); };
+    add(camera.get_view());
+    add(camera.get_fov());
+    add(camera.get_ar());
+    add(camera.get_ap());
+    add(camera.get_dist());
+    return h;
+}
+
+// The selected layers, as a bit for each in the order of Layers
+static uint64_t layer_bits(const Layers& l) {
+    bool bits[] = {l.direct, l.indirect, l.lights, l.depth, l.object, l.material};
+    uint64_t ret = 0;
+    for(size_t i = 0; i < std::size(bits); i++) ret |= (uint64_t)bits[i] << i;
+    return ret;
+}
+
+// Continues h with the settings that change what a render shows
+uint64_t Pathtracer::settings_hash(uint64_t h) const {
+    auto add = [&h](const auto& v) { h = hash_words(&v, sizeof(v), h); };
+    add((uint64_t)out_w);
+    add((uint64_t)out_h);
+    add((uint64_t)n_samples);
+    add((uint64_t)n_area_samples);
+    add((uint64_t)max_depth);
+    add(noise_threshold);
+    add(time_limit);
+    add((uint32_t)wavefront);
+    add((uint32_t)denoising);
+    add((uint32_t)sequence);
+    add(seed);
+    add(layer_bits(layers));
+    return h;
+}
+
+// The mesh_hash of an item's mesh, kept until its version changes. Getting an
+// object's posed mesh may change its version, so callers get the mesh first.
+std::pair<uint64_t, uint64_t> Pathtracer::cached_mesh_hash(Scene_ID id, uint64_t version,
+                                                           const GL::Mesh& mesh) {
+    auto entry = mesh_hashes.find(id);
+    if(entry == mesh_hashes.end() || entry->second.version != version) {
+        auto [topology, hash] = mesh_hash(mesh);
+        entry = mesh_hashes.insert_or_assign(id, Cached_Hash{version, hash, topology}).first;
+    }
+    return {entry->second.topology, entry->second.hash};
+}
+
+// Hash of everything in the scene that affects a render. Items are combined by
+// addition, so the result doesn't depend on the order they are visited in.
+uint64_t Pathtracer::hash_scene(Scene& scene) {
+
+    // Looks up an environment map hashed under this version, or hashes it again
+    auto cached = [this](Scene_ID id, uint64_t version, const auto& rehash) {
+        auto entry = emissive_hashes.find(id);
+        if(entry == emissive_hashes.end() || entry->second.version != version) {
+            entry = emissive_hashes.insert_or_assign(id, Cached_Hash{version, rehash()}).first;
+        }
+        return entry->second.hash;
+    };
+
+    uint64_t ret = 0;
+    scene.for_items([&, this](Scene_Item& item) {
+        uint64_t h = hash_words(nullptr, 0);
+        auto add = [&h](const auto& v) { h = hash_words(&v, sizeof(v), h); };
+
+        if(item.is<Scene_Object>()) {
+            Scene_Object& obj = item.get<Scene_Object>();
+            const Material::Options& opt = obj.material.opt;
+            add(obj.id());
+            add(obj.pose.transform());
+            add(opt.type);
+            add(opt.albedo);
+            add(opt.reflectance);
+            add(opt.transmittance);
+            add(obj.material.emissive());
+            add(opt.ior);
+            if(obj.is_shape()) {
+                add(obj.opt.shape.bbox());
+            } else {
+                const GL::Mesh& mesh = obj.posed_mesh();
+                add(cached_mesh_hash(obj.id(), obj.mesh_version(), mesh).second);
+            }
+
+        } else if(item.is<Scene_Light>()) {
+            Scene_Light& light = item.get<Scene_Light>();
+            add(light.id());
+            add(light.pose.transform());
+            add(light.opt.type);
+            add(light.radiance());
+            add(light.opt.angle_bounds);
+            add(light.opt.size);
+            add((uint32_t)light.opt.has_emissive_map);
+            if(light.opt.has_emissive_map) {
+                // The map's pixels rather than its path, which differs between machines
+                // and may have been overwritten since
+                const HDR_Image& map = light.emissive();
+                add(cached(light.id(), light.emissive_version(), [&map]() {
+                    auto [w, h] = map.dimension();
+                    size_t dims[] = {w, h};
+                    return hash_words(map.data(), w * h * sizeof(Spectrum),
+                                      hash_words(dims, sizeof(dims)));
+                }));
+            }
+
+        } else if(item.is<Scene_Particles>()) {
+            Scene_Particles& particles = item.get<Scene_Particles>();
+            add(particles.id());
+            add(particles.opt.color);
+            add(particles.opt.scale);
+            const GL::Mesh& mesh = particles.mesh();
+            add(cached_mesh_hash(particles.id(), particles.mesh_version(), mesh).second);
+            for(const Particle& p : particles.get_particles()) add(p.pos);
+        }
+        ret += h;
+    });
+    return ret;
+}
+
 Pathtracer::Pathtracer(Gui::Widget_Render& gui, Vec2 screen_dim)
-    : thread_pool(std::thread::hardware_concurrency()), gui(gui), camera(screen_dim) {
-    accumulator_samples = 0;
-    total_epochs = 0;
-    completed_epochs = 0;
+    : thread_pool(std::thread::hardware_concurrency()),
+      build_pool(std::thread::hardware_concurrency()), gui(gui), camera(screen_dim) {
+    samples_per_pass = 0;
+    resolved_passes = 0;
+    merged_passes = 0;
+    total_work = 0;
+    next_work = 0;
+    completed_work = 0;
+    running_workers = 0;
+    converged_tiles = 0;
+    next_aov = 0;
+    traced_aovs = 0;
+    render_time = build_time = render_start = deadline = 0;
     out_w = out_h = 0;
     n_samples = 0;
     n_area_samples = 0;
@@ -20,150 +174,336 @@ Pathtracer::Pathtracer(Gui::Widget_Render& gui, Vec2 screen_dim)
 
 Pathtracer::~Pathtracer() {
     cancel();
+    finish_build();
     thread_pool.stop();
+    build_pool.stop();
 }
 
-void Pathtracer::build_lights(Scene& layout_scene, std::vector<Object>& objs) {
+void Pathtracer::copy_scene(Scene& layout_scene, Scene_Copy& out) {
 
-    lights.clear();
-    env_light.reset();
+    // Reads mesh_cache, so mustn't run alongside a build
+    auto copy_mesh = [this](Scene_ID id, const GL::Mesh& mesh,
+                            std::pair<uint64_t, uint64_t> hashes, bool always, Mesh_Copy& copy) {
+        std::tie(copy.topology, copy.hash) = hashes;
+        auto entry = mesh_cache.find(id);
+        if(!always && entry != mesh_cache.end() && entry->second.topology == copy.topology &&
+           entry->second.hash == copy.hash)
+            return;
+        copy.verts = mesh.verts();
+        copy.indices = mesh.indices();
+    };
 
-    layout_scene.for_items([&, this](const Scene_Item& item) {
-        if(item.is<Scene_Light>()) {
+    out.items.clear();
+    layout_scene.for_items([&, this](Scene_Item& item) {
+        if(item.is<Scene_Object>()) {
+
+            Scene_Object& obj = item.get<Scene_Object>();
+            Object_Copy copy;
+            copy.id = obj.id();
+            copy.name = std::as_const(item).name();
+            copy.material = obj.material.opt;
+            copy.emissive = obj.material.emissive();
+            copy.transform = obj.pose.transform();
+            if(obj.is_shape()) {
+                copy.shape = obj.opt.shape;
+            } else {
+                bool lights = obj.material.opt.type == Material_Type::diffuse_light;
+                const GL::Mesh& mesh = obj.posed_mesh();
+                copy_mesh(obj.id(), mesh, cached_mesh_hash(obj.id(), obj.mesh_version(), mesh),
+                          lights, copy.mesh);
+            }
+            out.items.emplace_back(std::move(copy));
+
+        } else if(item.is<Scene_Light>()) {
 
             const Scene_Light& light = item.get<Scene_Light>();
-            Spectrum r = light.radiance();
+            Light_Copy copy;
+            copy.id = light.id();
+            copy.name = std::as_const(item).name();
+            copy.opt = light.opt;
+            copy.radiance = light.radiance();
+            copy.transform = light.pose.transform();
+            if(light.opt.type == Light_Type::sphere && light.opt.has_emissive_map) {
+                copy.emissive = light.emissive_copy();
+            }
+            if(light.opt.type == Light_Type::rectangle) {
+                GL::Mesh quad = Util::quad_mesh(light.opt.size.x, light.opt.size.y);
+                copy.quad.verts = quad.verts();
+                copy.quad.indices = quad.indices();
+            }
+            out.items.emplace_back(std::move(copy));
 
-            switch(light.opt.type) {
+        } else if(item.is<Scene_Particles>()) {
+
+            Scene_Particles& particles = item.get<Scene_Particles>();
+            Particles_Copy copy;
+            copy.id = particles.id();
+            copy.color = particles.opt.color;
+            copy.scale = particles.opt.scale;
+            const GL::Mesh& mesh = particles.mesh();
+            copy_mesh(particles.id(), mesh,
+                      cached_mesh_hash(particles.id(), particles.mesh_version(), mesh), false,
+                      copy.mesh);
+            for(const Particle& p : particles.get_particles()) copy.positions.push_back(p.pos);
+            out.items.emplace_back(std::move(copy));
+        }
+    });
+}
+
+void Pathtracer::build_lights(Scene_Copy& copy, std::vector<Object>& objs, Built_Scene& out) {
+
+    out.lights.clear();
+    out.env_light.reset();
+
+    // Recorded by material once all of them exist, as area lights add theirs below
+    std::vector<std::pair<size_t, Emitter>> emitting;
+    std::unordered_map<Scene_ID, std::string> names;
+
+    for(auto& item : copy.items) {
+        if(auto light = std::get_if<Light_Copy>(&item)) {
+
+            Spectrum r = light->radiance;
+            names[light->id] = light->name;
+
+            switch(light->opt.type) {
             case Light_Type::directional: {
-                lights.push_back(Light(Directional_Light(r), light.id(), light.pose.transform()));
+                out.lights.push_back(Light(Directional_Light(r), light->id, light->transform));
             } break;
             case Light_Type::sphere: {
-                if(light.opt.has_emissive_map) {
-                    env_light = Env_Light(Env_Map(light.emissive_copy()));
+                if(light->opt.has_emissive_map) {
+                    out.env_light = Env_Light(Env_Map(std::move(light->emissive)));
                 } else {
-                    env_light = Env_Light(Env_Sphere(r));
+                    out.env_light = Env_Light(Env_Sphere(r));
                 }
             } break;
             case Light_Type::hemisphere: {
-                env_light = Env_Light(Env_Hemisphere(r));
+                out.env_light = Env_Light(Env_Hemisphere(r));
             } break;
             case Light_Type::point: {
-                lights.push_back(Light(Point_Light(r), light.id(), light.pose.transform()));
+                out.lights.push_back(Light(Point_Light(r), light->id, light->transform));
             } break;
             case Light_Type::spot: {
-                lights.push_back(Light(Spot_Light(r, light.opt.angle_bounds), light.id(),
-                                       light.pose.transform()));
+                out.lights.push_back(
+                    Light(Spot_Light(r, light->opt.angle_bounds), light->id, light->transform));
             } break;
             case Light_Type::rectangle: {
-                lights.push_back(
-                    Light(Rect_Light(r, light.opt.size), light.id(), light.pose.transform()));
+                uint32_t first = (uint32_t)out.lights.size();
+                out.lights.push_back(
+                    Light(Rect_Light(r, light->opt.size), light->id, light->transform));
 
                 unsigned int idx = 0;
-                auto entry = mat_cache.find(light.id());
-                if(entry != mat_cache.end()) {
+                auto entry = out.mat_cache.find(light->id);
+                if(entry != out.mat_cache.end()) {
                     idx = (unsigned int)entry->second;
-                    materials[entry->second] = BSDF(BSDF_Diffuse(r));
+                    out.materials[entry->second] = BSDF(BSDF_Diffuse(r));
                 } else {
-                    idx = (unsigned int)materials.size();
-                    mat_cache[light.id()] = materials.size();
-                    materials.push_back(BSDF(BSDF_Diffuse(r)));
+                    idx = (unsigned int)out.materials.size();
+                    out.mat_cache[light->id] = out.materials.size();
+                    out.materials.push_back(BSDF(BSDF_Diffuse(r)));
                 }
-                objs.push_back(
-                    Object(std::move(Util::quad_mesh(light.opt.size.x, light.opt.size.y)),
-                           light.id(), idx, light.pose.transform()));
+                emitting.push_back({idx, Emitter{first, false}});
+                Tri_Mesh quad;
+                quad.build(light->quad.verts, light->quad.indices);
+                objs.push_back(Object(std::move(quad), light->id, idx, light->transform));
             } break;
-            default: return;
+            default: break;
+            }
+
+        } else if(auto obj = std::get_if<Object_Copy>(&item)) {
+
+            // Emissive meshes are sampled as lights too, one per triangle
+            if(obj->material.type != Material_Type::diffuse_light || obj->shape) continue;
+            names[obj->id] = obj->name;
+
+            Spectrum r = obj->emissive;
+            const Mat4& T = obj->transform;
+            const auto& verts = obj->mesh.verts;
+            const auto& idxs = obj->mesh.indices;
+            Emitter emitter{(uint32_t)out.lights.size(), true};
+            emitting.push_back({out.mat_cache[obj->id], emitter});
+            for(size_t i = 0; i + 2 < idxs.size(); i += 3) {
+                Vec3 v0 = T * verts[idxs[i]].pos;
+                Vec3 v1 = T * verts[idxs[i + 1]].pos;
+                Vec3 v2 = T * verts[idxs[i + 2]].pos;
+                out.lights.push_back(Light(Tri_Light(r, v0, v1, v2), obj->id));
             }
         }
-    });
-}
+    }
 
-void Pathtracer::build_scene(Scene& layout_scene) {
+    out.emitters.assign(out.materials.size(), Emitter{});
+    for(const auto& [material, emitter] : emitting) out.emitters[material] = emitter;
 
-    // It would be nice to let the interface be usable here (as with
-    // the path-tracing part), but this would cause too much hassle with
-    // editing the scene while building BVHs from it.
-    // This could be worked around by first copying all the mesh data
-    // and then building the BVHs, but I don't think it's that big
-    // of a deal, as BVH building should take at most a few seconds
-    // even with many big meshes.
+    // Each scene light or emissive object makes one light group, in the order found
+    std::unordered_map<Scene_ID, uint32_t> groups;
+    out.light_group.clear();
+    out.group_names.clear();
+    for(const Light& light : out.lights) {
+        auto [entry, added] = groups.insert({light.id(), (uint32_t)out.group_names.size()});
+        if(added) out.group_names.push_back(names[light.id()]);
+        out.light_group.push_back(entry->second);
+    }
+    out.env_group = no_group;
+    if(out.env_light.has_value()) {
+        out.env_group = (uint32_t)out.group_names.size();
+        out.group_names.push_back("environment");
+    }
+
+    out.light_tree.build(out.lights);
+}
+
+void Pathtracer::build_scene(Scene_Copy& copy, Built_Scene& out) {
 
-    // We could also do instancing instead of duplicating the bvh
-    // for big meshes, but that's something to add in the future
+    // Builds from a copy of the scene, so the interface stays usable meanwhile
+    std::vector<std::future<void>> tasks;
 
-    // Yeah this could just be a list of futures but future wanted a
-    // default constructor for Object so whatever
+    // Each item's objects go in its own slot, so that the top-level BVH is built
+    // from them in scene order however the tasks finish; Object has no default
+    // constructor, so the slots are lists.
     std::mutex obj_mut;
-    std::vector<Object> obj_list;
-    materials.clear();
-    mat_cache.clear();
+    std::vector<std::vector<Object>> slots(copy.items.size());
+    out.materials.clear();
+    out.mat_cache.clear();
 
-    layout_scene.for_items([&, this](Scene_Item& item) {
-        if(item.is<Scene_Object>()) {
+    // Per-stage BVH build times, summed over all meshes. Meshes are built
+    // concurrently, so these can add up to more than the wall-clock time.
+    BVH<Triangle>::Build_Stats mesh_stats;
+    auto add_stats = [&mesh_stats](const BVH<Triangle>::Build_Stats& s) {
+        mesh_stats.bounds += s.bounds;
+        mesh_stats.split += s.split;
+        mesh_stats.reorder += s.reorder;
+        mesh_stats.layout += s.layout;
+    };
 
-            Scene_Object& obj = item.get<Scene_Object>();
-            unsigned int idx = (unsigned int)materials.size();
-            const Material::Options& opt = obj.material.opt;
+    // Look up the object's mesh in the cache, building it only if it's new, or
+    // refitting it if only its vertex data has changed. Called concurrently from
+    // the build tasks.
+    size_t n_meshes = 0, n_reused = 0, n_refit = 0;
+    std::unordered_map<Scene_ID, Cached_Mesh> next_cache;
+    auto get_mesh = [&, this](Scene_ID id, const Mesh_Copy& src) {
+        uint64_t topology = src.topology, hash = src.hash;
+        Tri_Mesh mesh;
+        bool cached = false;
+        {
+            std::lock_guard<std::mutex> lock(obj_mut);
+            n_meshes++;
+            auto entry = mesh_cache.find(id);
+            if(entry != mesh_cache.end() && entry->second.topology == topology) {
+                mesh = entry->second.mesh.instance();
+                cached = true;
+                if(entry->second.hash == hash) {
+                    n_reused++;
+                    next_cache[id] = Cached_Mesh{hash, topology, mesh.instance()};
+                    return mesh;
+                }
+            }
+        }
+        bool refit = cached && mesh.refit(src.verts, src.indices, &build_pool);
+        if(!cached) mesh.build(src.verts, src.indices, &build_pool);
+        std::lock_guard<std::mutex> lock(obj_mut);
+        if(refit) {
+            n_refit++;
+        } else {
+            add_stats(mesh.build_stats());
+        }
+        next_cache[id] = Cached_Mesh{hash, topology, mesh.instance()};
+        return mesh;
+    };
+
+    Uint64 stage = SDL_GetPerformanceCounter();
+    auto seconds = [&stage]() {
+        Uint64 now = SDL_GetPerformanceCounter();
+        float ret = (float)((now - stage) / (double)SDL_GetPerformanceFrequency());
+        stage = now;
+        return ret;
+    };
+
+    for(size_t i = 0; i < copy.items.size(); i++) {
+        const auto& item = copy.items[i];
+        if(auto obj = std::get_if<Object_Copy>(&item)) {
+
+            unsigned int idx = (unsigned int)out.materials.size();
+            const Material::Options& opt = obj->material;
 
             switch(opt.type) {
             case Material_Type::lambertian: {
-                materials.push_back(BSDF(BSDF_Lambertian(opt.albedo)));
+                out.materials.push_back(BSDF(BSDF_Lambertian(opt.albedo)));
             } break;
             case Material_Type::mirror: {
-                materials.push_back(BSDF(BSDF_Mirror(opt.reflectance)));
+                out.materials.push_back(BSDF(BSDF_Mirror(opt.reflectance)));
             } break;
             case Material_Type::refract: {
-                materials.push_back(BSDF(BSDF_Refract(opt.transmittance, opt.ior)));
+                out.materials.push_back(BSDF(BSDF_Refract(opt.transmittance, opt.ior)));
             } break;
             case Material_Type::glass: {
-                materials.push_back(BSDF(BSDF_Glass(opt.transmittance, opt.reflectance, opt.ior)));
+                out.materials.push_back(
+                    BSDF(BSDF_Glass(opt.transmittance, opt.reflectance, opt.ior)));
             } break;
             case Material_Type::diffuse_light: {
-                materials.push_back(BSDF(BSDF_Diffuse(obj.material.emissive())));
+                out.materials.push_back(BSDF(BSDF_Diffuse(obj->emissive)));
+                // build_lights samples emissive meshes as lights
+                if(!obj->shape) out.mat_cache[obj->id] = idx;
             } break;
-            default: return;
+            default: continue;
             }
 
-            thread_pool.enqueue([&, idx]() {
-                if(obj.is_shape()) {
-                    Shape shape(obj.opt.shape);
-                    std::lock_guard<std::mutex> lock(obj_mut);
-                    obj_list.push_back(
-                        Object(std::move(shape), obj.id(), idx, obj.pose.transform()));
+            tasks.push_back(build_pool.enqueue([&, obj, idx, i]() {
+                if(obj->shape) {
+                    Shape shape(*obj->shape);
+                    slots[i].push_back(Object(std::move(shape), obj->id, idx, obj->transform));
                 } else {
-                    Tri_Mesh mesh(obj.posed_mesh());
-                    std::lock_guard<std::mutex> lock(obj_mut);
-                    obj_list.push_back(
-                        Object(std::move(mesh), obj.id(), idx, obj.pose.transform()));
+                    Tri_Mesh mesh = get_mesh(obj->id, obj->mesh);
+                    slots[i].push_back(Object(std::move(mesh), obj->id, idx, obj->transform));
                 }
-            });
-
-        } else if(item.is<Scene_Particles>()) {
+            }));
 
-            Scene_Particles& particles = item.get<Scene_Particles>();
-            unsigned int idx = (unsigned int)materials.size();
-            materials.push_back(BSDF(BSDF_Diffuse(particles.opt.color)));
+        } else if(auto particles = std::get_if<Particles_Copy>(&item)) {
 
-            thread_pool.enqueue([&, idx]() {
-                Tri_Mesh mesh(particles.mesh());
+            unsigned int idx = (unsigned int)out.materials.size();
+            out.materials.push_back(BSDF(BSDF_Diffuse(particles->color)));
 
-                const auto& parts = particles.get_particles();
-                for(const Particle& p : parts) {
-                    Tri_Mesh copy = mesh.copy();
-                    Mat4 T = Mat4::translate(p.pos) * Mat4::scale(Vec3{particles.opt.scale});
+            tasks.push_back(build_pool.enqueue([&, particles, idx, i]() {
+                Tri_Mesh mesh = get_mesh(particles->id, particles->mesh);
 
-                    std::lock_guard<std::mutex> lock(obj_mut);
-                    obj_list.push_back(Object(std::move(copy), particles.id(), idx, T));
+                // Every particle is an instance of the one mesh BVH, differing
+                // only in its transform
+                for(Vec3 pos : particles->positions) {
+                    Mat4 T = Mat4::translate(pos) * Mat4::scale(Vec3{particles->scale});
+                    slots[i].push_back(Object(mesh.instance(), particles->id, idx, T));
                 }
-            });
+            }));
         }
-    });
+    }
 
-    thread_pool.wait();
-    build_lights(layout_scene, obj_list);
+    // This may itself run on the build pool, so rather than only waiting for
+    // the build tasks, it helps to run them
+    for(auto& task : tasks) {
+        while(task.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            if(!build_pool.run_one()) std::this_thread::yield();
+        }
+    }
+    float objects = seconds();
+
+    std::vector<Object> obj_list;
+    for(auto& slot : slots) {
+        for(Object& obj : slot) obj_list.push_back(std::move(obj));
+    }
+
+    // Entries for objects that no longer exist are dropped here
+    mesh_cache = std::move(next_cache);
 
-    scene.build(std::move(obj_list));
+    build_lights(copy, obj_list, out);
+    out.objects.build(std::move(obj_list), 1, &build_pool);
+    float top = seconds();
+
+    out.hash = copy.hash;
+
+    const BVH<Object>::Build_Stats& top_stats = out.objects.build_stats();
+    info("Scene BVH build: objects %.3fs (%zu/%zu meshes reused, %zu refit; mesh bounds %.3fs, "
+         "split %.3fs, reorder %.3fs, layout %.3fs), top level %.3fs (bounds %.3fs, split %.3fs, "
+         "reorder %.3fs, layout %.3fs)",
+         objects, n_reused, n_meshes, n_refit, mesh_stats.bounds, mesh_stats.split,
+         mesh_stats.reorder, mesh_stats.layout, top, top_stats.bounds, top_stats.split,
+         top_stats.reorder, top_stats.layout);
 }
 
 void Pathtracer::set_sizes(size_t w, size_t h, size_t samples, size_t area_samples, size_t depth) {
@@ -172,52 +512,501 @@ void Pathtracer::set_sizes(size_t w, size_t h, size_t samples, size_t area_sampl
     n_samples = samples;
     n_area_samples = area_samples;
     max_depth = depth;
-    accumulator.resize(out_w, out_h);
+    accumulator.assign(out_w * out_h, Spectrum{});
+    accumulator_sq.assign(out_w * out_h, 0.0f);
+    output.resize(out_w, out_h);
+    merged_passes = 0;
+    resolved_passes = 0;
+    set_region(0, 0, w, h);
+}
+
+void Pathtracer::set_region(size_t x, size_t y, size_t w, size_t h) {
+    std::fill(accumulator.begin(), accumulator.end(), Spectrum{});
+    std::fill(accumulator_sq.begin(), accumulator_sq.end(), 0.0f);
+    merged_passes++;
+    converged_tiles = 0;
+    x = std::min(x, out_w);
+    y = std::min(y, out_h);
+    build_tiles(x, y, std::min(w, out_w - x), std::min(h, out_h - y));
+    clear_layers();
+}
+
+void Pathtracer::set_noise_threshold(float threshold) {
+    noise_threshold = threshold;
+}
+
+void Pathtracer::set_time_limit(float seconds) {
+    time_limit = seconds;
+}
+
+bool Pathtracer::past_deadline() const {
+    return deadline && SDL_GetPerformanceCounter() >= deadline;
+}
+
+void Pathtracer::build_tiles(size_t x0, size_t y0, size_t w, size_t h) {
+
+    // Start with large tiles and split them until each render thread has several
+    // to pull from, so that small images still balance across all cores.
+    size_t n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    size_t size = 64;
+    auto n_tiles = [w, h](size_t s) { return ((w + s - 1) / s) * ((h + s - 1) / s); };
+    while(size > 8 && n_tiles(size) < 8 * n_threads) size /= 2;
+
+    tiles.clear();
+    for(size_t y = y0; y < y0 + h; y += size) {
+        for(size_t x = x0; x < x0 + w; x += size) {
+            Tile& tile = tiles.emplace_back();
+            tile.x = x;
+            tile.y = y;
+            tile.w = std::min(size, x0 + w - x);
+            tile.h = std::min(size, y0 + h - y);
+        }
+    }
 }
 
 void Pathtracer::log_ray(const Ray& ray, float t, Spectrum color) {
     gui.log_ray(ray, t, color);
 }
 
-void Pathtracer::accumulate(const HDR_Image& sample) {
+float Pathtracer::light_pdf(Vec3 from, Vec3 normal, const Trace& hit) const {
+
+    if(!hit.hit || (size_t)hit.material >= emitters.size()) return 0.0f;
+    const Emitter& emitter = emitters[hit.material];
+    if(emitter.first == Emitter::none) return 0.0f;
+
+    size_t light = emitter.first + (emitter.per_tri ? hit.tri : 0);
+    float pmf = light_tree.pmf(from, normal, light);
+    if(pmf <= 0.0f) return 0.0f;
+    return n_area_samples * pmf * lights[light].pdf(from, hit.position);
+}
+
+float Pathtracer::env_pdf(Vec3 dir) const {
+    if(!env_light.has_value()) return 0.0f;
+    return n_area_samples * env_light.value().pdf(dir);
+}
+
+void Pathtracer::set_sampler(RNG::Sequence seq, uint32_t s) {
+    sequence = seq;
+    seed = s;
+}
+
+void Pathtracer::set_denoise(bool enable) {
+    denoising = enable;
+}
+
+const AOVs* Pathtracer::get_aovs() const {
+    if(!aov_tiles || traced_aovs < aov_tiles) return nullptr;
+    return &aovs;
+}
+
+void Pathtracer::trace_aovs(const Tile& tile) {
+
+    // A few jittered rays per pixel antialias the features as the samples do the
+    // image. They draw from their own seed, so they don't repeat any sample.
+    constexpr uint32_t rays = 4;
+    Vec2 wh((float)out_w, (float)out_h);
 
-    std::lock_guard<std::mutex> lock(accumulator_mut);
+    for(size_t y = tile.y; y < tile.y + tile.h; y++) {
+        if(cancel_flag) return;
+        for(size_t x = tile.x; x < tile.x + tile.w; x++) {
 
-    accumulator_samples++;
-    for(size_t j = 0; j < out_h; j++) {
-        for(size_t i = 0; i < out_w; i++) {
-            Spectrum& s = accumulator.at(i, j);
-            const Spectrum& n = sample.at(i, j);
-            s += (n - s) * (1.0f / accumulator_samples);
+            size_t idx = y * out_w + x;
+            Spectrum albedo;
+            Vec3 normal;
+            float depth = 0.0f;
+            for(uint32_t s = 0; s < rays; s++) {
+                RNG::begin_sample(sequence, ~seed, idx, s);
+                Vec2 xy((float)x + RNG::unit(), (float)y + RNG::unit());
+                Ray ray = camera.generate_ray(xy / wh);
+                Trace hit = scene.hit(ray);
+                if(!hit.hit) continue;
+
+                // Two-sided surfaces face the camera, as they are shaded
+                const BSDF& bsdf = materials[hit.material];
+                if(!bsdf.is_sided() && dot(hit.normal, ray.dir) > 0.0f) hit.normal = -hit.normal;
+                albedo += bsdf.albedo();
+                normal += hit.normal;
+                depth += hit.distance;
+            }
+
+            aovs.albedo[idx] = albedo * (1.0f / rays);
+            aovs.normal[idx] = normal.norm_squared() > 0.0f ? normal.unit() : Vec3{};
+            aovs.depth[idx] = depth / rays;
         }
     }
 }
 
-void Pathtracer::do_trace(size_t samples) {
+void Pathtracer::trace_preview(Tile& tile, size_t level, std::vector<Spectrum>& out) {
+
+    // One sample from the middle of each block fills the block. Preview samples
+    // take the last sample indices, so they don't repeat the passes' samples.
+    size_t block = preview_blocks[level];
+    out.resize(tile.w * tile.h);
+    for(size_t j = 0; j < tile.h; j += block) {
+        for(size_t i = 0; i < tile.w; i += block) {
+            if(cancel_flag) return;
+
+            size_t x = tile.x + std::min(i + block / 2, tile.w - 1);
+            size_t y = tile.y + std::min(j + block / 2, tile.h - 1);
+            RNG::begin_sample(sequence, seed, (uint64_t)y * out_w + x,
+                              UINT32_MAX - (uint32_t)level);
+            Spectrum p = trace_pixel(x, y);
+            if(!p.valid()) p = Spectrum{};
 
-    HDR_Image sample(out_w, out_h);
-    for(size_t j = 0; j < out_h; j++) {
-        for(size_t i = 0; i < out_w; i++) {
+            for(size_t v = j; v < std::min(j + block, tile.h); v++) {
+                std::fill_n(&out[v * tile.w + i], std::min(block, tile.w - i), p);
+            }
+        }
+    }
 
+    // Passes finish out of order, and a coarser one mustn't cover a finer one
+    std::lock_guard<std::mutex> lock(tile.mut);
+    if(tile.preview_block && tile.preview_block <= block) return;
+    tile.preview_block = block;
+    for(size_t j = 0; j < tile.h; j++) {
+        std::copy_n(&out[j * tile.w], tile.w, &preview_pixels[(tile.y + j) * out_w + tile.x]);
+    }
+    merged_passes++;
+}
+
+bool Pathtracer::do_trace(const Tile& tile, size_t first, Pass& pass) {
+
+    if(wavefront) return trace_wavefront(tile, first, pass);
+    if(first == 0 && !layer_depth.empty()) trace_first_hits(tile);
+
+    size_t samples = pass.samples;
+    std::vector<Spectrum>& out = pass.sums;
+    std::vector<float>& out_sq = pass.sums_sq;
+    out.resize(tile.w * tile.h);
+    out_sq.resize(tile.w * tile.h);
+    pass.layers.clear();
+
+    for(size_t j = 0; j < tile.h; j++) {
+
+        // A pass cut off by the deadline is dropped, like a cancelled one
+        if(past_deadline()) return false;
+
+        for(size_t i = 0; i < tile.w; i++) {
+
+            Spectrum sum;
+            float sum_sq = 0.0f;
             size_t sampled = 0;
+            uint64_t pixel = (uint64_t)(tile.y + j) * out_w + tile.x + i;
             for(size_t s = 0; s < samples; s++) {
 
-                Spectrum p = trace_pixel(i, j);
+                RNG::begin_sample(sequence, seed, pixel, (uint32_t)(first + s));
+                Spectrum p = trace_pixel(tile.x + i, tile.y + j);
                 if(p.valid()) {
-                    sample.at(i, j) += p;
+                    sum += p;
+                    sum_sq += p.luma() * p.luma();
                     sampled++;
                 }
 
-                if(cancel_flag) return;
+                if(cancel_flag) return false;
+            }
+
+            // Store the pass as a sum of `samples` samples so that merging is a plain add
+            float scale = sampled ? (float)samples / sampled : 0.0f;
+            out[j * tile.w + i] = sum * scale;
+            out_sq[j * tile.w + i] = sum_sq * scale;
+        }
+    }
+    return true;
+}
+
+void Pathtracer::merge(Tile& tile, size_t pass_idx, Pass& pass) {
+
+    std::lock_guard<std::mutex> lock(tile.mut);
+
+    // Time-limited renders drop whichever passes the deadline cuts off, so their
+    // sums depend on timing anyway and are merged as they finish
+    if(!deadline && pass_idx != tile.next_pass) {
+        std::swap(tile.held[pass_idx], pass);
+        return;
+    }
+
+    accumulate(tile, pass);
+    for(auto it = tile.held.begin(); it != tile.held.end() && it->first == tile.next_pass;
+        it = tile.held.erase(it)) {
+        accumulate(tile, it->second);
+    }
+}
+
+void Pathtracer::accumulate(Tile& tile, const Pass& pass) {
+
+    // Passes skipped over a converged tile only move the order along
+    tile.next_pass++;
+    if(!pass.samples) return;
+
+    for(size_t j = 0; j < tile.h; j++) {
+        size_t row = (tile.y + j) * out_w + tile.x;
+        Spectrum* dst = &accumulator[row];
+        float* dst_sq = &accumulator_sq[row];
+        const Spectrum* src = &pass.sums[j * tile.w];
+        const float* src_sq = &pass.sums_sq[j * tile.w];
+        for(size_t i = 0; i < tile.w; i++) {
+            dst[i] += src[i];
+            dst_sq[i] += src_sq[i];
+        }
+    }
+    if(!pass.layers.empty()) {
+        size_t n = tile.w * layer_colors;
+        for(size_t j = 0; j < tile.h; j++) {
+            Spectrum* dst = &layer_accumulator[((tile.y + j) * out_w + tile.x) * layer_colors];
+            const Spectrum* src = &pass.layers[j * n];
+            for(size_t i = 0; i < n; i++) dst[i] += src[i];
+        }
+        tile.layer_samples += pass.samples;
+    }
+    tile.samples += pass.samples;
+    merged_passes++;
+
+    update_converged(tile);
+}
+
+void Pathtracer::update_converged(Tile& tile) {
+
+    // Too few samples give an unreliable variance, so tiles always get this many
+    constexpr size_t min_samples = 16;
+
+    bool converged = false;
+    if(noise_threshold > 0.0f && tile.samples >= min_samples) {
+        converged = tile_error(tile) < noise_threshold;
+    }
+    if(converged != tile.converged.exchange(converged)) {
+        if(converged)
+            converged_tiles++;
+        else
+            converged_tiles--;
+    }
+}
+
+float Pathtracer::tile_error(const Tile& tile) const {
+
+    // RMS over the tile of each pixel's relative standard error. Pixels darker
+    // than this are judged against it instead, so that noise in near-black
+    // regions isn't measured relative to almost nothing.
+    constexpr float dark = 0.02f;
+
+    float n = (float)tile.samples;
+    float sum = 0.0f;
+    for(size_t j = tile.y; j < tile.y + tile.h; j++) {
+        for(size_t i = tile.x; i < tile.x + tile.w; i++) {
+            size_t idx = j * out_w + i;
+            float mean = accumulator[idx].luma() / n;
+            float var = std::max(accumulator_sq[idx] / n - mean * mean, 0.0f) * n / (n - 1.0f);
+            float err = std::sqrt(var / n) / std::max(mean, dark);
+            sum += err * err;
+        }
+    }
+    return std::sqrt(sum / (tile.w * tile.h));
+}
+
+Pathtracer::Tile* Pathtracer::next_noisy_tile() {
+
+    // Taken in turn, so that the passes are shared evenly between noisy tiles
+    for(size_t i = 0; i < tiles.size(); i++) {
+        Tile& tile = tiles[next_noisy++ % tiles.size()];
+        if(!tile.converged) return &tile;
+    }
+    return nullptr;
+}
+
+void Pathtracer::do_work() {
+
+    // Each worker traces into its own buffer, which is never shared; the tile
+    // lock is only held for the merge at the end of each pass.
+    Pass pass;
+
+    auto trace_all_aovs = [this]() {
+        for(;;) {
+            size_t t = next_aov.fetch_add(1);
+            if(t >= aov_tiles || cancel_flag) break;
+            trace_aovs(tiles[t]);
+
+            // The last tile's AOVs make the output denoised
+            if(traced_aovs.fetch_add(1) + 1 == aov_tiles) merged_passes++;
+        }
+    };
+
+    // A preview's AOVs wait for its coarse passes, so that those show first
+    if(!previewing) trace_all_aovs();
+    bool aovs_taken = !previewing;
+
+    for(;;) {
+        size_t work = next_work.fetch_add(1);
+        if(work >= total_work || cancel_flag || past_deadline()) break;
+
+        // A preview's coarse passes come first, each over every tile in turn
+        if(work < preview_items) {
+            trace_preview(tiles[work % tiles.size()], work / tiles.size(), pass.sums);
+            completed_work++;
+            continue;
+        }
+        work -= preview_items;
+        if(!aovs_taken) {
+            trace_all_aovs();
+            aovs_taken = true;
+        }
+        if(converged_tiles == tiles.size()) break;
+
+        size_t n = work / tiles.size();
+        Tile* tile = &tiles[work % tiles.size()];
+        size_t samples = deadline ? samples_per_pass
+                                  : pass_samples(tile->first_sample, tile->target_samples, n,
+                                                 samples_per_pass);
+
+        // A converged tile's pass goes to the next tile that is still noisy, after
+        // that tile's own passes. Time-limited renders don't need to: skipped
+        // passes take no time, which is left to the noisy tiles anyway.
+        if(tile->converged && !deadline) {
+            pass.samples = 0;
+            merge(*tile, n, pass);
+            Tile* noisy = next_noisy_tile();
+            if(!noisy) {
+                completed_work++;
+                continue;
+            }
+            tile = noisy;
+            n = tile_passes + tile->extra_passes++;
+        }
+
+        pass.samples = tile->converged ? 0 : samples;
+        if(pass.samples && !do_trace(*tile, tile->first_sample + n * samples_per_pass, pass))
+            break;
+        merge(*tile, n, pass);
+        completed_work++;
+    }
+
+    // Any a preview left, if its passes ran out first
+    trace_all_aovs();
+
+    if(running_workers.fetch_sub(1) == 1 && !cancel_flag) {
+        render_time = SDL_GetPerformanceCounter() - render_start;
+    }
+}
+
+void Pathtracer::resolve(size_t begin, size_t end, bool to_noisy) {
+
+    Spectrum* dst = to_noisy ? noisy.data() : output.data();
+
+    for(size_t t = begin; t < end; t++) {
+        Tile& tile = tiles[t];
+        std::lock_guard<std::mutex> lock(tile.mut);
+
+        if(!tile.samples && tile.preview_block) {
+            for(size_t j = tile.y; j < tile.y + tile.h; j++) {
+                size_t row = j * out_w + tile.x;
+                std::copy_n(&preview_pixels[row], tile.w, &dst[row]);
+                if(!to_noisy) continue;
+                for(size_t i = row; i < row + tile.w; i++) {
+                    noisy_var[i] = dst[i].luma() * dst[i].luma() + 1.0f;
+                }
+            }
+            continue;
+        }
+
+        float n = (float)tile.samples;
+        float scale = tile.samples ? 1.0f / n : 0.0f;
+        for(size_t j = tile.y; j < tile.y + tile.h; j++) {
+            for(size_t i = tile.x; i < tile.x + tile.w; i++) {
+                size_t idx = j * out_w + i;
+                dst[idx] = accumulator[idx] * scale;
+                if(!to_noisy) continue;
+
+                // Of the mean, which falls with the number of samples; pixels with
+                // too few to tell are taken to be very noisy
+                float mean = dst[idx].luma();
+                float var = n > 1.0f ? std::max(accumulator_sq[idx] / n - mean * mean, 0.0f) /
+                                           (n - 1.0f)
+                                     : mean * mean + 1.0f;
+                noisy_var[idx] = var;
+            }
+        }
+    }
+}
+
+void Pathtracer::update_output() {
+
+    size_t version = merged_passes.load();
+    bool running = in_progress();
+
+    if(version != resolved_passes) {
+
+        // Checked once, since the last AOVs may be traced while resolving
+        bool to_noisy = get_aovs() != nullptr;
+
+        if(running) {
+            // Render threads are busy; take the snapshot here, holding each tile's
+            // lock only while copying that tile.
+            resolve(0, tiles.size(), to_noisy);
+        } else {
+            size_t n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+            size_t per_thread = (tiles.size() + n_threads - 1) / n_threads;
+            for(size_t t = 0; t < tiles.size(); t += per_thread) {
+                size_t end = std::min(t + per_thread, tiles.size());
+                thread_pool.enqueue([this, t, end, to_noisy]() { resolve(t, end, to_noisy); });
+            }
+            thread_pool.wait();
+        }
+        resolved_passes = version;
+        denoise_pending = to_noisy;
+    }
+
+    // Only the region's pixels are denoised into the output
+    auto take = [this](const std::vector<Spectrum>& result) {
+        Spectrum* dst = output.data();
+        for(const Tile& tile : tiles) {
+            for(size_t j = tile.y; j < tile.y + tile.h; j++) {
+                size_t row = j * out_w;
+                std::copy_n(&result[row + tile.x], tile.w, &dst[row + tile.x]);
             }
-            sample.at(i, j) *= (1.0f / sampled);
         }
+    };
+
+    // Results of renders that have since been restarted are dropped. Once the
+    // render is done, one still running may hold its last passes, so it is waited for.
+    if(denoising_task.valid() &&
+       (!running ||
+        denoising_task.wait_for(std::chrono::seconds(0)) == std::future_status::ready)) {
+        auto [render, result] = denoising_task.get();
+        if(render == renders) take(result);
+    }
+
+    // A render started since may not have its AOVs yet; its resolve will set this again
+    const AOVs* features = get_aovs();
+    if(!denoise_pending || !features) return;
+
+    if(running) {
+        unsigned long long now = SDL_GetPerformanceCounter();
+        if(denoising_task.valid() ||
+           now - last_denoise < denoise_interval * SDL_GetPerformanceFrequency())
+            return;
+
+        // Denoised from copies, as the workers keep writing to these
+        auto color = std::make_shared<std::vector<Spectrum>>(noisy);
+        auto var = std::make_shared<std::vector<float>>(noisy_var);
+        auto guide = std::make_shared<AOVs>(*features);
+        denoising_task = build_pool.enqueue([color, var, guide, render = renders]() {
+            std::vector<Spectrum> result(color->size());
+            denoise(color->data(), var->data(), *guide, result.data(), nullptr);
+            return std::make_pair(render, std::move(result));
+        });
+        denoise_pending = false;
+        last_denoise = now;
+        return;
     }
-    accumulate(sample);
+
+    // The finished render is denoised on every thread
+    std::vector<Spectrum> result(noisy.size());
+    denoise(noisy.data(), noisy_var.data(), *features, result.data(), &thread_pool);
+    take(result);
+    denoise_pending = false;
+    last_denoise = SDL_GetPerformanceCounter();
 }
 
 bool Pathtracer::in_progress() const {
-    return completed_epochs.load() < total_epochs;
+    return running_workers.load() > 0;
 }
 
 std::pair<float, float> Pathtracer::completion_time() const {
@@ -226,7 +1015,21 @@ std::pair<float, float> Pathtracer::completion_time() const {
 }
 
 float Pathtracer::progress() const {
-    return (float)completed_epochs.load() / (float)total_epochs;
+    if(deadline) {
+        double elapsed = (double)(SDL_GetPerformanceCounter() - render_start);
+        return std::min((float)(elapsed / (deadline - render_start)), 1.0f);
+    }
+    return (float)completed_work.load() / (float)total_work;
+}
+
+float Pathtracer::average_samples() {
+    if(tiles.empty()) return 0.0f;
+    size_t total = 0;
+    for(Tile& tile : tiles) {
+        std::lock_guard<std::mutex> lock(tile.mut);
+        total += tile.samples * tile.w * tile.h;
+    }
+    return (float)total / (out_w * out_h);
 }
 
 size_t Pathtracer::visualize_bvh(GL::Lines& lines, GL::Lines& active, size_t depth) {
@@ -235,53 +1038,352 @@ size_t Pathtracer::visualize_bvh(GL::Lines& lines, GL::Lines& active, size_t dep
 
 void Pathtracer::begin_render(Scene& layout_scene, const Camera& cam, bool add_samples) {
 
-    size_t n_threads = std::thread::hardware_concurrency();
-    size_t samples_per_epoch = std::max(size_t(1), n_samples / (n_threads * 10));
-
     cancel();
-    total_epochs = n_samples / samples_per_epoch + !!(n_samples % samples_per_epoch);
+    previewing = false;
 
     if(!add_samples) {
-        accumulator.clear({});
-        accumulator_samples = 0;
-        build_time = SDL_GetPerformanceCounter();
-        build_scene(layout_scene);
-        build_time = SDL_GetPerformanceCounter() - build_time;
-    }
-    render_time = SDL_GetPerformanceCounter();
-    
+        prepare_scene(layout_scene);
+        begin_prepared(cam);
+        return;
+    }
+
+    camera = cam;
+    start_work(n_samples);
+}
+
+bool Pathtracer::preview(Scene& layout_scene, const Camera& cam, bool restart) {
+
+    // A finished build is swapped in, restarting the preview with it
+    bool built = building.valid() &&
+                 building.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    uint64_t key = hash_camera(cam, settings_hash(built ? building_hash : scene_hash));
+    bool start = !previewing || restart || built || key != preview_key;
+
+    if(start) {
+        cancel();
+        if(built) use_prepared();
+        previewing = true;
+        preview_key = key;
+        restart_work(cam);
+    }
+
+    // Hashing the scene is far cheaper than building it. Edits made during a
+    // build are built once it has been swapped in.
+    if(!building.valid() && hash_scene(layout_scene) != scene_hash) prepare_scene(layout_scene);
+    return start;
+}
+
+void Pathtracer::prepare_scene(Scene& layout_scene) {
+
+    // Already being built
+    uint64_t hash = hash_scene(layout_scene);
+    if(building.valid() && building_hash == hash) return;
+    finish_build();
+
+    // Builds run on their own pool, leaving the render's workers undisturbed
+    Uint64 start = SDL_GetPerformanceCounter();
+    auto copy = std::make_shared<Scene_Copy>();
+    copy_scene(layout_scene, *copy);
+    copy->hash = hash;
+    prepared.emplace();
+    building_hash = hash;
+    building = build_pool.enqueue([this, copy, start]() {
+        build_scene(*copy, *prepared);
+        prepared->build_time = SDL_GetPerformanceCounter() - start;
+    });
+}
+
+void Pathtracer::finish_build() {
+    if(building.valid()) building.get();
+}
+
+void Pathtracer::use_prepared() {
+
+    finish_build();
+    if(!prepared) return;
+
+    scene = std::move(prepared->objects);
+    lights = std::move(prepared->lights);
+    light_tree = std::move(prepared->light_tree);
+    materials = std::move(prepared->materials);
+    env_light = std::move(prepared->env_light);
+    mat_cache = std::move(prepared->mat_cache);
+    emitters = std::move(prepared->emitters);
+    light_group = std::move(prepared->light_group);
+    group_names = std::move(prepared->group_names);
+    env_group = prepared->env_group;
+    scene_hash = prepared->hash;
+    build_time = prepared->build_time;
+    prepared.reset();
+}
+
+void Pathtracer::begin_prepared(const Camera& cam) {
+    cancel();
+    use_prepared();
+    restart_work(cam);
+}
+
+void Pathtracer::restart_work(const Camera& cam) {
+
+    std::fill(accumulator.begin(), accumulator.end(), Spectrum{});
+    std::fill(accumulator_sq.begin(), accumulator_sq.end(), 0.0f);
+    for(Tile& tile : tiles) tile.samples = 0;
+    clear_layers();
+    merged_passes++;
+
     camera = cam;
+    start_work(n_samples);
+}
+
+void Pathtracer::start_work(size_t samples, bool top_up) {
+
+    size_t n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    // The threshold may have changed since these samples were taken. Sample
+    // indices carry on from the samples tiles already have, so added samples
+    // draw new points rather than repeating the earlier ones. With top_up, each
+    // tile only takes what it needs to reach samples.
+    size_t most = 0;
+    for(Tile& tile : tiles) {
+        update_converged(tile);
+        tile.first_sample = tile.samples;
+        tile.target_samples = top_up ? std::max(samples, tile.samples) : tile.samples + samples;
+        most = std::max(most, tile.target_samples - tile.samples);
+        tile.next_pass = 0;
+        tile.extra_passes = 0;
+        tile.held.clear();
+    }
+
+    start_layers();
+
+    // The AOVs are traced again, as the scene or camera may have changed
+    renders++;
+    aov_tiles = denoising ? tiles.size() : 0;
+    next_aov = 0;
+    traced_aovs = 0;
+    if(denoising) {
+        aovs.resize(out_w, out_h);
+        noisy.assign(out_w * out_h, Spectrum{});
+        noisy_var.assign(out_w * out_h, 0.0f);
+    }
+
+    // Every tile gets a pass before any tile gets its next, so the whole image
+    // refines progressively rather than one region at a time.
+    samples_per_pass = std::max(size_t(1), n_samples / 16);
+
+    // Previews refine from coarse blocks, then by single samples, which show
+    // sooner than larger passes would
+    preview_items = 0;
+    for(Tile& tile : tiles) tile.preview_block = 0;
+    if(previewing) {
+        samples_per_pass = 1;
+        preview_items = std::size(preview_blocks) * tiles.size();
+        preview_pixels.resize(out_w * out_h);
+    }
+
+    tile_passes = most / samples_per_pass + !!(most % samples_per_pass);
+    next_noisy = 0;
+    total_work = preview_items + tile_passes * tiles.size();
+    next_work = 0;
+    completed_work = 0;
+
+    render_start = SDL_GetPerformanceCounter();
+    render_time = 0;
+    deadline = 0;
+    if(time_limit > 0.0f && !tiles.empty()) {
+        deadline = render_start + (Uint64)(time_limit * SDL_GetPerformanceFrequency());
+        total_work = SIZE_MAX;
+    }
+
+    running_workers = n_threads;
+    for(size_t i = 0; i < n_threads; i++) {
+        thread_pool.enqueue([this]() { do_work(); });
+    }
+}
+
+uint64_t Pathtracer::render_hash() const {
+    uint64_t h = hash_camera(camera, scene_hash);
+    auto add = [&h](const auto& v) { h = hash_words(&v, sizeof(v), h); };
+    add((uint64_t)out_w);
+    add((uint64_t)out_h);
+    add((uint64_t)n_area_samples);
+    add((uint64_t)max_depth);
+    return h;
+}
 
-    for(size_t s = 0; s < n_samples; s += samples_per_epoch) {
-        size_t samples = (s + samples_per_epoch) > n_samples ? n_samples - s : samples_per_epoch;
-        thread_pool.enqueue([samples, this]() {
-            do_trace(samples);
-            size_t completed = completed_epochs.fetch_add(1);
-            if(completed + 1 == total_epochs) {
-                Uint64 done = SDL_GetPerformanceCounter();
-                render_time = done - render_time;
+Checkpoint::Header Pathtracer::checkpoint_header() const {
+    Checkpoint::Header header;
+    header.hash = render_hash();
+    header.w = out_w;
+    header.h = out_h;
+    header.layers = layer_bits(layers);
+    header.layer_colors = layer_colors;
+    header.seed = seed;
+    header.sequence = (uint32_t)sequence;
+    header.wavefront = wavefront;
+    header.noise_threshold = noise_threshold;
+    return header;
+}
+
+std::string Pathtracer::save_checkpoint(const std::string& path) {
+
+    Checkpoint checkpoint;
+    checkpoint.header = checkpoint_header();
+
+    // Each tile is copied under its lock, so a checkpoint taken mid-render holds
+    // whole passes only. The exception is the first-hit layers of tiles with no
+    // samples yet, which resuming traces again anyway.
+    for(Tile& tile : tiles) {
+        std::lock_guard<std::mutex> lock(tile.mut);
+        Checkpoint::Tile& saved = checkpoint.tiles.emplace_back();
+        saved.x = tile.x;
+        saved.y = tile.y;
+        saved.w = tile.w;
+        saved.h = tile.h;
+        saved.samples = tile.samples;
+        saved.layer_samples = tile.layer_samples;
+        auto rows = [&](const auto& buffer, auto& dst, size_t per_pixel) {
+            for(size_t j = tile.y; j < tile.y + tile.h; j++) {
+                auto row = buffer.begin() + (j * out_w + tile.x) * per_pixel;
+                dst.insert(dst.end(), row, row + tile.w * per_pixel);
             }
-        });
+        };
+        rows(accumulator, saved.sums, 1);
+        rows(accumulator_sq, saved.sums_sq, 1);
+        if(layer_colors) rows(layer_accumulator, saved.layer_sums, layer_colors);
+        if(!layer_depth.empty()) {
+            rows(layer_depth, saved.depth, 1);
+            rows(layer_object, saved.object, 1);
+            rows(layer_material, saved.material, 1);
+        }
+    }
+    return checkpoint.save(path);
+}
+
+std::string Pathtracer::load_checkpoint(const std::string& path, bool replace) {
+
+    // The layers' buffers are sized for the current selection, which the file has to match
+    start_layers();
+    bool first_hits = !layer_depth.empty();
+
+    std::vector<Checkpoint::Tile> merged;
+    if(!replace) {
+        for(const Tile& tile : tiles) {
+            Checkpoint::Tile& bounds = merged.emplace_back();
+            bounds.x = tile.x;
+            bounds.y = tile.y;
+            bounds.w = tile.w;
+            bounds.h = tile.h;
+        }
+    }
+
+    Checkpoint checkpoint;
+    std::string err = checkpoint.load(path, checkpoint_header(), first_hits, merged);
+    if(!err.empty()) return err;
+
+    // The tiling depends on the core count of the machine that saved it, so
+    // the saved tiles are taken as they are.
+    if(replace) {
+        tiles.clear();
+        std::fill(accumulator.begin(), accumulator.end(), Spectrum{});
+        std::fill(accumulator_sq.begin(), accumulator_sq.end(), 0.0f);
+        converged_tiles = 0;
+        clear_layers();
+    }
+    for(const Checkpoint::Tile& saved : checkpoint.tiles) {
+        Tile& tile = tiles.emplace_back();
+        tile.x = saved.x;
+        tile.y = saved.y;
+        tile.w = saved.w;
+        tile.h = saved.h;
+        tile.samples = saved.samples;
+        tile.layer_samples = saved.layer_samples;
+        auto rows = [&tile, this](const auto& src, auto& dst, size_t per_pixel) {
+            size_t n = tile.w * per_pixel;
+            for(size_t j = 0; j < tile.h; j++) {
+                size_t row = ((tile.y + j) * out_w + tile.x) * per_pixel;
+                std::copy_n(src.data() + j * n, n, dst.data() + row);
+            }
+        };
+        rows(saved.sums, accumulator, 1);
+        rows(saved.sums_sq, accumulator_sq, 1);
+        rows(saved.layer_sums, layer_accumulator, layer_colors);
+        if(first_hits) {
+            rows(saved.depth, layer_depth, 1);
+            rows(saved.object, layer_object, 1);
+            rows(saved.material, layer_material, 1);
+        }
+    }
+    merged_passes++;
+    return {};
+}
+
+std::string Pathtracer::resume(Scene& layout_scene, const Camera& cam, const std::string& path) {
+
+    cancel();
+    previewing = false;
+
+    prepare_scene(layout_scene);
+    use_prepared();
+    camera = cam;
+
+    std::string err = load_checkpoint(path, true);
+    if(!err.empty()) return err;
+
+    // Tiles that were a pass ahead when it was saved take a pass less
+    start_work(n_samples, true);
+    return {};
+}
+
+std::string Pathtracer::merge_checkpoints(Scene& layout_scene, const Camera& cam,
+                                          const std::vector<std::string>& paths) {
+
+    cancel();
+    previewing = false;
+
+    // A process that rendered part of the frame has built the scene already
+    if(hash_scene(layout_scene) != scene_hash) {
+        prepare_scene(layout_scene);
+        use_prepared();
     }
+    camera = cam;
+
+    set_region(0, 0, 0, 0);
+    for(const std::string& path : paths) {
+        std::string err = load_checkpoint(path, false);
+        if(!err.empty()) return err;
+    }
+
+    // Only the AOVs are traced, if denoising, so no deadline is set
+    float limit = std::exchange(time_limit, 0.0f);
+    start_work(0);
+    time_limit = limit;
+    return {};
 }
 
 void Pathtracer::cancel() {
+
+    // Workers stop at their next check of the flag, and any still queued return
+    // as soon as they start, so there is no need to stop and restart the pool
+    bool running = in_progress();
     cancel_flag = true;
-    thread_pool.clear();
-    completed_epochs = 0;
-    total_epochs = 0;
+    thread_pool.wait();
+    completed_work = 0;
+    total_work = 0;
+    running_workers = 0;
     cancel_flag = false;
     build_time = 0;
-    render_time = SDL_GetPerformanceCounter() - render_time;
+    if(running) render_time = SDL_GetPerformanceCounter() - render_start;
 }
 
 const HDR_Image& Pathtracer::get_output() {
-    return accumulator;
+    update_output();
+    return output;
 }
 
 const GL::Tex2D& Pathtracer::get_output_texture(float exposure) {
-    std::lock_guard<std::mutex> lock(accumulator_mut);
-    return accumulator.get_texture(exposure);
+    update_output();
+    return output.get_texture(exposure);
 }
 
 } // namespace PT
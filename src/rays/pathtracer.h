@@ -2,17 +2,26 @@
 #pragma once
 
 #include <atomic>
+#include <deque>
+#include <future>
+#include <map>
 #include <mutex>
 #include <unordered_map>
+#include <variant>
 
 #include "../lib/mathlib.h"
 #include "../scene/scene.h"
 #include "../util/hdr_image.h"
+#include "../util/rand.h"
 #include "../util/thread_pool.h"
 
 #include "bsdf.h"
+#include "checkpoint.h"
+#include "denoise.h"
 #include "env_light.h"
+#include "layers.h"
 #include "light.h"
+#include "light_tree.h"
 #include "object.h"
 
 namespace Gui {
@@ -28,47 +37,381 @@ public:
 
     void set_sizes(size_t w, size_t h, size_t pixel_samples, size_t area_samples, size_t depth);
 
+    // When above zero, a tile stops taking samples once the RMS relative error
+    // of its pixels falls below this. Passes it would have taken go to the tiles
+    // still above it instead, so pixel_samples becomes an average over the image
+    // rather than a count for every pixel.
+    void set_noise_threshold(float threshold);
+
+    // When above zero, renders run for this many seconds instead, taking passes
+    // of pixel_samples / 16 samples until the time is up.
+    void set_time_limit(float seconds);
+
+    // When set, passes are traced by the wavefront integrator in wavefront.cpp,
+    // which runs each bounce of a whole pass as a batch, instead of trace_pixel.
+    void set_wavefront(bool enable);
+
+    // Samples draw from the given sequence, keyed by seed, pixel and sample index.
+    // With the same seed, sample counts and no noise threshold or time limit, a
+    // render comes out bit for bit the same however many threads trace it.
+    void set_sampler(RNG::Sequence sequence, uint32_t seed);
+
+    // When set, the output is denoised (see denoise.h), guided by AOVs that the
+    // render workers trace before their first pass. Until those are done, the
+    // output is left noisy.
+    void set_denoise(bool enable);
+
+    // The AOVs of the current render, or null if they aren't traced (yet)
+    const AOVs* get_aovs() const;
+
+    // Selects the render layers (see layers.h) that following renders accumulate.
+    // Only the wavefront integrator splits its samples into layers, so those
+    // (Layers::splits) are left empty unless it is set; callers refuse them.
+    void set_layers(const Layers& layers);
+
+    // Writes the output and the selected layers to a multi-layer EXR: color in
+    // half floats, and depth and IDs in full floats, which they need to be exact.
+    // Returns an error message, or an empty string on success.
+    std::string save_exr(const std::string& path);
+
     const HDR_Image& get_output();
     const GL::Tex2D& get_output_texture(float exposure);
     size_t visualize_bvh(GL::Lines& lines, GL::Lines& active, size_t level);
 
     void begin_render(Scene& scene, const Camera& camera, bool add_samples = false);
+
+    // Interactive preview, to be called every frame: if the camera or settings
+    // have changed since the last call, or restart is set, the render in progress
+    // is abandoned and the preview starts over. An edited scene is rebuilt in the
+    // background while the preview of the scene as it was keeps refining, and
+    // the preview starts over with it once it's built. It first traces one sample
+    // per 8x8 block of pixels, then per 4x4 and 2x2 block, before passes of one
+    // sample per pixel refine it up to pixel_samples. When denoising, its AOVs are
+    // traced after the coarse passes, and the passes over every pixel are
+    // denoised. Returns whether it started over.
+    bool preview(Scene& scene, const Camera& camera, bool restart = false);
+
+    // Copies what the build needs from the scene, then builds it on the build pool
+    // without disturbing the render in progress, so that animations can build
+    // frame N + 1 while frame N traces and the scene may be edited meanwhile.
+    // begin_prepared then starts rendering it, as begin_render would, waiting for
+    // the build to finish if it hasn't yet.
+    void prepare_scene(Scene& scene);
+    void begin_prepared(const Camera& camera);
+
+    // Checkpoints hold the accumulated samples and layers of the current render.
+    // Resuming builds the scene, loads the checkpoint and takes the samples it is
+    // still missing, so each tile ends with pixel_samples as it would have had
+    // the render not been stopped; the scene, camera, settings (the seed, sampler,
+    // integrator and noise threshold included) and selected layers must match the
+    // ones it was saved with. Both return an error message, or an empty string on
+    // success.
+    std::string save_checkpoint(const std::string& path);
+    std::string resume(Scene& scene, const Camera& camera, const std::string& path);
+
+    // How many samples pass number pass over a tile takes, for a render that
+    // takes the tile from first to target samples in passes of per_pass each.
+    // Zero once it has reached target.
+    static size_t pass_samples(size_t first, size_t target, size_t pass, size_t per_pass) {
+        size_t done = first + pass * per_pass;
+        return done < target ? std::min(per_pass, target - done) : 0;
+    }
+
+    // Render only the given rectangle of the image, so that one frame can be
+    // split across processes; set_sizes resets this to the whole image. The
+    // tiles saved by each process are then combined with merge_checkpoints,
+    // which builds the scene unless it is already built, to check them against
+    // it, and refuses any that overlap a region already merged. No samples are
+    // taken, but when denoising, the merged tiles' AOVs are traced, so the
+    // output is ready once the render is no longer in progress.
+    void set_region(size_t x, size_t y, size_t w, size_t h);
+    std::string merge_checkpoints(Scene& scene, const Camera& camera,
+                                  const std::vector<std::string>& paths);
     void cancel();
     bool in_progress() const;
     float progress() const;
+    float average_samples();
     std::pair<float, float> completion_time() const;
 
 private:
     // Internal
-    void build_scene(Scene& scene);
-    void build_lights(Scene& scene, std::vector<Object>& objs);
-    void do_trace(size_t samples);
-    void accumulate(const HDR_Image& sample);
+    struct Built_Scene;
+    struct Scene_Copy;
+    void copy_scene(Scene& scene, Scene_Copy& out);
+    void build_scene(Scene_Copy& scene, Built_Scene& out);
+    void build_lights(Scene_Copy& scene, std::vector<Object>& objs, Built_Scene& out);
+    uint64_t hash_scene(Scene& scene);
+    std::pair<uint64_t, uint64_t> cached_mesh_hash(Scene_ID id, uint64_t version,
+                                                   const GL::Mesh& mesh);
+    uint64_t settings_hash(uint64_t h) const;
+    void use_prepared();
+    void finish_build();
+    void restart_work(const Camera& camera);
+    struct Tile;
+    void build_tiles(size_t x, size_t y, size_t w, size_t h);
+    Checkpoint::Header checkpoint_header() const;
+    std::string load_checkpoint(const std::string& path, bool replace);
+    void start_work(size_t samples, bool top_up = false);
+    void do_work();
+    struct Pass;
+    bool do_trace(const Tile& tile, size_t first, Pass& pass);
+    bool trace_wavefront(const Tile& tile, size_t first, Pass& pass);
+    void trace_aovs(const Tile& tile);
+    void trace_preview(Tile& tile, size_t level, std::vector<Spectrum>& out);
+    void merge(Tile& tile, size_t pass_idx, Pass& pass);
+    void accumulate(Tile& tile, const Pass& pass);
+    void start_layers();
+    void clear_layers();
+    void trace_first_hits(const Tile& tile);
+    void store_first_hit(size_t idx, const Trace& hit);
+    void update_converged(Tile& tile);
+    Tile* next_noisy_tile();
+    float tile_error(const Tile& tile) const;
+    bool past_deadline() const;
+    void resolve(size_t begin, size_t end, bool to_noisy);
+    void update_output();
     bool tonemap();
 
+    // The sums of a pass of samples over a tile's pixels, along with those of
+    // its color layers, layer_colors per pixel, if any are selected
+    struct Pass {
+        size_t samples = 0;
+        std::vector<Spectrum> sums;
+        std::vector<float> sums_sq;
+        std::vector<Spectrum> layers;
+    };
+
+    // A rectangular region of the output image. Tiles are rendered in passes of a
+    // few samples each, and the tile's lock guards its region of the accumulator.
+    // Passes over a converged tile are given to a tile that is still noisy.
+    struct Tile {
+        size_t x = 0, y = 0, w = 0, h = 0;
+        size_t samples = 0;
+        std::atomic<bool> converged = false;
+        std::mutex mut;
+
+        // Passes given to this tile by converged ones, which follow its own
+        std::atomic<size_t> extra_passes = 0;
+
+        // Of samples, how many were split into the color layers, which start
+        // over when a different set of them is selected
+        size_t layer_samples = 0;
+
+        // Sample index of the current render's first pass over the tile, and
+        // the number of samples the tile has once the render is done
+        size_t first_sample = 0, target_samples = 0;
+
+        // While previewing, the block size of the finest preview pass drawn over
+        // the tile, or zero if none has been. It shows until the tile has samples.
+        size_t preview_block = 0;
+
+        // Passes are summed in order, since float addition isn't associative;
+        // passes finished ahead of an earlier one are held until it's merged.
+        size_t next_pass = 0;
+        std::map<size_t, Pass> held;
+    };
+
     Gui::Widget_Render& gui;
-    unsigned long long render_time, build_time;
-    Thread_Pool thread_pool;
-    bool cancel_flag = false;
+    unsigned long long render_time, build_time, render_start, deadline;
+    Thread_Pool thread_pool, build_pool;
+    std::atomic<bool> cancel_flag = false;
+
+    // Per-pixel sums of all merged samples; output is the resolved mean, rebuilt
+    // on demand whenever a pass has been merged since it was last read. The sums
+    // of squared sample luminance give each pixel's variance.
+    std::vector<Spectrum> accumulator;
+    std::vector<float> accumulator_sq;
+    HDR_Image output;
+    std::deque<Tile> tiles;
+    std::atomic<size_t> merged_passes;
+    size_t resolved_passes;
+
+    // Work item i is pass (i / tiles.size()) over tile (i % tiles.size()). Workers
+    // pull the next item off this shared counter, so threads that finish early
+    // immediately pick up work that would otherwise wait behind a slow tile.
+    // The render is in progress until every worker has run out of work, the
+    // deadline has passed, or every tile has converged. Each tile has tile_passes
+    // passes of its own, and next_noisy is where the search for a tile to give a
+    // converged tile's pass to starts.
+    size_t samples_per_pass, total_work, tile_passes = 0;
+    std::atomic<size_t> next_work, completed_work, running_workers, converged_tiles;
+    std::atomic<size_t> next_noisy = 0;
+
+    // When denoising, workers first take tiles off next_aov to trace their AOVs,
+    // and the resolved output goes into noisy, with the variance of each pixel's
+    // mean luminance, to be denoised into output once all aov_tiles are traced.
+    AOVs aovs;
+    size_t aov_tiles = 0;
+    std::atomic<size_t> next_aov, traced_aovs;
+    std::vector<Spectrum> noisy;
+    std::vector<float> noisy_var;
 
-    HDR_Image accumulator;
-    std::mutex accumulator_mut;
-    size_t total_epochs, accumulator_samples;
-    std::atomic<size_t> completed_epochs;
+    // While workers are busy, a copy of noisy is denoised on the build pool at
+    // most every denoise_interval seconds, and taken into output once done unless
+    // a render has been started since; renders counts those started. It is
+    // denoised once more on the render threads when the render finishes.
+    // denoise_pending is set while output lags noisy.
+    static constexpr double denoise_interval = 1.0;
+    bool denoise_pending = false;
+    unsigned long long last_denoise = 0;
+    size_t renders = 0;
+    std::future<std::pair<size_t, std::vector<Spectrum>>> denoising_task;
+
+    // A preview's coarse passes, over blocks of preview_blocks[level] pixels, are
+    // its first preview_items work items. Each fills its blocks of preview_pixels.
+    static constexpr size_t preview_blocks[] = {8, 4, 2};
+    bool previewing = false;
+    size_t preview_items = 0;
+    uint64_t preview_key = 0;
+    std::vector<Spectrum> preview_pixels;
+
+    // The selected layers. Each pixel has layer_colors sums of color layers in
+    // layer_accumulator, from direct_layer, indirect_layer and light_layer on
+    // (no_layer for those not selected); light_layer + g holds light group g.
+    // The first-hit layers are written by whichever pass takes sample 0.
+    static constexpr size_t no_layer = SIZE_MAX;
+    Layers layers;
+    size_t layer_colors = 0, direct_layer = no_layer, indirect_layer = no_layer,
+           light_layer = no_layer;
+    std::vector<Spectrum> layer_accumulator;
+    std::vector<float> layer_depth, layer_object, layer_material;
 
     /// Relevant to student
     Spectrum trace_pixel(size_t x, size_t y);
     Spectrum trace_ray(const Ray& ray);
     void log_ray(const Ray& ray, float t, Spectrum color = Spectrum{1.0f});
 
+    // Direct lighting at from, facing normal, samples each light of the light
+    // tree n_area_samples times, and the environment as many. These give the
+    // density (summed over those samples) with which it samples the direction
+    // towards a point found on an emitter by another ray, or towards the
+    // environment along dir, for weighting the ray's find by MIS. Only the
+    // wavefront integrator weights by MIS; trace_ray adds light samples at full
+    // weight and leaves emission found by BSDF samples to the student.
+    float light_pdf(Vec3 from, Vec3 normal, const Trace& hit) const;
+    float env_pdf(Vec3 dir) const;
+
     BVH<Object> scene;
     std::vector<Light> lights;
+    Light_Tree light_tree;
     std::vector<BSDF> materials;
     std::optional<Env_Light> env_light; // only one of these per scene
+
+    // Materials of the objects that are also sampled as lights (area lights and
+    // emissive meshes), by their ID
     std::unordered_map<Scene_ID, size_t> mat_cache;
 
+    // The lights sampling the emission of each material, if any: the triangles
+    // of an emissive mesh are lights first + Trace::tri, and an area light's
+    // quad is the single light first.
+    struct Emitter {
+        static constexpr uint32_t none = UINT32_MAX;
+        uint32_t first = none;
+        bool per_tri = false;
+    };
+    std::vector<Emitter> emitters;
+
+    // Lights are split into layers by the scene light or object they come from:
+    // light_group gives each light's group, and env_group is the environment's,
+    // if there is one. group_names name them, for the layers' channels.
+    static constexpr uint32_t no_group = UINT32_MAX;
+    std::vector<uint32_t> light_group;
+    std::vector<std::string> group_names;
+    uint32_t env_group = no_group;
+
+    // Meshes built by the last build_scene, keyed by the object they came from.
+    // The next build reuses each one whose posed mesh data still hashes the same,
+    // so moving objects or editing lights and materials rebuilds no mesh BVHs.
+    // If only the vertex data has changed (e.g. animated skinning), the cached
+    // BVH is refit to it instead of rebuilt.
+    struct Cached_Mesh {
+        uint64_t hash = 0, topology = 0;
+        Tri_Mesh mesh;
+    };
+    std::unordered_map<Scene_ID, Cached_Mesh> mesh_cache;
+
+    // What build_scene reads from the layout scene, copied on the GUI thread so
+    // that the build can run on the build pool while the scene is edited, with
+    // items in the scene's order. A mesh's data is only copied if the build needs
+    // it: not if mesh_cache holds it unchanged, unless its triangles are lights.
+    struct Mesh_Copy {
+        uint64_t topology = 0, hash = 0;
+        std::vector<GL::Mesh::Vert> verts;
+        std::vector<GL::Mesh::Index> indices;
+    };
+    struct Object_Copy {
+        Scene_ID id = 0;
+        std::string name;
+        Material::Options material;
+        Spectrum emissive;
+        Mat4 transform;
+        std::optional<Shape> shape;
+        Mesh_Copy mesh;
+    };
+    struct Light_Copy {
+        Scene_ID id = 0;
+        std::string name;
+        Scene_Light::Options opt;
+        Spectrum radiance;
+        Mat4 transform;
+        HDR_Image emissive;
+        Mesh_Copy quad;
+    };
+    struct Particles_Copy {
+        Scene_ID id = 0;
+        Spectrum color;
+        float scale = 1.0f;
+        Mesh_Copy mesh;
+        std::vector<Vec3> positions;
+    };
+    struct Scene_Copy {
+        std::vector<std::variant<Object_Copy, Light_Copy, Particles_Copy>> items;
+        uint64_t hash = 0;
+    };
+
+    // Everything build_scene makes from the layout scene, held here by
+    // prepare_scene until use_prepared moves it into the members above.
+    struct Built_Scene {
+        BVH<Object> objects;
+        std::vector<Light> lights;
+        Light_Tree light_tree;
+        std::vector<BSDF> materials;
+        std::optional<Env_Light> env_light;
+        std::unordered_map<Scene_ID, size_t> mat_cache;
+        std::vector<Emitter> emitters;
+        std::vector<uint32_t> light_group;
+        std::vector<std::string> group_names;
+        uint32_t env_group = no_group;
+        uint64_t hash = 0;
+        unsigned long long build_time = 0;
+    };
+    std::optional<Built_Scene> prepared;
+
+    // The build running on the build pool into prepared, if any, and the hash of
+    // the scene it was copied from. Only one runs at a time, as it updates
+    // mesh_cache, which copy_scene reads.
+    std::future<void> building;
+    uint64_t building_hash = 0;
+
+    // Identifies the scene built by build_scene, for matching checkpoints to it
+    uint64_t scene_hash = 0;
+
+    // hash_scene is run every frame while previewing, so the hashes of mesh
+    // (object or particle) and environment map data are kept until the item's
+    // version says they changed. Meshes also keep the hash of their topology,
+    // which copy_scene needs.
+    struct Cached_Hash {
+        uint64_t version = 0, hash = 0, topology = 0;
+    };
+    std::unordered_map<Scene_ID, Cached_Hash> mesh_hashes, emissive_hashes;
+    uint64_t render_hash() const;
+
     Camera camera;
     size_t out_w, out_h, n_samples, n_area_samples, max_depth;
+    float noise_threshold = 0.0f, time_limit = 0.0f;
+    bool wavefront = false, denoising = false;
+    RNG::Sequence sequence = RNG::Sequence::random;
+    uint32_t seed = 0;
 };
 
 } // namespace PT
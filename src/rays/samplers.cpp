@@ -0,0 +1,170 @@
+
+#include "samplers.h"
+#include "../util/rand.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace Samplers {
+
+void Alias::build(const float* weights, size_t n, Entry* table) {
+
+    double total = 0.0;
+    for(size_t i = 0; i < n; i++) total += weights[i];
+
+    if(total <= 0.0) {
+        for(size_t i = 0; i < n; i++) {
+            table[i] = {1.0f, (uint32_t)i, 1.0f / n, 1.0f / n};
+        }
+        return;
+    }
+
+    // Scale the weights to average one, then pair each outcome below one with
+    // one above, which fills the rest of its entry and is left with less
+    std::vector<uint32_t> small, large;
+    for(size_t i = 0; i < n; i++) {
+        table[i].pmf = (float)(weights[i] / total);
+        table[i].prob = (float)(weights[i] * n / total);
+        table[i].alias = (uint32_t)i;
+        (table[i].prob < 1.0f ? small : large).push_back((uint32_t)i);
+    }
+    while(!small.empty() && !large.empty()) {
+        uint32_t s = small.back(), l = large.back();
+        small.pop_back();
+        table[s].alias = l;
+        table[l].prob -= 1.0f - table[s].prob;
+        if(table[l].prob < 1.0f) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // Whatever is left only differs from one by rounding
+    for(uint32_t i : small) table[i].prob = 1.0f;
+    for(uint32_t i : large) table[i].prob = 1.0f;
+    for(size_t i = 0; i < n; i++) table[i].alias_pmf = table[table[i].alias].pmf;
+}
+
+size_t Alias::sample(const Entry* table, size_t n, float& pmf) {
+    size_t i = std::min((size_t)(RNG::unit() * n), n - 1);
+    const Entry& entry = table[i];
+    if(RNG::unit() < entry.prob) {
+        pmf = entry.pmf;
+        return i;
+    }
+    pmf = entry.alias_pmf;
+    return entry.alias;
+}
+
+float Hemisphere::Uniform::pdf(Vec3 dir) const {
+    return dir.y > 0.0f ? 1.0f / (2.0f * PI_F) : 0.0f;
+}
+
+namespace Sphere {
+
+float Uniform::pdf(Vec3) const {
+    return 1.0f / (4.0f * PI_F);
+}
+
+float Image::pdf(Vec3 dir) const {
+
+    if(marginal.empty()) return 1.0f / (4.0f * PI_F);
+
+    // The density sample draws dir with: its pixel's pmf spread over the pixel
+    Vec2 p = uv(dir);
+    size_t x = std::min((size_t)(p.x * w), w - 1);
+    size_t y = std::min((size_t)(p.y * h), h - 1);
+    float sin_theta = std::sin(PI_F * p.y);
+    if(sin_theta <= 0.0f) return 0.0f;
+
+    float pmf = marginal[y].pmf * conditional[y * w + x].pmf;
+    return pmf * (w * h) / (2.0f * PI_F * PI_F * sin_theta);
+}
+
+Vec3 Image::direction(Vec2 uv) {
+    float phi = 2.0f * PI_F * uv.x;
+    float theta = PI_F * uv.y;
+    return Vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+}
+
+Vec2 Image::uv(Vec3 dir) {
+    float phi = std::atan2(dir.z, dir.x);
+    if(phi < 0.0f) phi += 2.0f * PI_F;
+    float theta = std::acos(clamp(dir.y, -1.0f, 1.0f));
+    return Vec2(phi / (2.0f * PI_F), theta / PI_F);
+}
+
+// Table cache layout: the header, then marginal and conditional, in the
+// writer's byte order. The image file's size and modification time tell
+// whether the tables are still up to date.
+namespace {
+struct Tables_Header {
+    char magic[8] = {'C', '3', 'D', 'A', 'L', 'I', 'A', '1'};
+    uint64_t source_size = 0;
+    int64_t source_time = 0;
+    uint64_t w = 0, h = 0;
+};
+
+bool describe(const std::string& image_path, Tables_Header& header) {
+    std::error_code err;
+    header.source_size = std::filesystem::file_size(image_path, err);
+    if(err) return false;
+    auto time = std::filesystem::last_write_time(image_path, err);
+    header.source_time = (int64_t)time.time_since_epoch().count();
+    return !err;
+}
+} // namespace
+
+bool Image::load_tables(const std::string& image_path) {
+
+    Tables_Header header, expected;
+    expected.w = w;
+    expected.h = h;
+    if(image_path.empty() || !describe(image_path, expected)) return false;
+
+    std::ifstream in(image_path + ".alias", std::ios::binary);
+    if(!in.is_open()) return false;
+    in.read((char*)&header, sizeof(header));
+    if(!in.good() || std::memcmp(&header, &expected, sizeof(header))) return false;
+
+    marginal.resize(h);
+    conditional.resize(w * h);
+    in.read((char*)marginal.data(), marginal.size() * sizeof(Alias::Entry));
+    in.read((char*)conditional.data(), conditional.size() * sizeof(Alias::Entry));
+    if(in.good()) return true;
+
+    marginal.clear();
+    conditional.clear();
+    return false;
+}
+
+void Image::save_tables(const std::string& image_path) const {
+
+    Tables_Header header;
+    header.w = w;
+    header.h = h;
+    if(image_path.empty() || !describe(image_path, header)) return;
+
+    // Written aside and renamed into place, so an interrupted write is never loaded.
+    // The image's directory may not be writable, in which case there is no cache.
+    std::string path = image_path + ".alias", temp = path + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if(!out.is_open()) return;
+        out.write((const char*)&header, sizeof(header));
+        out.write((const char*)marginal.data(), marginal.size() * sizeof(Alias::Entry));
+        out.write((const char*)conditional.data(), conditional.size() * sizeof(Alias::Entry));
+        if(!out.good()) {
+            out.close();
+            std::remove(temp.c_str());
+            return;
+        }
+    }
+    std::remove(path.c_str());
+    std::rename(temp.c_str(), path.c_str());
+}
+
+} // namespace Sphere
+} // namespace Samplers
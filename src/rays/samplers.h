@@ -27,6 +27,30 @@ struct Two_Points {
 using Direction = Point;
 using Two_Directions = Two_Points;
 
+// Vose's alias method: picks one of n outcomes in proportion to their weights in
+// constant time, from a table of n entries built in linear time. Each entry
+// also holds the pmf of both outcomes it can give, so a sample reads just one.
+struct Alias {
+    struct Entry {
+        float prob = 1.0f; // chance of giving this entry's own outcome, not its alias
+        uint32_t alias = 0;
+        float pmf = 0.0f, alias_pmf = 0.0f;
+    };
+
+    // If every weight is zero, the outcomes are equally likely
+    static void build(const float* weights, size_t n, Entry* table);
+    static size_t sample(const Entry* table, size_t n, float& pmf);
+};
+
+// The power heuristic for multiple importance sampling: the weight of a sample
+// drawn with density pdf, where other is the density with which the other
+// strategies could have drawn it. Each density is scaled by its strategy's
+// number of samples.
+inline float power_heuristic(float pdf, float other) {
+    float a = pdf * pdf, b = other * other;
+    return a > 0.0f ? a / (a + b) : 0.0f;
+}
+
 // These are continuous. Note they output a probabilty _density_ function
 namespace Rect {
 
@@ -45,6 +69,7 @@ namespace Hemisphere {
 struct Uniform {
     Uniform() = default;
     Vec3 sample(float& pdf) const;
+    float pdf(Vec3 dir) const;
 };
 
 struct Cosine {
@@ -58,16 +83,32 @@ namespace Sphere {
 struct Uniform {
     Uniform() = default;
     Vec3 sample(float& pdf) const;
+    float pdf(Vec3 dir) const;
     Hemisphere::Uniform hemi;
 };
 
 struct Image {
     Image(const HDR_Image& image);
     Vec3 sample(float& pdf) const;
+    float pdf(Vec3 dir) const;
+
+    // The direction through the point uv of the image, which wraps around the
+    // sphere with u going around the y axis and v from +y down to -y, and back
+    static Vec3 direction(Vec2 uv);
+    static Vec2 uv(Vec3 direction);
 
     size_t w = 0, h = 0;
-    std::vector<float> pdf, cdf;
-    float total = 0.0f;
+
+    // A pixel is sampled by picking its row from marginal, in proportion to the
+    // row's total weight, then the pixel from that row's table, the w entries of
+    // conditional from y * w.
+    std::vector<Alias::Entry> marginal, conditional;
+
+private:
+    // The tables are saved next to the image file they were built from, and
+    // loaded instead of being rebuilt while that file is unchanged
+    bool load_tables(const std::string& image_path);
+    void save_tables(const std::string& image_path) const;
 };
 
 } // namespace Sphere
@@ -45,6 +45,11 @@ public:
         return std::visit(overloaded{[&ray](const auto& o) { return o.hit(ray); }}, underlying);
     }
 
+    // Shapes are simple enough that a full hit is hardly more work
+    bool occluded(const Ray& ray) const {
+        return hit(ray).hit;
+    }
+
     template<typename T> T& get() {
         return std::get<T>(underlying);
     }
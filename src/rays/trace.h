@@ -12,6 +12,12 @@ struct Trace {
     Vec3 position, normal, origin;
     int material = 0;
 
+    // The scene object that was hit
+    unsigned int object = 0;
+
+    // For hits on meshes, which triangle of the mesh's index list was hit
+    uint32_t tri = 0;
+
     static Trace min(const Trace& l, const Trace& r) {
         if(l.hit && r.hit) {
             if(l.distance < r.distance) return l;
@@ -30,4 +36,18 @@ struct Trace {
     }
 };
 
+// Where along a ray the closest hit found so far is, and what it is on: prim
+// indexes the primitives of the BVH being traversed, and for objects holding a
+// mesh, tri and (u, v) locate the hit on one of its triangles. Traversal only
+// keeps these, building the full Trace from them once for the closest hit.
+struct Hit_Record {
+
+    static constexpr uint32_t none = UINT32_MAX;
+
+    bool hit = false;
+    float distance = 0.0f;
+    uint32_t prim = none, tri = 0;
+    float u = 0.0f, v = 0.0f;
+};
+
 } // namespace PT
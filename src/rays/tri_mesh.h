@@ -3,6 +3,7 @@
 
 #include "../lib/mathlib.h"
 #include "../platform/gl.h"
+#include <memory>
 
 #include "bvh.h"
 #include "trace.h"
@@ -18,15 +19,20 @@ class Triangle {
 public:
     BBox bbox() const;
     Trace hit(const Ray& ray) const;
+    bool occluded(const Ray& ray) const {
+        return hit(ray).hit;
+    }
 
     size_t visualize(GL::Lines&, GL::Lines&, size_t, const Mat4&) const {
         return size_t(0);
     }
 
 private:
-    Triangle(Tri_Mesh_Vert* verts, unsigned int v0, unsigned int v1, unsigned int v2);
+    Triangle(Tri_Mesh_Vert* verts, unsigned int v0, unsigned int v1, unsigned int v2,
+             unsigned int index);
 
-    unsigned int v0, v1, v2;
+    // index is the triangle's place in the mesh, which the BVH build reorders
+    unsigned int v0, v1, v2, index;
     Tri_Mesh_Vert* vertex_list;
     friend class Tri_Mesh;
 };
@@ -34,25 +40,73 @@ private:
 class Tri_Mesh {
 public:
     Tri_Mesh() = default;
-    Tri_Mesh(const GL::Mesh& mesh);
+    Tri_Mesh(const GL::Mesh& mesh, Thread_Pool* pool = nullptr);
 
     Tri_Mesh(Tri_Mesh&& src) = default;
     Tri_Mesh& operator=(Tri_Mesh&& src) = default;
     Tri_Mesh(const Tri_Mesh& src) = delete;
     Tri_Mesh& operator=(const Tri_Mesh& src) = delete;
 
-    Tri_Mesh copy() const;
+    // Another reference to the same built mesh, for drawing it many times
+    // under different object transforms without duplicating its BVH.
+    Tri_Mesh instance() const;
 
     BBox bbox() const;
     Trace hit(const Ray& ray) const;
+    bool occluded(const Ray& ray) const;
+    void hit_packet(const Ray* rays, Trace* traces, size_t n) const;
+
+    // hit() split in two: closest finds only the nearest triangle and where on it
+    // the ray lands, keeping recs unless it is nearer, and surface builds the Trace.
+    Hit_Record closest(const Ray& ray) const;
+    void closest_packet(const Ray* rays, Hit_Record* recs, size_t n) const;
+    Trace surface(const Ray& ray, const Hit_Record& rec) const;
 
     size_t visualize(GL::Lines& lines, GL::Lines& active, size_t level, const Mat4& trans) const;
 
-    void build(const GL::Mesh& mesh);
+    void build(const GL::Mesh& mesh, Thread_Pool* pool = nullptr);
+
+    // Update to new vertex data for the same triangles (e.g. a skinned pose),
+    // refitting the existing BVH rather than building a new one. Returns false
+    // if the refit tree was poor enough that it was rebuilt.
+    bool refit(const GL::Mesh& mesh, Thread_Pool* pool = nullptr);
+
+    // As above, from a copy of the mesh data, which needn't be made on the GUI thread
+    void build(const std::vector<GL::Mesh::Vert>& verts, const std::vector<GL::Mesh::Index>& idxs,
+               Thread_Pool* pool = nullptr);
+    bool refit(const std::vector<GL::Mesh::Vert>& verts, const std::vector<GL::Mesh::Index>& idxs,
+               Thread_Pool* pool = nullptr);
+
+    const BVH<Triangle>::Build_Stats& build_stats() const {
+        return data->triangles.build_stats();
+    }
 
 private:
-    std::vector<Tri_Mesh_Vert> verts;
-    BVH<Triangle> triangles;
+    // Intersection data for each triangle in BVH order: one corner and the two
+    // edges leaving it, stored component-wise so that a leaf's triangles are
+    // tested together. Leaves needn't start at a multiple of four, so there are
+    // three degenerate triangles of padding for blocks that run past the end.
+    struct Tri_Soa {
+        std::vector<float> px, py, pz;
+        std::vector<float> e1x, e1y, e1z;
+        std::vector<float> e2x, e2y, e2z;
+    };
+
+    // Never modified once built; instances share it, and rebuilding a mesh
+    // replaces it rather than changing it under them.
+    struct Data {
+        std::vector<Tri_Mesh_Vert> verts;
+        BVH<Triangle> triangles;
+        Tri_Soa soa;
+    };
+
+    static void build_soa(Data& data);
+    static void intersect4(const Tri_Soa& soa, size_t b, size_t end, const Ray& ray, float max_t,
+                           float t[4], float u[4], float v[4], bool mask[4]);
+    void hit_leaf(const Ray& ray, size_t start, size_t size, Hit_Record& ret) const;
+    bool occluded_leaf(const Ray& ray, size_t start, size_t size) const;
+
+    std::shared_ptr<const Data> data = std::make_shared<Data>();
 };
 
 } // namespace PT
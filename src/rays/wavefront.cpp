@@ -0,0 +1,352 @@
+
+#include "pathtracer.h"
+#include "../util/rand.h"
+
+namespace PT {
+
+// The wavefront integrator advances a batch of a pass's paths one bounce at a time,
+// running each stage over the whole batch before starting the next:
+//
+//  - extend traces every live path's ray,
+//  - shade visits the hits grouped by material, adds emission, queues a shadow
+//    ray towards each light sample and samples the BSDF for the path's next ray,
+//  - connect tests the shadow rays, adding the light of those that are unoccluded,
+//  - accumulate sums the finished paths into their pixels, and their layers.
+//
+// Each stage works through one kind of data, and rays are traced in large batches
+// that the BVH regroups into coherent packets, rather than recursing through each
+// sample depth-first.
+//
+// Lights are sampled at every non-specular hit, and light that the path's next
+// ray finds on those lights or the environment is found by both strategies. Each
+// is weighted by the power heuristic, so that light sampling handles small and
+// distant lights and BSDF sampling handles glossy surfaces and large lights.
+// Emission after the camera or a specular bounce, or from emissive surfaces that
+// aren't lights, can only be found by the path and is counted in full.
+//
+// Each path keeps its own RNG state, restored around every stage that draws for
+// it, so that what it draws doesn't depend on the order paths are visited in.
+
+namespace {
+
+// Rays along with the paths they belong to, one entry per ray in each array
+struct Ray_Queue {
+    std::vector<Ray> rays;
+    std::vector<Trace> hits;
+    std::vector<uint32_t> path;
+    std::vector<Spectrum> radiance; // shadow rays: light added if unoccluded
+    std::vector<uint8_t> specular;  // path rays: came from the camera or a specular bounce
+    std::vector<float> pdf;         // path rays: density of the BSDF sample they came from
+    std::vector<Vec3> normal;       // path rays: normal at their origin, if not specular
+    std::vector<uint32_t> group;    // shadow rays: light group of their light sample
+    std::vector<uint8_t> direct;    // shadow rays: from a camera ray's hit
+
+    void clear() {
+        rays.clear();
+        path.clear();
+        radiance.clear();
+        specular.clear();
+        pdf.clear();
+        normal.clear();
+        group.clear();
+        direct.clear();
+    }
+    void trace(const BVH<Object>& scene) {
+        hits.assign(rays.size(), Trace{});
+        scene.hit_stream(rays, hits);
+    }
+};
+
+struct Wavefront {
+    Ray_Queue live, next, shadow;
+    std::vector<Spectrum> radiance, layers;
+    std::vector<uint32_t> order, counts;
+    std::vector<RNG::State> rng;
+
+    // Shading frame of the hit at each position of order
+    std::vector<Mat4> to_object;
+    std::vector<Vec3> out_dir;
+};
+
+} // namespace
+
+void Pathtracer::set_wavefront(bool enable) {
+    wavefront = enable;
+}
+
+bool Pathtracer::trace_wavefront(const Tile& tile, size_t first, Pass& pass) {
+
+    // Kept per worker, so the queues are only allocated by a worker's first pass.
+    // A pass's paths are traced in batches of at most max_batch, which bounds the
+    // size of the queues however many samples the pass takes.
+    thread_local Wavefront wf;
+    constexpr size_t max_batch = 1 << 16;
+
+    size_t samples = pass.samples;
+    size_t n_pixels = tile.w * tile.h;
+    size_t n_paths = n_pixels * samples;
+    Vec2 wh((float)out_w, (float)out_h);
+
+    // Path p (counted from the pass's first, not the batch's) takes sample
+    // p % samples of the tile's pixel p / samples. Batches sum their paths into
+    // the pass in path order, so each pixel's samples are summed in order.
+    std::vector<size_t> sampled(n_pixels, 0);
+    pass.sums.assign(n_pixels, Spectrum{});
+    pass.sums_sq.assign(n_pixels, 0.0f);
+    pass.layers.assign(n_pixels * layer_colors, Spectrum{});
+
+    // Adds light reaching path p's camera from the light group (or no_group) to
+    // its radiance, and to its layers. Direct light has bounced at most once.
+    auto add = [&](uint32_t p, const Spectrum& L, bool direct, uint32_t group) {
+        wf.radiance[p] += L;
+        if(!layer_colors) return;
+        Spectrum* dst = &wf.layers[(size_t)p * layer_colors];
+        size_t slot = direct ? direct_layer : indirect_layer;
+        if(slot != no_layer) dst[slot] += L;
+        if(light_layer != no_layer && group != no_group) dst[light_layer + group] += L;
+    };
+    auto emitter_group = [&](const Trace& hit) {
+        const Emitter& emitter = emitters[hit.material];
+        if(light_layer == no_layer || emitter.first == Emitter::none) return no_group;
+        return light_group[emitter.first + (emitter.per_tri ? hit.tri : 0)];
+    };
+
+    // Shades the hits order[begin, end), which share the material bsdf. The BSDF and
+    // the environment light are resolved to their concrete types once for the whole
+    // run, so the loops over its hits call them directly rather than dispatching per
+    // hit. Other lights are chosen per sample from the light tree.
+    auto shade = [&](const auto& bsdf, size_t begin, size_t end) {
+        using Type = std::decay_t<decltype(bsdf)>;
+
+        for(size_t r = begin; r < end; r++) {
+
+            uint32_t i = wf.order[r];
+            const Ray& ray = wf.live.rays[i];
+            Trace& hit = wf.live.hits[i];
+            uint32_t p = wf.live.path[i];
+
+            if(!Type::sided && dot(hit.normal, ray.dir) > 0.0f) {
+                hit.normal = -hit.normal;
+            }
+
+            RNG::restore(wf.rng[p]);
+            Mat4 object_to_world = Mat4::rotate_to(hit.normal);
+            wf.to_object[r] = object_to_world.T();
+            wf.out_dir[r] = wf.to_object[r].rotate(ray.point - hit.position).unit();
+
+            // The roulette draw is taken up front, so each bounce takes the same
+            // number of draws before its light samples
+            BSDF_Sample sample = bsdf.sample(wf.out_dir[r]);
+            float roulette = RNG::unit();
+            wf.rng[p] = RNG::save();
+
+            float weight = 1.0f;
+            if(!wf.live.specular[i]) {
+                float pdf = light_pdf(ray.point, wf.live.normal[i], hit);
+                weight = Samplers::power_heuristic(wf.live.pdf[i], pdf);
+            }
+            add(p, weight * ray.throughput * sample.emissive, ray.depth <= 1, emitter_group(hit));
+
+            if(ray.depth + 1 >= max_depth || sample.pdf <= 0.0f) continue;
+
+            Spectrum throughput =
+                ray.throughput * sample.attenuation * (std::abs(sample.direction.y) / sample.pdf);
+
+            // Russian roulette, once paths are a couple of bounces deep
+            if(ray.depth >= 2) {
+                float survive = std::min(1.0f, throughput.luma());
+                if(roulette >= survive) continue;
+                throughput *= 1.0f / survive;
+            }
+            if(throughput.luma() <= 0.0f) continue;
+
+            Ray bounce(hit.position, object_to_world.rotate(sample.direction));
+            bounce.dist_bounds.x = EPS_F;
+            bounce.throughput = throughput;
+            bounce.depth = ray.depth + 1;
+            wf.next.rays.push_back(bounce);
+            wf.next.path.push_back(p);
+            wf.next.specular.push_back(Type::discrete);
+            wf.next.pdf.push_back(sample.pdf);
+            wf.next.normal.push_back(hit.normal);
+        }
+
+        if constexpr(!Type::discrete) {
+
+            // Queues a shadow ray from the hit at order[r] towards the light sample
+            // ls, whose light is weighted by scale and belongs to group. pdf is the
+            // density with which all the light samples taken there give this one,
+            // or zero for discrete lights, which the BSDF can't sample.
+            auto connect = [&](size_t r, const Light_Sample& ls, float scale, float pdf,
+                               uint32_t group) {
+                if(ls.pdf <= 0.0f) return;
+                uint32_t i = wf.order[r];
+                Vec3 in_dir = wf.to_object[r].rotate(ls.direction);
+
+                float cos_theta = in_dir.y;
+                if(cos_theta <= 0.0f) return;
+
+                Spectrum attenuation = bsdf.evaluate(wf.out_dir[r], in_dir);
+                if(attenuation.luma() == 0.0f) return;
+
+                // Paths at the maximum depth don't bounce, so only light sampling finds
+                // the light beyond them
+                if(pdf > 0.0f && wf.live.rays[i].depth + 1 < max_depth) {
+                    scale *= Samplers::power_heuristic(pdf, bsdf.pdf(wf.out_dir[r], in_dir));
+                }
+
+                Ray shadow(wf.live.hits[i].position, ls.direction);
+                shadow.dist_bounds = Vec2(EPS_F, ls.distance - EPS_F);
+                wf.shadow.rays.push_back(shadow);
+                wf.shadow.path.push_back(wf.live.path[i]);
+                wf.shadow.radiance.push_back((scale * cos_theta / ls.pdf) *
+                                             wf.live.rays[i].throughput * ls.radiance *
+                                             attenuation);
+                wf.shadow.group.push_back(group);
+                wf.shadow.direct.push_back(wf.live.rays[i].depth == 0);
+            };
+
+            float per_sample = 1.0f / n_area_samples;
+            for(size_t r = begin; r < end; r++) {
+                const Trace& hit = wf.live.hits[wf.order[r]];
+                uint32_t p = wf.live.path[wf.order[r]];
+                RNG::restore(wf.rng[p]);
+                for(size_t l : light_tree.unbounded()) {
+                    connect(r, lights[l].sample(hit.position), 1.0f, 0.0f, light_group[l]);
+                }
+                for(size_t s = 0; s < n_area_samples; s++) {
+                    Light_Tree::Choice c = light_tree.sample(hit.position, hit.normal);
+                    if(c.pmf <= 0.0f) continue;
+                    const Light& light = lights[c.light];
+                    Light_Sample ls = light.sample(hit.position);
+                    float pdf = light.is_discrete() ? 0.0f : n_area_samples * c.pmf * ls.pdf;
+                    connect(r, ls, per_sample / c.pmf, pdf, light_group[c.light]);
+                }
+                wf.rng[p] = RNG::save();
+            }
+            if(env_light.has_value()) {
+                env_light.value().visit([&](const auto& l) {
+                    for(size_t r = begin; r < end; r++) {
+                        uint32_t p = wf.live.path[wf.order[r]];
+                        RNG::restore(wf.rng[p]);
+                        for(size_t s = 0; s < n_area_samples; s++) {
+                            Light_Sample ls = l.sample();
+                            connect(r, ls, per_sample, n_area_samples * ls.pdf, env_group);
+                        }
+                        wf.rng[p] = RNG::save();
+                    }
+                });
+            }
+        }
+    };
+
+    for(size_t base = 0; base < n_paths; base += max_batch) {
+
+        size_t batch = std::min(max_batch, n_paths - base);
+        wf.radiance.assign(batch, Spectrum{});
+        wf.layers.assign(batch * layer_colors, Spectrum{});
+        wf.rng.resize(batch);
+        wf.live.clear();
+        for(size_t p = 0; p < batch; p++) {
+            size_t pixel = (base + p) / samples, sample = (base + p) % samples;
+            size_t x = tile.x + pixel % tile.w, y = tile.y + pixel / tile.w;
+            RNG::begin_sample(sequence, seed, (uint64_t)y * out_w + x, (uint32_t)(first + sample));
+            Vec2 xy((float)x + RNG::unit(), (float)y + RNG::unit());
+            wf.live.rays.push_back(camera.generate_ray(xy / wh));
+            wf.rng[p] = RNG::save();
+            wf.live.path.push_back((uint32_t)p);
+            wf.live.specular.push_back(1);
+            wf.live.pdf.push_back(0.0f);
+            wf.live.normal.push_back(Vec3{});
+        }
+
+        for(bool camera = true; !wf.live.rays.empty(); camera = false) {
+
+            if(cancel_flag || past_deadline()) return false;
+
+            // Extend
+            wf.live.trace(scene);
+
+            // The first-hit layers are taken from each pixel's sample 0
+            if(camera && first == 0 && !layer_depth.empty()) {
+                for(size_t i = 0; i < wf.live.rays.size(); i++) {
+                    size_t p = base + wf.live.path[i];
+                    if(p % samples) continue;
+                    size_t idx = (tile.y + (p / samples) / tile.w) * out_w + tile.x +
+                                 (p / samples) % tile.w;
+                    store_first_hit(idx, wf.live.hits[i]);
+                }
+            }
+
+            // Counting sort of the hits by material, misses first
+            size_t n = wf.live.rays.size();
+            const std::vector<Trace>& hits = wf.live.hits;
+            auto key = [&hits](size_t i) {
+                return hits[i].hit ? (size_t)hits[i].material + 1 : 0;
+            };
+            wf.counts.assign(materials.size() + 2, 0);
+            for(size_t i = 0; i < n; i++) wf.counts[key(i) + 1]++;
+            for(size_t m = 1; m < wf.counts.size(); m++) wf.counts[m] += wf.counts[m - 1];
+            wf.order.resize(n);
+            for(size_t i = 0; i < n; i++) wf.order[wf.counts[key(i)]++] = (uint32_t)i;
+
+            // Shade the misses, then each material's run of hits
+            wf.next.clear();
+            wf.shadow.clear();
+            wf.to_object.resize(n);
+            wf.out_dir.resize(n);
+
+            for(size_t r = 0; r < wf.counts[0] && env_light.has_value(); r++) {
+                uint32_t i = wf.order[r];
+                const Ray& ray = wf.live.rays[i];
+                float weight = 1.0f;
+                if(!wf.live.specular[i]) {
+                    weight = Samplers::power_heuristic(wf.live.pdf[i], env_pdf(ray.dir));
+                }
+                Spectrum L = ray.throughput * env_light.value().sample_direction(ray.dir);
+                add(wf.live.path[i], weight * L, ray.depth <= 1, env_group);
+            }
+            for(size_t m = 0; m < materials.size(); m++) {
+                size_t begin = wf.counts[m], end = wf.counts[m + 1];
+                if(begin < end) {
+                    materials[m].visit([&](const auto& bsdf) { shade(bsdf, begin, end); });
+                }
+            }
+
+            // Connect
+            for(size_t i = 0; i < wf.shadow.rays.size(); i++) {
+                if(!scene.occluded(wf.shadow.rays[i])) {
+                    add(wf.shadow.path[i], wf.shadow.radiance[i], wf.shadow.direct[i],
+                        wf.shadow.group[i]);
+                }
+            }
+
+            std::swap(wf.live, wf.next);
+        }
+
+        // Accumulate the batch's finished paths into their pixels
+        for(size_t p = 0; p < batch; p++) {
+            const Spectrum& L = wf.radiance[p];
+            if(!L.valid()) continue;
+            size_t pixel = (base + p) / samples;
+            pass.sums[pixel] += L;
+            pass.sums_sq[pixel] += L.luma() * L.luma();
+            sampled[pixel]++;
+            Spectrum* layer_sums = pass.layers.data() + pixel * layer_colors;
+            const Spectrum* l = wf.layers.data() + p * layer_colors;
+            for(size_t k = 0; k < layer_colors; k++) layer_sums[k] += l[k];
+        }
+    }
+
+    // Store the pass as do_trace does
+    for(size_t pixel = 0; pixel < n_pixels; pixel++) {
+        float scale = sampled[pixel] ? (float)samples / sampled[pixel] : 0.0f;
+        pass.sums[pixel] *= scale;
+        pass.sums_sq[pixel] *= scale;
+        Spectrum* layer_sums = pass.layers.data() + pixel * layer_colors;
+        for(size_t k = 0; k < layer_colors; k++) layer_sums[k] *= scale;
+    }
+    return true;
+}
+
+} // namespace PT
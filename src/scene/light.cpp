@@ -4,8 +4,11 @@
 #include "../geometry/util.h"
 #include "renderer.h"
 
+#include <atomic>
 #include <sstream>
 
+static std::atomic<uint64_t> next_emissive_version = 1;
+
 const char* Light_Type_Names[(int)Light_Type::count] = {"Directional", "Sphere", "Hemisphere",
                                                         "Point",       "Spot",   "Rectangle"};
 
@@ -45,8 +48,17 @@ HDR_Image Scene_Light::emissive_copy() const {
     return _emissive.copy();
 }
 
+const HDR_Image& Scene_Light::emissive() const {
+    return _emissive;
+}
+
+uint64_t Scene_Light::emissive_version() const {
+    return _emissive_version;
+}
+
 std::string Scene_Light::emissive_load(std::string file) {
     std::string err = _emissive.load_from(file);
+    _emissive_version = next_emissive_version++;
     if(err.empty()) {
         opt.has_emissive_map = true;
     }
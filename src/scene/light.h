@@ -36,6 +36,11 @@ public:
     std::string emissive_load(std::string file);
     std::string emissive_loaded() const;
     HDR_Image emissive_copy() const;
+    const HDR_Image& emissive() const;
+
+    // Changes whenever a new emissive map is loaded. Versions are never reused,
+    // even between lights.
+    uint64_t emissive_version() const;
 
     const GL::Tex2D& emissive_texture() const;
     void emissive_clear();
@@ -71,6 +76,7 @@ private:
     GL::Mesh _mesh;
     GL::Lines _lines;
     HDR_Image _emissive;
+    uint64_t _emissive_version = 0;
 };
 
 bool operator!=(const Scene_Light::Options& l, const Scene_Light::Options& r);
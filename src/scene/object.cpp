@@ -1,4 +1,5 @@
 
+#include <atomic>
 #include <sstream>
 
 #include "object.h"
@@ -7,6 +8,9 @@
 #include "../geometry/util.h"
 #include "../gui/render.h"
 
+// Meshes may be synced from several build tasks at once
+static std::atomic<uint64_t> next_mesh_version = 1;
+
 Scene_Object::Scene_Object(Scene_ID id, Pose p, GL::Mesh&& m, std::string n)
     : pose(p), _id(id), armature(id), _mesh(std::move(m)) {
 
@@ -46,6 +50,10 @@ Scene_ID Scene_Object::id() const {
     return _id;
 }
 
+uint64_t Scene_Object::mesh_version() const {
+    return _mesh_version;
+}
+
 const GL::Mesh& Scene_Object::mesh() {
     sync_mesh();
     return _mesh;
@@ -62,6 +70,7 @@ void Scene_Object::try_make_editable(PT::Shape_Type prev) {
     case PT::Shape_Type::count: break;
     }
 
+    _mesh_version = next_mesh_version++;
     std::string err = halfedge.from_mesh(_mesh);
     if(err.empty()) {
         editable = true;
@@ -136,6 +145,8 @@ void Scene_Object::sync_anim_mesh() {
             }
         }
     }
+    // Also covers removing the last bone, which switches back to the unposed mesh
+    if(pose_dirty) _mesh_version = next_mesh_version++;
     skel_dirty = pose_dirty = false;
 }
 
@@ -148,6 +159,7 @@ void Scene_Object::sync_mesh() {
 
     if(editable && mesh_dirty) {
         halfedge.to_mesh(_mesh, !opt.smooth_normals);
+        _mesh_version = next_mesh_version++;
         mesh_dirty = false;
     } else if(mesh_dirty && is_shape()) {
         mesh_dirty = false;
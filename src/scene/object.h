@@ -31,6 +31,10 @@ public:
     const GL::Mesh& mesh();
     const GL::Mesh& posed_mesh();
 
+    // Changes whenever posed_mesh() may have, so what is derived from it can be
+    // cached. Versions are never reused, even between objects.
+    uint64_t mesh_version() const;
+
     void render(const Mat4& view, bool solid = false, bool depth_only = false, bool posed = true,
                 bool anim = true);
 
@@ -77,6 +81,7 @@ private:
     mutable bool editable = true;
     mutable bool mesh_dirty = false;
     mutable bool skel_dirty = false, pose_dirty = false;
+    mutable uint64_t _mesh_version = 0;
 };
 
 bool operator!=(const Scene_Object::Options& l, const Scene_Object::Options& r);
@@ -6,10 +6,16 @@
 #include "particles.h"
 #include "renderer.h"
 
+#include <atomic>
+
+// Versions are never reused, so caches keyed on them can't see a stale one
+static std::atomic<uint64_t> next_mesh_version = 1;
+
 Scene_Particles::Scene_Particles(Scene_ID id)
     : arrow(Util::arrow_mesh(0.03f, 0.075f, 1.0f)), particle_instances(Util::sphere_mesh(1.0f, 1)) {
 
     _id = id;
+    _mesh_version = next_mesh_version++;
     snprintf(opt.name, max_name_len, "Emitter %d", id);
     get_r();
 }
@@ -18,6 +24,7 @@ Scene_Particles::Scene_Particles(Scene_ID id, GL::Mesh&& mesh)
     : arrow(Util::arrow_mesh(0.03f, 0.075f, 1.0f)), particle_instances(std::move(mesh)) {
 
     _id = id;
+    _mesh_version = next_mesh_version++;
     snprintf(opt.name, max_name_len, "Emitter %d", id);
     get_r();
 }
@@ -26,6 +33,7 @@ Scene_Particles::Scene_Particles(Scene_ID id, Pose p, std::string name)
     : arrow(Util::arrow_mesh(0.03f, 0.075f, 1.0f)), particle_instances(Util::sphere_mesh(1.0f, 1)) {
 
     _id = id;
+    _mesh_version = next_mesh_version++;
     pose = p;
     snprintf(opt.name, max_name_len, "%s", name.c_str());
     get_r();
@@ -44,6 +52,11 @@ BBox Scene_Particles::bbox() const {
 
 void Scene_Particles::take_mesh(GL::Mesh&& mesh) {
     particle_instances = GL::Instances(std::move(mesh));
+    _mesh_version = next_mesh_version++;
+}
+
+uint64_t Scene_Particles::mesh_version() const {
+    return _mesh_version;
 }
 
 const GL::Mesh& Scene_Particles::mesh() const {
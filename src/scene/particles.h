@@ -49,6 +49,9 @@ public:
     const GL::Mesh& mesh() const;
     void take_mesh(GL::Mesh&& mesh);
 
+    // Changes whenever mesh() does, as Scene_Object::mesh_version does
+    uint64_t mesh_version() const;
+
     static const inline int max_name_len = 256;
     struct Options {
         char name[max_name_len] = {};
@@ -78,6 +81,7 @@ private:
     std::vector<Particle> particles;
     GL::Instances particle_instances;
     GL::Mesh arrow;
+    uint64_t _mesh_version = 0;
 
     float radius = 0.0f;
     double particle_cooldown = 0.0f;
@@ -4,10 +4,20 @@
 
 bool BBox::hit(const Ray& ray, Vec2& times) const {
 
-    // TODO (PathTracer):
-    // Implement ray - bounding box intersection test
-    // If the ray intersected the bounding box within the range given by
-    // [times.x,times.y], update times with the new intersection times.
+    // Slab test: clip [times.x, times.y] against the pair of planes bounding
+    // the box along each axis. Flat boxes still work, as the entry and exit
+    // times of a zero-width slab coincide.
+    float t_min = times.x, t_max = times.y;
+    for(int a = 0; a < 3; a++) {
+        float inv = 1.0f / ray.dir[a];
+        float t0 = (min[a] - ray.point[a]) * inv;
+        float t1 = (max[a] - ray.point[a]) * inv;
+        if(inv < 0.0f) std::swap(t0, t1);
+        t_min = std::max(t_min, t0);
+        t_max = std::min(t_max, t1);
+        if(t_min > t_max) return false;
+    }
 
-    return false;
+    times = Vec2(t_min, t_max);
+    return true;
 }
@@ -45,6 +45,11 @@ Spectrum BSDF_Lambertian::evaluate(Vec3 out_dir, Vec3 in_dir) const {
     return albedo * (1.0f / PI_F);
 }
 
+float BSDF_Lambertian::pdf(Vec3 out_dir, Vec3 in_dir) const {
+    // This must match the pdf sample() gives; change it too if you sample differently
+    return sampler.pdf(in_dir);
+}
+
 BSDF_Sample BSDF_Mirror::sample(Vec3 out_dir) const {
 
     // TODO (PathTracer): Task 6
@@ -66,6 +71,10 @@ Spectrum BSDF_Mirror::evaluate(Vec3 out_dir, Vec3 in_dir) const {
     return {};
 }
 
+float BSDF_Mirror::pdf(Vec3 out_dir, Vec3 in_dir) const {
+    return 0.0f;
+}
+
 BSDF_Sample BSDF_Glass::sample(Vec3 out_dir) const {
 
     // TODO (PathTracer): Task 6
@@ -90,6 +99,10 @@ Spectrum BSDF_Glass::evaluate(Vec3 out_dir, Vec3 in_dir) const {
     return {};
 }
 
+float BSDF_Glass::pdf(Vec3 out_dir, Vec3 in_dir) const {
+    return 0.0f;
+}
+
 BSDF_Sample BSDF_Diffuse::sample(Vec3 out_dir) const {
     BSDF_Sample ret;
     ret.direction = sampler.sample(ret.pdf);
@@ -103,6 +116,10 @@ Spectrum BSDF_Diffuse::evaluate(Vec3 out_dir, Vec3 in_dir) const {
     return {};
 }
 
+float BSDF_Diffuse::pdf(Vec3 out_dir, Vec3 in_dir) const {
+    return sampler.pdf(in_dir);
+}
+
 BSDF_Sample BSDF_Refract::sample(Vec3 out_dir) const {
 
     // TODO (PathTracer): Task 6
@@ -123,4 +140,8 @@ Spectrum BSDF_Refract::evaluate(Vec3 out_dir, Vec3 in_dir) const {
     return {};
 }
 
+float BSDF_Refract::pdf(Vec3 out_dir, Vec3 in_dir) const {
+    return 0.0f;
+}
+
 } // namespace PT
@@ -1,12 +1,18 @@
 
 #include "../rays/bvh.h"
 #include "debug.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <stack>
 
 namespace PT {
 
 template<typename Primitive>
-void BVH<Primitive>::build(std::vector<Primitive>&& prims, size_t max_leaf_size) {
+void BVH<Primitive>::build(std::vector<Primitive>&& prims, size_t max_leaf_size,
+                           Thread_Pool* pool) {
 
     // NOTE (PathTracer):
     // This BVH is parameterized on the type of the primitive it contains. This allows
@@ -22,87 +28,309 @@ void BVH<Primitive>::build(std::vector<Primitive>&& prims, size_t max_leaf_size)
     // Finally, also note that while a BVH is a tree structure, our BVH nodes don't
     // contain pointers to children, but rather indicies. This is because instead
     // of allocating each node individually, the BVH class contains a vector that
-    // holds all of the nodes. Hence, to get the child of a node, you have to
-    // look up the child index in this vector (e.g. nodes[node.l]). Similarly,
-    // to create a new node, don't allocate one yourself - use BVH::new_node, which
-    // returns the index of a newly added node.
+    // holds all of the nodes, in depth-first order. Hence, the left child of
+    // nodes[i] is nodes[i + 1], and the right child is nodes[nodes[i].start].
+    // To create a new node, don't allocate one yourself - use BVH::new_node,
+    // which returns the index of a newly added node.
 
     // Keep these
     nodes.clear();
     primitives = std::move(prims);
 
-    // TODO (PathTracer): Task 3
-    // Construct a BVH from the given vector of primitives and maximum leaf
-    // size configuration. The starter code builds a BVH with a
-    // single leaf node (which is also the root) that encloses all the
-    // primitives.
+    // This is a binned SAH builder. Each node's primitives are sorted into a
+    // fixed number of bins by centroid along each axis, and the node is split at
+    // the bin boundary with the lowest surface area heuristic cost. When given a
+    // thread pool, large ranges are binned in parallel chunks, and the right
+    // subtree of a large node is built as a separate task. Tasks waiting on
+    // their children run other queued work instead of blocking a pool thread.
+
+    constexpr size_t n_bins = 16;
+    constexpr size_t parallel_size = 1 << 14;
 
-    // Replace these
-    BBox box;
-    for(const Primitive& prim : primitives) box.enclose(prim.bbox());
+    using Clock = std::chrono::steady_clock;
+    auto seconds = [](Clock::time_point since) {
+        return std::chrono::duration<float>(Clock::now() - since).count();
+    };
 
-    new_node(box, 0, primitives.size(), 0, 0);
+    stats = {};
+    max_leaf_size = std::max(max_leaf_size, size_t(1));
+    leaf_size = max_leaf_size;
+    build_cost = 0.0f;
+
+    size_t n = primitives.size();
+    assert(n < WIDE_LEAF);
     root_idx = 0;
-}
+    wide.clear();
+    if(n == 0) return;
 
-template<typename Primitive> Trace BVH<Primitive>::hit(const Ray& ray) const {
+    auto join = [pool](std::future<void>& task) {
+        while(task.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            if(!pool->run_one()) std::this_thread::yield();
+        }
+    };
+
+    // Calls f(chunk, begin, end) over [begin, end), split into chunks run on
+    // the pool if the range is large enough to be worth it.
+    auto n_chunks = [pool](size_t begin, size_t end) {
+        return pool ? (end - begin + parallel_size - 1) / parallel_size : size_t(1);
+    };
+    auto for_chunks = [&](size_t begin, size_t end, auto&& f) {
+        size_t chunks = n_chunks(begin, end);
+        size_t grain = (end - begin + chunks - 1) / chunks;
+        std::vector<std::future<void>> tasks;
+        for(size_t c = 1; c < chunks; c++) {
+            size_t b = begin + c * grain, e = std::min(end, b + grain);
+            tasks.push_back(pool->enqueue([&f, c, b, e]() { f(c, b, e); }));
+        }
+        f(size_t(0), begin, std::min(end, begin + grain));
+        for(auto& task : tasks) join(task);
+    };
+
+    // Stage 1: primitive bounds, which may be expensive (e.g. transformed objects)
+    Clock::time_point stage = Clock::now();
+
+    std::vector<BBox> boxes(n);
+    std::vector<Vec3> centers(n);
+    for_chunks(0, n, [&](size_t, size_t b, size_t e) {
+        for(size_t i = b; i < e; i++) {
+            boxes[i] = primitives[i].bbox();
+            centers[i] = boxes[i].center();
+        }
+    });
+    stats.bounds = seconds(stage);
+
+    // Stage 2: recursive splitting. The tree is built over an index array; the
+    // primitives themselves are only moved once, at the end.
+    stage = Clock::now();
+
+    std::vector<size_t> order(n);
+    for(size_t i = 0; i < n; i++) order[i] = i;
+
+    // The tree is first built in this format, as subtrees are claimed from an
+    // atomic counter by whichever task gets to them, and laid out afterwards.
+    struct Build_Node {
+        BBox bbox;
+        size_t start, size, l, r;
+    };
+    std::vector<Build_Node> tree(2 * n - 1);
+    std::atomic<size_t> n_nodes = 1;
 
-    // TODO (PathTracer): Task 3
-    // Implement ray - BVH intersection test. A ray intersects
-    // with a BVH aggregate if and only if it intersects a primitive in
-    // the BVH that is not an aggregate.
+    struct Bin {
+        BBox box;
+        size_t count = 0;
+    };
+    using Bins = std::array<std::array<Bin, n_bins>, 3>;
 
-    // The starter code simply iterates through all the primitives.
-    // Again, remember you can use hit() on any Primitive value.
+    std::function<void(size_t, size_t, size_t, size_t)> split = [&](size_t idx, size_t begin,
+                                                                     size_t end, size_t depth) {
+        size_t size = end - begin;
 
-    Trace ret;
-    for(const Primitive& prim : primitives) {
-        Trace hit = prim.hit(ray);
-        ret = Trace::min(ret, hit);
+        std::vector<std::pair<BBox, BBox>> chunk_bounds(n_chunks(begin, end));
+        for_chunks(begin, end, [&](size_t c, size_t b, size_t e) {
+            for(size_t i = b; i < e; i++) {
+                chunk_bounds[c].first.enclose(boxes[order[i]]);
+                chunk_bounds[c].second.enclose(centers[order[i]]);
+            }
+        });
+        BBox box, cbox;
+        for(auto& [b, c] : chunk_bounds) {
+            box.enclose(b);
+            cbox.enclose(c);
+        }
+
+        Build_Node& node = tree[idx];
+        node.bbox = box;
+        node.start = begin;
+        node.size = size;
+        node.l = node.r = 0;
+
+        if(size <= max_leaf_size) return;
+
+        Vec3 extent = cbox.max - cbox.min;
+        auto bin_of = [&](size_t prim, int axis) {
+            float t = (centers[prim][axis] - cbox.min[axis]) / extent[axis];
+            return std::min(n_bins - 1, (size_t)(t * n_bins));
+        };
+
+        std::vector<Bins> chunk_bins(n_chunks(begin, end));
+        for_chunks(begin, end, [&](size_t c, size_t b, size_t e) {
+            for(size_t i = b; i < e; i++) {
+                for(int a = 0; a < 3; a++) {
+                    if(extent[a] <= 0.0f) continue;
+                    Bin& bin = chunk_bins[c][a][bin_of(order[i], a)];
+                    bin.box.enclose(boxes[order[i]]);
+                    bin.count++;
+                }
+            }
+        });
+
+        Bins bins;
+        for(const Bins& chunk : chunk_bins) {
+            for(int a = 0; a < 3; a++) {
+                for(size_t k = 0; k < n_bins; k++) {
+                    bins[a][k].box.enclose(chunk[a][k].box);
+                    bins[a][k].count += chunk[a][k].count;
+                }
+            }
+        }
+
+        // Sweep each axis for the cheapest split between bins k-1 and k. The
+        // parent's area and the traversal cost are the same for every
+        // candidate, so they are left out of the comparison.
+        int best_axis = -1;
+        size_t best_bin = 0;
+        float best_cost = FLT_MAX;
+        for(int a = 0; a < 3; a++) {
+            if(extent[a] <= 0.0f) continue;
+
+            float right_cost[n_bins] = {};
+            BBox right;
+            size_t right_count = 0;
+            for(size_t k = n_bins - 1; k > 0; k--) {
+                right.enclose(bins[a][k].box);
+                right_count += bins[a][k].count;
+                right_cost[k] = right.surface_area() * right_count;
+            }
+
+            BBox left;
+            size_t left_count = 0;
+            for(size_t k = 1; k < n_bins; k++) {
+                left.enclose(bins[a][k - 1].box);
+                left_count += bins[a][k - 1].count;
+                float cost = left.surface_area() * left_count + right_cost[k];
+                if(left_count && left_count < size && cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = a;
+                    best_bin = k;
+                }
+            }
+        }
+
+        // Near MAX_DEPTH, halving the primitives is the only way to be sure the
+        // leaves still fit below it, so SAH is given up for the rest of the subtree
+        bool deep = (size >> (MAX_DEPTH - 1 - depth)) > 0;
+
+        size_t mid = begin + size / 2;
+        if(best_axis >= 0 && !deep) {
+            auto first = order.begin() + begin, last = order.begin() + end;
+            mid = std::partition(first, last,
+                                 [&](size_t prim) { return bin_of(prim, best_axis) < best_bin; }) -
+                  order.begin();
+        }
+
+        // All centroids coincide, so any split is as good as another
+        if(mid == begin || mid == end) mid = begin + size / 2;
+
+        size_t l = n_nodes.fetch_add(2), r = l + 1;
+        node.l = l;
+        node.r = r;
+
+        if(pool && end - mid >= parallel_size) {
+            std::future<void> right =
+                pool->enqueue([&, r, mid, end, depth]() { split(r, mid, end, depth + 1); });
+            split(l, begin, mid, depth + 1);
+            join(right);
+        } else {
+            split(l, begin, mid, depth + 1);
+            split(r, mid, end, depth + 1);
+        }
+    };
+
+    split(0, 0, n, 0);
+    stats.split = seconds(stage);
+
+    // Stage 3: put the primitives in leaf order
+    stage = Clock::now();
+
+    std::vector<Primitive> sorted;
+    sorted.reserve(n);
+    for(size_t i : order) sorted.push_back(std::move(primitives[i]));
+    primitives = std::move(sorted);
+
+    stats.reorder = seconds(stage);
+
+    // Stage 4: compact depth-first binary nodes, and the wide nodes used by hit()
+    stage = Clock::now();
+
+    nodes.reserve(n_nodes);
+    std::function<void(size_t)> flatten = [&](size_t idx) {
+        const Build_Node& node = tree[idx];
+        size_t flat = new_node(node.bbox, node.start, node.size);
+        if(node.l == node.r) return;
+
+        nodes[flat].size = 0;
+        flatten(node.l);
+        nodes[flat].start = (uint32_t)nodes.size();
+        flatten(node.r);
+    };
+    flatten(0);
+    build_wide();
+    build_cost = sah_cost();
+
+    stats.layout = seconds(stage);
+}
+
+template<typename Primitive> Trace BVH<Primitive>::hit(const Ray& ray) const {
+
+    // Objects only record where they were hit during the walk, and the closest
+    // is shaded afterwards (see BVH::hit_deferred in rays/bvh.inl)
+    if constexpr(Has_Deferred_Hit<Primitive>::value) {
+        return hit_deferred(ray);
+    } else {
+        // The tree walk itself lives in BVH::traverse (rays/bvh.inl); it calls this
+        // for each leaf the ray reaches, nearest first, with the closest hit so far.
+        return traverse(ray, [this](const Ray& ray, size_t start, size_t size, Trace& ret) {
+            for(size_t i = start; i < start + size; i++) {
+                ret = Trace::min(ret, primitives[i].hit(ray));
+            }
+        });
     }
-    return ret;
 }
 
 template<typename Primitive>
-BVH<Primitive>::BVH(std::vector<Primitive>&& prims, size_t max_leaf_size) {
-    build(std::move(prims), max_leaf_size);
+BVH<Primitive>::BVH(std::vector<Primitive>&& prims, size_t max_leaf_size, Thread_Pool* pool) {
+    build(std::move(prims), max_leaf_size, pool);
 }
 
 template<typename Primitive> BVH<Primitive> BVH<Primitive>::copy() const {
     BVH<Primitive> ret;
     ret.nodes = nodes;
+    ret.wide = wide;
     ret.primitives = primitives;
     ret.root_idx = root_idx;
+    ret.leaf_size = leaf_size;
+    ret.build_cost = build_cost;
+    ret.stats = stats;
     return ret;
 }
 
 template<typename Primitive> bool BVH<Primitive>::Node::is_leaf() const {
-    return l == r;
+    return size > 0;
 }
 
-template<typename Primitive>
-size_t BVH<Primitive>::new_node(BBox box, size_t start, size_t size, size_t l, size_t r) {
+template<typename Primitive> size_t BVH<Primitive>::new_node(BBox box, size_t start, size_t size) {
     Node n;
     n.bbox = box;
-    n.start = start;
-    n.size = size;
-    n.l = l;
-    n.r = r;
+    n.start = (uint32_t)start;
+    n.size = (uint32_t)size;
     nodes.push_back(n);
     return nodes.size() - 1;
 }
 
 template<typename Primitive> BBox BVH<Primitive>::bbox() const {
+    if(nodes.empty()) return {};
     return nodes[root_idx].bbox;
 }
 
 template<typename Primitive> std::vector<Primitive> BVH<Primitive>::destructure() {
     nodes.clear();
+    wide.clear();
     return std::move(primitives);
 }
 
 template<typename Primitive> void BVH<Primitive>::clear() {
     nodes.clear();
+    wide.clear();
     primitives.clear();
 }
 
@@ -145,9 +373,9 @@ size_t BVH<Primitive>::visualize(GL::Lines& lines, GL::Lines& active, size_t lev
         edge(Vec3{max.x, min.y, min.z}, Vec3{max.x, max.y, min.z});
         edge(Vec3{max.x, min.y, min.z}, Vec3{max.x, min.y, max.z});
 
-        if(node.l && node.r) {
-            tstack.push({node.l, lvl + 1});
-            tstack.push({node.r, lvl + 1});
+        if(!node.is_leaf()) {
+            tstack.push({idx + 1, lvl + 1});
+            tstack.push({node.start, lvl + 1});
         } else {
             for(size_t i = node.start; i < node.start + node.size; i++) {
                 size_t c = primitives[i].visualize(lines, active, level - lvl, trans);
@@ -11,14 +11,8 @@ Light_Sample Env_Map::sample() const {
     Light_Sample ret;
     ret.distance = std::numeric_limits<float>::infinity();
 
-    // TODO (PathTracer): Task 7
-    // Uniformly sample the sphere. Tip: implement Samplers::Sphere::Uniform
-    Samplers::Sphere::Uniform uniform;
-    ret.direction = uniform.sample(ret.pdf);
-
-    // Once you've implemented Samplers::Sphere::Image, remove the above and
-    // uncomment this line to use importance sampling instead.
-    // ret.direction = sampler.sample(ret.pdf);
+    // Importance sampled by brightness, see Samplers::Sphere::Image
+    ret.direction = sampler.sample(ret.pdf);
 
     ret.radiance = sample_direction(ret.direction);
     return ret;
@@ -30,9 +24,15 @@ Spectrum Env_Map::sample_direction(Vec3 dir) const {
     // Find the incoming light along a given direction by finding the corresponding
     // place in the enviornment image. You should bi-linearly interpolate the value
     // between the 4 image pixels nearest to the exact direction.
+    // Tip: Samplers::Sphere::Image::uv maps the direction to the image the same way
+    // the sampler does.
     return Spectrum();
 }
 
+float Env_Map::pdf(Vec3 dir) const {
+    return sampler.pdf(dir);
+}
+
 Light_Sample Env_Hemisphere::sample() const {
     Light_Sample ret;
     ret.direction = sampler.sample(ret.pdf);
@@ -46,6 +46,10 @@ Spectrum Env_Hemisphere::sample_direction(Vec3 dir) const {
     return {};
 }
 
+float Env_Hemisphere::pdf(Vec3 dir) const {
+    return sampler.pdf(dir);
+}
+
 Light_Sample Env_Sphere::sample() const {
     Light_Sample ret;
     ret.direction = sampler.sample(ret.pdf);
@@ -58,4 +62,8 @@ Spectrum Env_Sphere::sample_direction(Vec3) const {
     return radiance;
 }
 
+float Env_Sphere::pdf(Vec3 dir) const {
+    return sampler.pdf(dir);
+}
+
 } // namespace PT
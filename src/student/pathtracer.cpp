@@ -63,48 +63,64 @@ Spectrum Pathtracer::trace_ray(const Ray& ray) {
     // the direct and indirect lighting computed below.
     Spectrum radiance_out = Spectrum(0.5f);
     {
-        auto sample_light = [&](const auto& light) {
-            // If the light is discrete (e.g. a point light), then we only need
-            // one sample, as all samples will be equivalent
-            int samples = light.is_discrete() ? 1 : (int)n_area_samples;
-            for(int i = 0; i < samples; i++) {
-
-                Light_Sample sample = light.sample(hit.position);
-                Vec3 in_dir = world_to_object.rotate(sample.direction);
-
-                // If the light is below the horizon, ignore it
-                float cos_theta = in_dir.y;
-                if(cos_theta <= 0.0f) continue;
-
-                // If the BSDF has 0 throughput in this direction, ignore it.
-                // This is another oppritunity to do Russian roulette on low-throughput rays,
-                // which would allow us to skip the shadow ray cast, increasing efficiency.
-                Spectrum attenuation = bsdf.evaluate(out_dir, in_dir);
-                if(attenuation.luma() == 0.0f) continue;
-
-                // TODO (PathTracer): Task 4
-                // Construct a shadow ray and compute whether the intersected surface is
-                // in shadow. Only accumulate light if not in shadow.
-
-                // Tip: since you're creating the shadow ray at the intersection point, it may
-                // intersect the surface at time=0. Similarly, if the ray is allowed to have
-                // arbitrary length, it will hit the light it was cast at. Therefore, you should
-                // modify the time_bounds of your shadow ray to account for this. Using EPS_F is
-                // recommended.
-
-                // Note: that along with the typical cos_theta, pdf factors, we divide by samples.
-                // This is because we're  doing another monte-carlo estimate of the lighting from
-                // area lights.
-                radiance_out +=
-                    (cos_theta / (samples * sample.pdf)) * sample.radiance * attenuation;
-            }
+        // Adds one sample of light, weighting what it contributes by scale
+        auto sample_light = [&](const Light_Sample& sample, float scale) {
+            // Samples drawn with no density (e.g. at an environment map's poles) are dropped
+            if(sample.pdf <= 0.0f) return;
+
+            Vec3 in_dir = world_to_object.rotate(sample.direction);
+
+            // If the light is below the horizon, ignore it
+            float cos_theta = in_dir.y;
+            if(cos_theta <= 0.0f) return;
+
+            // If the BSDF has 0 throughput in this direction, ignore it.
+            // This is another oppritunity to do Russian roulette on low-throughput rays,
+            // which would allow us to skip the shadow ray cast, increasing efficiency.
+            Spectrum attenuation = bsdf.evaluate(out_dir, in_dir);
+            if(attenuation.luma() == 0.0f) return;
+
+            // TODO (PathTracer): Task 4
+            // Construct a shadow ray and compute whether the intersected surface is
+            // in shadow. Only accumulate light if not in shadow.
+
+            // Tip: scene.occluded(ray) answers this faster than scene.hit(ray), as it
+            // can stop at any hit rather than searching for the closest.
+
+            // Tip: since you're creating the shadow ray at the intersection point, it may
+            // intersect the surface at time=0. Similarly, if the ray is allowed to have
+            // arbitrary length, it will hit the light it was cast at. Therefore, you should
+            // modify the time_bounds of your shadow ray to account for this. Using EPS_F is
+            // recommended.
+
+            // Note: that along with the typical cos_theta, pdf factors, we scale by the
+            // chance of having picked this light and divide by the number of samples.
+            // This is because we're doing another monte-carlo estimate of the lighting
+            // from all the lights.
+            radiance_out += (scale * cos_theta / sample.pdf) * sample.radiance * attenuation;
         };
 
         // If the BSDF is discrete (i.e. uses dirac deltas/if statements), then we are never
         // going to hit the exact right direction by sampling lights, so ignore them.
         if(!bsdf.is_discrete()) {
-            for(const auto& light : lights) sample_light(light);
-            if(env_light.has_value()) sample_light(env_light.value());
+
+            // Directional lights are sampled once each. Scenes can have thousands of other
+            // lights, so rather than sampling each of them, each area sample picks one from
+            // the light tree, with probability pmf roughly proportional to its contribution.
+            float per_sample = 1.0f / n_area_samples;
+            for(size_t l : light_tree.unbounded()) {
+                sample_light(lights[l].sample(hit.position), 1.0f);
+            }
+            for(size_t i = 0; i < n_area_samples; i++) {
+                Light_Tree::Choice choice = light_tree.sample(hit.position, hit.normal);
+                if(choice.pmf <= 0.0f) continue;
+                sample_light(lights[choice.light].sample(hit.position), per_sample / choice.pmf);
+            }
+            if(env_light.has_value()) {
+                for(size_t i = 0; i < n_area_samples; i++) {
+                    sample_light(env_light.value().sample(hit.position), per_sample);
+                }
+            }
         }
     }
 
@@ -34,25 +34,50 @@ Vec3 Sphere::Uniform::sample(float& pdf) const {
 
 Sphere::Image::Image(const HDR_Image& image) {
 
-    // TODO (PathTracer): Task 7
-    // Set up importance sampling for a spherical environment map image.
-
-    // You may make use of the pdf, cdf, and total members, or create your own
-    // representation.
-
     const auto [_w, _h] = image.dimension();
     w = _w;
     h = _h;
+    if(w == 0 || h == 0) return;
+    if(load_tables(image.loaded_from())) return;
+
+    // Each pixel is weighted by its brightness times the solid angle it covers,
+    // which shrinks towards the poles with sin(theta)
+    std::vector<float> weights(w * h), rows(h, 0.0f);
+    for(size_t y = 0; y < h; y++) {
+        float sin_theta = std::sin(PI_F * (y + 0.5f) / h);
+        for(size_t x = 0; x < w; x++) {
+            weights[y * w + x] = image.at(x, y).luma() * sin_theta;
+            rows[y] += weights[y * w + x];
+        }
+    }
+
+    marginal.resize(h);
+    conditional.resize(w * h);
+    Alias::build(rows.data(), h, marginal.data());
+    for(size_t y = 0; y < h; y++) Alias::build(&weights[y * w], w, &conditional[y * w]);
+
+    save_tables(image.loaded_from());
 }
 
 Vec3 Sphere::Image::sample(float& out_pdf) const {
 
-    // TODO (PathTracer): Task 7
-    // Use your importance sampling data structure to generate a sample direction.
-    // Tip: std::upper_bound can easily binary search your CDF
+    if(marginal.empty()) {
+        out_pdf = 1.0f / (4.0f * PI_F);
+        return Vec3(0.0f, 1.0f, 0.0f);
+    }
 
-    out_pdf = 1.0f; // what was the PDF (again, PMF here) of your chosen sample?
-    return Vec3();
+    float row_pmf, pixel_pmf;
+    size_t y = Alias::sample(marginal.data(), h, row_pmf);
+    size_t x = Alias::sample(&conditional[y * w], w, pixel_pmf);
+
+    // Uniform within the pixel, so the pmf is spread over its solid angle
+    Vec2 uv((x + RNG::unit()) / w, (y + RNG::unit()) / h);
+    // Directions at the poles have no solid angle to spread it over, as in pdf()
+    float sin_theta = std::sin(PI_F * uv.y);
+    out_pdf = sin_theta > 0.0f
+                  ? row_pmf * pixel_pmf * (w * h) / (2.0f * PI_F * PI_F * sin_theta)
+                  : 0.0f;
+    return direction(uv);
 }
 
 Vec3 Point::sample(float& pmf) const {
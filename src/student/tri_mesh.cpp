@@ -5,14 +5,10 @@
 namespace PT {
 
 BBox Triangle::bbox() const {
-
-    // TODO (PathTracer): Task 2
-    // compute the bounding box of the triangle
-
-    // Beware of flat/zero-volume boxes! You may need to
-    // account for that here, or later on in BBox::intersect
-
     BBox box;
+    box.enclose(vertex_list[v0].position);
+    box.enclose(vertex_list[v1].position);
+    box.enclose(vertex_list[v2].position);
     return box;
 }
 
@@ -22,69 +18,275 @@ Trace Triangle::hit(const Ray& ray) const {
     Tri_Mesh_Vert v_0 = vertex_list[v0];
     Tri_Mesh_Vert v_1 = vertex_list[v1];
     Tri_Mesh_Vert v_2 = vertex_list[v2];
-    (void)v_0;
-    (void)v_1;
-    (void)v_2;
 
-    // TODO (PathTracer): Task 2
-    // Intersect this ray with a triangle defined by the three above points.
+    // Moller-Trumbore, as Tri_Mesh::intersect4 does for four triangles at once
+    Vec3 e1 = v_1.position - v_0.position;
+    Vec3 e2 = v_2.position - v_0.position;
+    Vec3 q = cross(ray.dir, e2);
+    float det = dot(e1, q);
 
     Trace ret;
     ret.origin = ray.point;
-    ret.hit = false;       // was there an intersection?
-    ret.distance = 0.0f;   // at what distance did the intersection occur?
-    ret.position = Vec3{}; // where was the intersection?
-    ret.normal = Vec3{};   // what was the surface normal at the intersection?
-                           // (this should be interpolated between the three vertex normals)
+    if(std::abs(det) <= 1e-12f) return ret;
+
+    float inv = 1.0f / det;
+    Vec3 s = ray.point - v_0.position;
+    float u = dot(s, q) * inv;
+    Vec3 r = cross(s, e1);
+    float v = dot(ray.dir, r) * inv;
+    float t = dot(e2, r) * inv;
+    if(u < 0.0f || v < 0.0f || u + v > 1.0f) return ret;
+    if(t < ray.dist_bounds.x || t > ray.dist_bounds.y) return ret;
+
+    ret.hit = true;
+    ret.distance = t;
+    ret.position = ray.at(t);
+    ret.normal = ((1.0f - u - v) * v_0.normal + u * v_1.normal + v * v_2.normal).unit();
+    ret.tri = index;
     return ret;
 }
 
-Triangle::Triangle(Tri_Mesh_Vert* verts, unsigned int v0, unsigned int v1, unsigned int v2)
-    : vertex_list(verts), v0(v0), v1(v1), v2(v2) {
+Triangle::Triangle(Tri_Mesh_Vert* verts, unsigned int v0, unsigned int v1, unsigned int v2,
+                   unsigned int index)
+    : v0(v0), v1(v1), v2(v2), index(index), vertex_list(verts) {
 }
 
-void Tri_Mesh::build(const GL::Mesh& mesh) {
+void Tri_Mesh::build(const GL::Mesh& mesh, Thread_Pool* pool) {
+    build(mesh.verts(), mesh.indices(), pool);
+}
 
-    verts.clear();
-    triangles.clear();
+bool Tri_Mesh::refit(const GL::Mesh& mesh, Thread_Pool* pool) {
+    return refit(mesh.verts(), mesh.indices(), pool);
+}
 
-    for(const auto& v : mesh.verts()) {
-        verts.push_back({v.pos, v.norm});
-    }
+void Tri_Mesh::build(const std::vector<GL::Mesh::Vert>& verts,
+                     const std::vector<GL::Mesh::Index>& idxs, Thread_Pool* pool) {
 
-    const auto& idxs = mesh.indices();
+    // Built into fresh storage, since other instances may still share the old data
+    std::shared_ptr<Data> next = std::make_shared<Data>();
+
+    for(const auto& v : verts) {
+        next->verts.push_back({v.pos, v.norm});
+    }
 
     std::vector<Triangle> tris;
     for(size_t i = 0; i < idxs.size(); i += 3) {
-        tris.push_back(Triangle(verts.data(), idxs[i], idxs[i + 1], idxs[i + 2]));
+        tris.push_back(Triangle(next->verts.data(), idxs[i], idxs[i + 1], idxs[i + 2],
+                                (unsigned int)(i / 3)));
+    }
+
+    next->triangles.build(std::move(tris), 4, pool);
+    build_soa(*next);
+    data = std::move(next);
+}
+
+bool Tri_Mesh::refit(const std::vector<GL::Mesh::Vert>& verts,
+                     const std::vector<GL::Mesh::Index>& idxs, Thread_Pool* pool) {
+
+    assert(verts.size() == data->verts.size());
+    assert(idxs.size() == 3 * data->triangles.prims().size());
+
+    std::shared_ptr<Data> next = std::make_shared<Data>();
+
+    for(const auto& v : verts) {
+        next->verts.push_back({v.pos, v.norm});
+    }
+
+    next->triangles = data->triangles.copy();
+    for(Triangle& tri : next->triangles.edit_prims()) {
+        tri.vertex_list = next->verts.data();
+    }
+
+    bool kept = next->triangles.refit(pool);
+    build_soa(*next);
+    data = std::move(next);
+    return kept;
+}
+
+void Tri_Mesh::build_soa(Data& data) {
+
+    Tri_Soa& soa = data.soa;
+    const std::vector<Tri_Mesh_Vert>& verts = data.verts;
+    const std::vector<Triangle>& tris = data.triangles.prims();
+    size_t n = tris.size() + 3;
+
+    std::vector<float>* arrays[] = {&soa.px,  &soa.py,  &soa.pz,  &soa.e1x, &soa.e1y,
+                                    &soa.e1z, &soa.e2x, &soa.e2y, &soa.e2z};
+    for(std::vector<float>* a : arrays) a->assign(n, 0.0f);
+
+    for(size_t i = 0; i < tris.size(); i++) {
+        Vec3 p = verts[tris[i].v0].position;
+        Vec3 e1 = verts[tris[i].v1].position - p;
+        Vec3 e2 = verts[tris[i].v2].position - p;
+        soa.px[i] = p.x;
+        soa.py[i] = p.y;
+        soa.pz[i] = p.z;
+        soa.e1x[i] = e1.x;
+        soa.e1y[i] = e1.y;
+        soa.e1z[i] = e1.z;
+        soa.e2x[i] = e2.x;
+        soa.e2y[i] = e2.y;
+        soa.e2z[i] = e2.z;
+    }
+}
+
+void Tri_Mesh::intersect4(const Tri_Soa& soa, size_t b, size_t end, const Ray& ray, float max_t,
+                          float t[4], float u[4], float v[4], bool mask[4]) {
+
+    // Moller-Trumbore over the four triangles from b. Lanes past end are masked
+    // off; they read padding or the next leaf's triangles.
+    float ox = ray.point.x, oy = ray.point.y, oz = ray.point.z;
+    float dx = ray.dir.x, dy = ray.dir.y, dz = ray.dir.z;
+
+    for(size_t k = 0; k < 4; k++) {
+        size_t i = b + k;
+        float e1x = soa.e1x[i], e1y = soa.e1y[i], e1z = soa.e1z[i];
+        float e2x = soa.e2x[i], e2y = soa.e2y[i], e2z = soa.e2z[i];
+
+        float qx = dy * e2z - dz * e2y;
+        float qy = dz * e2x - dx * e2z;
+        float qz = dx * e2y - dy * e2x;
+        float det = e1x * qx + e1y * qy + e1z * qz;
+        float inv = 1.0f / det;
+
+        float sx = ox - soa.px[i], sy = oy - soa.py[i], sz = oz - soa.pz[i];
+        u[k] = (sx * qx + sy * qy + sz * qz) * inv;
+
+        float rx = sy * e1z - sz * e1y;
+        float ry = sz * e1x - sx * e1z;
+        float rz = sx * e1y - sy * e1x;
+        v[k] = (dx * rx + dy * ry + dz * rz) * inv;
+        t[k] = (e2x * rx + e2y * ry + e2z * rz) * inv;
+
+        mask[k] = i < end && std::abs(det) > 1e-12f && u[k] >= 0.0f && v[k] >= 0.0f &&
+                  u[k] + v[k] <= 1.0f && t[k] >= ray.dist_bounds.x && t[k] <= max_t;
     }
+}
+
+void Tri_Mesh::hit_leaf(const Ray& ray, size_t start, size_t size, Hit_Record& ret) const {
+
+    float max_t = ret.hit ? std::min(ret.distance, ray.dist_bounds.y) : ray.dist_bounds.y;
 
-    triangles.build(std::move(tris), 4);
+    size_t best = SIZE_MAX;
+    float best_u = 0.0f, best_v = 0.0f;
+
+    size_t end = start + size;
+    for(size_t b = start; b < end; b += 4) {
+
+        float t[4], u[4], v[4];
+        bool mask[4];
+        intersect4(data->soa, b, end, ray, max_t, t, u, v, mask);
+
+        for(size_t k = 0; k < 4; k++) {
+            if(mask[k] && t[k] <= max_t) {
+                max_t = t[k];
+                best = b + k;
+                best_u = u[k];
+                best_v = v[k];
+            }
+        }
+    }
+
+    if(best == SIZE_MAX) return;
+
+    ret.hit = true;
+    ret.distance = max_t;
+    ret.prim = (uint32_t)best;
+    ret.u = best_u;
+    ret.v = best_v;
 }
 
-Tri_Mesh::Tri_Mesh(const GL::Mesh& mesh) {
-    build(mesh);
+Trace Tri_Mesh::surface(const Ray& ray, const Hit_Record& rec) const {
+
+    // Only the closest hit is shaded, from the original vertices
+    const std::vector<Tri_Mesh_Vert>& verts = data->verts;
+    const Triangle& tri = data->triangles.prims()[rec.prim];
+    Vec3 normal = (1.0f - rec.u - rec.v) * verts[tri.v0].normal + rec.u * verts[tri.v1].normal +
+                  rec.v * verts[tri.v2].normal;
+
+    Trace ret;
+    ret.hit = true;
+    ret.distance = rec.distance;
+    ret.origin = ray.point;
+    ret.position = ray.at(rec.distance);
+    ret.normal = normal.unit();
+    ret.tri = tri.index;
+    return ret;
 }
 
-Tri_Mesh Tri_Mesh::copy() const {
+Tri_Mesh::Tri_Mesh(const GL::Mesh& mesh, Thread_Pool* pool) {
+    build(mesh, pool);
+}
+
+Tri_Mesh Tri_Mesh::instance() const {
     Tri_Mesh ret;
-    ret.verts = verts;
-    ret.triangles = triangles.copy();
+    ret.data = data;
     return ret;
 }
 
 BBox Tri_Mesh::bbox() const {
-    return triangles.bbox();
+    return data->triangles.bbox();
+}
+
+bool Tri_Mesh::occluded_leaf(const Ray& ray, size_t start, size_t size) const {
+
+    size_t end = start + size;
+    for(size_t b = start; b < end; b += 4) {
+        float t[4], u[4], v[4];
+        bool mask[4];
+        intersect4(data->soa, b, end, ray, ray.dist_bounds.y, t, u, v, mask);
+        if(mask[0] || mask[1] || mask[2] || mask[3]) return true;
+    }
+    return false;
+}
+
+bool Tri_Mesh::occluded(const Ray& ray) const {
+    auto leaf = [this](const Ray& ray, size_t start, size_t size) {
+        return occluded_leaf(ray, start, size);
+    };
+    return data->triangles.traverse_any(ray, leaf);
+}
+
+Hit_Record Tri_Mesh::closest(const Ray& ray) const {
+    auto leaf = [this](const Ray& ray, size_t start, size_t size, Hit_Record& ret) {
+        hit_leaf(ray, start, size, ret);
+    };
+    return data->triangles.traverse<Hit_Record>(ray, leaf);
+}
+
+void Tri_Mesh::closest_packet(const Ray* rays, Hit_Record* recs, size_t n) const {
+    auto leaf = [this](const Ray* active, Hit_Record* found, size_t m, size_t start,
+                       size_t size) {
+        for(size_t j = 0; j < m; j++) {
+            hit_leaf(active[j], start, size, found[j]);
+            if(found[j].hit) active[j].dist_bounds.y = found[j].distance;
+        }
+    };
+    data->triangles.traverse_packet(rays, recs, n, leaf);
 }
 
 Trace Tri_Mesh::hit(const Ray& ray) const {
-    Trace t = triangles.hit(ray);
-    return t;
+    Hit_Record rec = closest(ray);
+    return rec.hit ? surface(ray, rec) : Trace{};
+}
+
+void Tri_Mesh::hit_packet(const Ray* rays, Trace* traces, size_t n) const {
+
+    // Records start out clipped to the traces' hits, so only closer ones are rebuilt
+    Hit_Record recs[PACKET_SIZE];
+    for(size_t i = 0; i < n; i++) {
+        recs[i].hit = traces[i].hit;
+        recs[i].distance = traces[i].distance;
+    }
+    closest_packet(rays, recs, n);
+    for(size_t i = 0; i < n; i++) {
+        if(recs[i].prim != Hit_Record::none) traces[i] = surface(rays[i], recs[i]);
+    }
 }
 
 size_t Tri_Mesh::visualize(GL::Lines& lines, GL::Lines& active, size_t level,
                            const Mat4& trans) const {
-    return triangles.visualize(lines, active, level, trans);
+    return data->triangles.visualize(lines, active, level, trans);
 }
 
 } // namespace PT
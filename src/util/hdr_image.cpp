@@ -15,8 +15,9 @@ HDR_Image::HDR_Image(size_t w, size_t h) : w(w), h(h) {
 
 HDR_Image HDR_Image::copy() const {
     HDR_Image ret;
-    ret.resize(w, h);
-    ret.pixels.insert(ret.pixels.begin(), pixels.begin(), pixels.end());
+    ret.w = w;
+    ret.h = h;
+    ret.pixels = pixels;
     ret.last_path = last_path;
     ret.dirty = true;
     ret.exposure = exposure;
@@ -51,6 +52,15 @@ Spectrum HDR_Image::at(size_t i) const {
     return pixels[i];
 }
 
+Spectrum* HDR_Image::data() {
+    dirty = true;
+    return pixels.data();
+}
+
+const Spectrum* HDR_Image::data() const {
+    return pixels.data();
+}
+
 Spectrum& HDR_Image::at(size_t x, size_t y) {
     assert(x < w && y < h);
     size_t idx = y * w + x;
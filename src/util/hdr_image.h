@@ -23,6 +23,8 @@ public:
     Spectrum at(size_t x, size_t y) const;
     Spectrum& at(size_t i);
     Spectrum at(size_t i) const;
+    Spectrum* data();
+    const Spectrum* data() const;
 
     void clear(Spectrum color);
     void resize(size_t w, size_t h);
@@ -8,11 +8,115 @@
 
 namespace RNG {
 
-static thread_local std::mt19937 rng;
+static thread_local State state;
+
+// PCG32 (XSH RR): a 64 bit LCG, whose top bits are xorshifted and rotated
+static uint32_t pcg32(uint64_t& s) {
+    uint64_t old = s;
+    s = old * 6364136223846793005ull + 1442695040888963407ull;
+    uint32_t shifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+    uint32_t rot = (uint32_t)(old >> 59u);
+    return (shifted >> rot) | (shifted << ((32u - rot) & 31u));
+}
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint32_t mix32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+static float to_unit(uint32_t x) {
+    return (float)(x >> 8) * (1.0f / 16777216.0f);
+}
+
+// Generator matrices of the first four Sobol dimensions, as the direction
+// numbers v[k] that bit k of the index contributes. The first is the van der
+// Corput sequence; the rest follow from the primitive polynomials and initial
+// numbers of Joe and Kuo (new-joe-kuo-6.21201).
+struct Sobol_Matrices {
+    uint32_t v[4][32] = {};
+};
+
+static constexpr Sobol_Matrices sobol_matrices() {
+
+    constexpr uint32_t degree[4] = {0, 1, 2, 3};
+    constexpr uint32_t poly[4] = {0, 0, 1, 1};
+    constexpr uint32_t initial[4][3] = {{}, {1}, {1, 3}, {1, 3, 1}};
+
+    Sobol_Matrices ret;
+    for(uint32_t k = 0; k < 32; k++) ret.v[0][k] = 1u << (31 - k);
+
+    for(uint32_t d = 1; d < 4; d++) {
+        uint32_t s = degree[d];
+        uint32_t* v = ret.v[d];
+        for(uint32_t k = 0; k < s; k++) v[k] = initial[d][k] << (31 - k);
+        for(uint32_t k = s; k < 32; k++) {
+            v[k] = v[k - s] ^ (v[k - s] >> s);
+            for(uint32_t j = 1; j < s; j++) {
+                if((poly[d] >> (s - 1 - j)) & 1) v[k] ^= v[k - j];
+            }
+        }
+    }
+    return ret;
+}
+
+static constexpr Sobol_Matrices sobol = sobol_matrices();
+
+static uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Owen scrambling by hashing, after Burley, "Practical Hash-based Owen
+// Scrambling" (JCGT 2020): the Laine-Karras hash only lets each bit affect the
+// ones above it, so applied to the reversed bits it flips every bit of x
+// depending only on the bits before it, as a nested uniform scramble does.
+static uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+// Dimensions are taken in groups of four Sobol dimensions, each group with its
+// own scrambled order of the points, so that every draw of a sample is well
+// spread on its own and together with the others of its group.
+static float sobol_unit() {
+
+    uint32_t dim = state.dimension++;
+    uint32_t group = mix32(state.scramble ^ mix32(2 * (dim / 4)));
+    uint32_t index = owen_scramble(state.index, group);
+
+    uint32_t x = 0;
+    const uint32_t* v = sobol.v[dim % 4];
+    for(uint32_t k = 0; index; index >>= 1, k++) {
+        if(index & 1) x ^= v[k];
+    }
+    return to_unit(owen_scramble(x, mix32(state.scramble ^ mix32(2 * dim + 1))));
+}
 
 float unit() {
-    std::uniform_real_distribution<float> d(0.0f, 1.0f);
-    return d(rng);
+    if(state.sequence == Sequence::sobol) return sobol_unit();
+    return to_unit(pcg32(state.pcg));
 }
 
 int integer(int min, int max) {
@@ -29,7 +133,25 @@ void seed() {
         r() ^
         (std::random_device::result_type)std::hash<std::thread::id>()(std::this_thread::get_id()) ^
         (std::random_device::result_type)std::hash<time_t>()(std::time(nullptr));
-    rng.seed(seed);
+    state = State{};
+    state.pcg = mix64(seed);
+}
+
+void begin_sample(Sequence sequence, uint32_t seed, uint64_t pixel, uint32_t sample) {
+    uint64_t key = mix64(((uint64_t)seed << 32) ^ mix64(pixel));
+    state.sequence = sequence;
+    state.pcg = mix64(key + mix64(sample));
+    state.scramble = (uint32_t)(key ^ (key >> 32));
+    state.index = sample;
+    state.dimension = 0;
+}
+
+State save() {
+    return state;
+}
+
+void restore(const State& s) {
+    state = s;
 }
 
 } // namespace RNG
@@ -1,11 +1,12 @@
-
 #pragma once
 
+#include <cstdint>
+
 #include "../lib/mathlib.h"
 
 namespace RNG {
 
-// Generate random float in the range [0,1]
+// Generate random float in the range [0,1)
 float unit();
 
 // Generate random integer in the range [min,max)
@@ -16,4 +17,25 @@ bool coin_flip(float p = 0.5f);
 
 // Seed the current thread's PRNG
 void seed();
+
+// Where the draws of a sample come from. Sobol draws are Owen-scrambled Sobol
+// points, each draw taking the next dimension, so the samples of a pixel cover
+// each dimension more evenly than random ones do and noise falls off faster.
+enum class Sequence : uint8_t { random, sobol };
+
+// Starts drawing the given sample of a pixel. Its draws depend only on these
+// arguments, not on the thread or on what it drew before, so renders with the
+// same seed come out the same however their samples are spread over threads.
+void begin_sample(Sequence sequence, uint32_t seed, uint64_t pixel, uint32_t sample);
+
+// The current thread's position in its draws, for switching between samples
+// that are drawn interleaved, as the wavefront integrator does.
+struct State {
+    uint64_t pcg = 0;
+    uint32_t scramble = 0, index = 0, dimension = 0;
+    Sequence sequence = Sequence::random;
+};
+State save();
+void restore(const State& state);
+
 } // namespace RNG
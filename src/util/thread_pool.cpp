@@ -13,7 +13,6 @@ Thread_Pool::~Thread_Pool() {
 void Thread_Pool::start(size_t threads) {
     n_threads = threads;
     stop_now = false;
-    stop_when_done = false;
     for(size_t i = 0; i < threads; i++)
         workers.emplace_back([this] {
             RNG::seed();
@@ -21,14 +20,15 @@ void Thread_Pool::start(size_t threads) {
                 std::function<void()> task;
                 {
                     std::unique_lock<std::mutex> lock(this->queue_mutex);
-                    this->condition.wait(lock, [this] {
-                        return this->stop_now || this->stop_when_done || !this->tasks.empty();
-                    });
-                    if(this->stop_now || (this->stop_when_done && this->tasks.empty())) return;
+                    this->condition.wait(
+                        lock, [this] { return this->stop_now || !this->tasks.empty(); });
+                    if(this->stop_now) return;
                     task = std::move(this->tasks.front());
                     this->tasks.pop();
+                    this->active++;
                 }
                 task();
+                finish();
             }
         });
 }
@@ -39,19 +39,30 @@ void Thread_Pool::clear() {
 }
 
 void Thread_Pool::wait() {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    done.wait(lock, [this] { return tasks.empty() && active == 0; });
+}
 
+bool Thread_Pool::run_one() {
+    std::function<void()> task;
     {
         std::unique_lock<std::mutex> lock(queue_mutex);
-        stop_when_done = true;
+        if(tasks.empty()) return false;
+        task = std::move(tasks.front());
+        tasks.pop();
+        active++;
     }
+    task();
+    finish();
+    return true;
+}
 
-    condition.notify_all();
-    for(std::thread& worker : workers) {
-        worker.join();
+void Thread_Pool::finish() {
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        active--;
     }
-    workers.clear();
-
-    start(n_threads);
+    done.notify_all();
 }
 
 void Thread_Pool::stop() {
@@ -69,4 +80,5 @@ void Thread_Pool::stop() {
 
     std::queue<std::function<void()>> empty;
     std::swap(tasks, empty);
+    active = 0;
 }
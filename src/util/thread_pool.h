@@ -19,12 +19,16 @@ public:
     void wait();
     void clear();
 
+    // Run one queued task on the calling thread, returning false if none was
+    // queued. Tasks waiting on work they enqueued use this to help finish it.
+    bool run_one();
+
     template<class F, class... Args>
     auto enqueue(F&& f, Args&&... args)
         -> std::future<typename std::invoke_result<F, Args...>::type> {
 
         using return_type = typename std::invoke_result<F, Args...>::type;
-        assert(!stop_now && !stop_when_done);
+        assert(!stop_now);
 
         auto task = std::make_shared<std::packaged_task<return_type()>>(
             std::bind(std::forward<F>(f), std::forward<Args>(args)...));
@@ -40,11 +44,11 @@ public:
 
 private:
     void start(size_t);
-    size_t n_threads;
+    void finish();
+    size_t n_threads, active = 0;
     bool stop_now = true;
-    bool stop_when_done = true;
     std::mutex queue_mutex;
-    std::condition_variable condition;
+    std::condition_variable condition, done;
     std::vector<std::thread> workers;
     std::queue<std::function<void()>> tasks;
 };
@@ -0,0 +1,88 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../src/rays/tri_mesh.h"
+
+using namespace PT;
+
+// A failed check prints where it was and fails the test
+#define CHECK(cond)                                                                                \
+    do {                                                                                           \
+        if(!(cond)) {                                                                              \
+            std::printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                   \
+            failed = true;                                                                         \
+        }                                                                                          \
+    } while(0)
+
+static bool failed = false;
+
+// A square in the z = 0 plane, which is all a BVH needs of a primitive
+struct Square {
+    BBox bbox() const {
+        return BBox(Vec3{-1.0f, -1.0f, 0.0f}, Vec3{1.0f, 1.0f, 0.0f});
+    }
+    Trace hit(const Ray& ray) const {
+        Trace ret;
+        ret.origin = ray.point;
+        float t = -ray.point.z / ray.dir.z;
+        Vec3 p = ray.at(t);
+        if(t >= ray.dist_bounds.x && t <= ray.dist_bounds.y && std::abs(p.x) <= 1.0f &&
+           std::abs(p.y) <= 1.0f) {
+            ret.hit = true;
+            ret.distance = t;
+            ret.position = p;
+            ret.normal = Vec3{0.0f, 0.0f, 1.0f};
+        }
+        return ret;
+    }
+    bool occluded(const Ray& ray) const {
+        return hit(ray).hit;
+    }
+};
+
+// A BVH's first leaf starts at primitive 0, so it must not be taken for an
+// unused wide-node slot: here it is the whole tree.
+static void single_primitive() {
+
+    std::vector<Square> squares(1);
+    BVH<Square> bvh(std::move(squares));
+
+    Ray toward(Vec3{0.0f, 0.0f, -5.0f}, Vec3{0.0f, 0.0f, 1.0f});
+    Ray away(Vec3{0.0f, 0.0f, -5.0f}, Vec3{0.0f, 0.0f, -1.0f});
+    CHECK(bvh.hit(toward).hit);
+    CHECK(bvh.occluded(toward));
+    CHECK(!bvh.hit(away).hit);
+    CHECK(!bvh.occluded(away));
+}
+
+// A rectangle light's mesh, whose two triangles fit in one leaf
+static void single_leaf_mesh() {
+
+    std::vector<GL::Mesh::Vert> verts(4);
+    verts[0].pos = Vec3{-1.0f, -1.0f, 0.0f};
+    verts[1].pos = Vec3{1.0f, -1.0f, 0.0f};
+    verts[2].pos = Vec3{1.0f, 1.0f, 0.0f};
+    verts[3].pos = Vec3{-1.0f, 1.0f, 0.0f};
+    for(auto& v : verts) v.norm = Vec3{0.0f, 0.0f, 1.0f};
+    std::vector<GL::Mesh::Index> idxs = {0, 1, 2, 0, 2, 3};
+
+    Tri_Mesh mesh;
+    mesh.build(verts, idxs);
+
+    Ray center(Vec3{0.0f, 0.0f, -5.0f}, Vec3{0.0f, 0.0f, 1.0f});
+    Ray corner(Vec3{-0.9f, 0.9f, -5.0f}, Vec3{0.0f, 0.0f, 1.0f});
+    Ray miss(Vec3{2.0f, 0.0f, -5.0f}, Vec3{0.0f, 0.0f, 1.0f});
+    CHECK(mesh.hit(center).hit);
+    CHECK(mesh.occluded(center));
+    CHECK(mesh.hit(corner).hit);
+    CHECK(mesh.occluded(corner));
+    CHECK(!mesh.hit(miss).hit);
+    CHECK(!mesh.occluded(miss));
+}
+
+int main() {
+    single_primitive();
+    single_leaf_mesh();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
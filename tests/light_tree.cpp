@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "../src/rays/light_tree.h"
+#include "../src/util/rand.h"
+
+using namespace PT;
+
+// A failed check prints where it was and fails the test
+#define CHECK(cond)                                                                                \
+    do {                                                                                           \
+        if(!(cond)) {                                                                              \
+            std::printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                   \
+            failed = true;                                                                         \
+        }                                                                                          \
+    } while(0)
+
+static bool failed = false;
+
+// Point, spot and area lights spread over a few meters, a dark point light,
+// which is left out of the tree, and a directional light, which is unbounded
+static std::vector<Light> scene_lights() {
+    std::vector<Light> lights;
+    Scene_ID id = 1;
+    for(int i = 0; i < 4; i++) {
+        Vec3 at((float)i, 2.0f, (float)(i % 2));
+        lights.emplace_back(Point_Light(Spectrum(1.0f + i)), id++, Mat4::translate(at));
+    }
+    lights.emplace_back(Spot_Light(Spectrum(4.0f), Vec2(30.0f, 60.0f)), id++,
+                        Mat4::translate(Vec3(-2.0f, 3.0f, 0.0f)) *
+                            Mat4::rotate(180.0f, Vec3(1.0f, 0.0f, 0.0f)));
+    lights.emplace_back(Rect_Light(Spectrum(2.0f), Vec2(1.0f, 2.0f)), id++,
+                        Mat4::translate(Vec3(0.0f, 4.0f, -3.0f)));
+    lights.emplace_back(Tri_Light(Spectrum(3.0f), Vec3(5.0f, 0.0f, 0.0f), Vec3(6.0f, 0.0f, 0.0f),
+                                  Vec3(5.0f, 1.0f, 0.0f)),
+                        id++);
+    lights.emplace_back(Point_Light(Spectrum(0.0f)), id++);
+    lights.emplace_back(Directional_Light(Spectrum(1.0f)), id++);
+    return lights;
+}
+
+// Each choice's pmf is the one pmf gives, which the frequency of choosing that
+// light matches, and lights left out of the tree are never chosen. Bounds are
+// looser higher up the tree, so a node may be taken whose children both turn out
+// unreachable, in which case no light is chosen: the pmfs sum to at most one.
+static void sample_matches_pmf() {
+
+    std::vector<Light> lights = scene_lights();
+    Light_Tree tree;
+    tree.build(lights);
+    CHECK(tree.unbounded().size() == 1 && tree.unbounded()[0] == lights.size() - 1);
+
+    Vec3 points[] = {Vec3(0.0f), Vec3(1.5f, 0.0f, 0.5f), Vec3(5.2f, 0.2f, 2.0f),
+                     Vec3(0.0f, 2.0f, 0.0f)};
+    Vec3 normals[] = {Vec3(0.0f), Vec3(0.0f, 1.0f, 0.0f), Vec3(0.0f, 0.0f, 1.0f)};
+
+    const size_t n_samples = 20000;
+    uint32_t pixel = 0;
+    for(Vec3 point : points) {
+        for(Vec3 normal : normals) {
+            std::vector<float> pmfs;
+            float total = 0.0f;
+            for(size_t l = 0; l < lights.size(); l++) {
+                pmfs.push_back(tree.pmf(point, normal, l));
+                total += pmfs.back();
+            }
+            CHECK(total <= 1.0f + 1e-4f);
+            CHECK(pmfs[lights.size() - 2] == 0.0f);
+            CHECK(pmfs[lights.size() - 1] == 0.0f);
+
+            // The last count is of samples that chose no light
+            std::vector<size_t> counts(lights.size() + 1, 0);
+            for(uint32_t s = 0; s < n_samples; s++) {
+                RNG::begin_sample(RNG::Sequence::random, 1, pixel, s);
+                Light_Tree::Choice choice = tree.sample(point, normal);
+                if(choice.pmf == 0.0f) {
+                    counts.back()++;
+                    continue;
+                }
+                CHECK(choice.light < lights.size());
+                if(choice.light >= lights.size()) continue;
+                CHECK(std::abs(choice.pmf - pmfs[choice.light]) <= 1e-5f * pmfs[choice.light]);
+                counts[choice.light]++;
+            }
+            pixel++;
+
+            // Within five standard deviations of the expected count
+            pmfs.push_back(std::max(1.0f - total, 0.0f));
+            for(size_t l = 0; l < counts.size(); l++) {
+                float expected = pmfs[l] * n_samples;
+                float sigma = std::sqrt(expected * (1.0f - pmfs[l]));
+                CHECK(std::abs(counts[l] - expected) <= 5.0f * sigma + 1.0f);
+            }
+        }
+    }
+}
+
+// Below spot lights shining up, or with no lights, none is chosen
+static void unreachable() {
+
+    std::vector<Light> lights;
+    lights.emplace_back(Spot_Light(Spectrum(1.0f), Vec2(20.0f, 40.0f)), 1);
+    lights.emplace_back(Spot_Light(Spectrum(1.0f), Vec2(20.0f, 40.0f)), 2,
+                        Mat4::translate(Vec3(1.0f, 0.0f, 0.0f)));
+    Light_Tree tree;
+    tree.build(lights);
+
+    Vec3 below(0.5f, -5.0f, 0.0f), above(0.5f, 5.0f, 0.0f);
+    CHECK(std::abs(tree.pmf(above, Vec3(0.0f), 0) + tree.pmf(above, Vec3(0.0f), 1) - 1.0f) <
+          1e-6f);
+    CHECK(tree.pmf(below, Vec3(0.0f), 0) == 0.0f);
+    CHECK(tree.pmf(below, Vec3(0.0f), 1) == 0.0f);
+    CHECK(tree.sample(below, Vec3(0.0f)).pmf == 0.0f);
+
+    Light_Tree empty;
+    empty.build({});
+    CHECK(empty.sample(above, Vec3(0.0f)).pmf == 0.0f);
+    CHECK(empty.pmf(above, Vec3(0.0f), 0) == 0.0f);
+}
+
+int main() {
+    sample_matches_pmf();
+    unreachable();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <vector>
+
+#include "../src/rays/checkpoint.h"
+#include "../src/rays/pathtracer.h"
+
+using namespace PT;
+
+// A failed check prints where it was and fails the test
+#define CHECK(cond)                                                                                \
+    do {                                                                                           \
+        if(!(cond)) {                                                                              \
+            std::printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                   \
+            failed = true;                                                                         \
+        }                                                                                          \
+    } while(0)
+
+static bool failed = false;
+
+// Takes the work items of a render from start_work's schedule, in order, until
+// stop of them have been taken, adding each pass's samples to its tile. Every
+// tile goes from its current samples to target, or gains target if !top_up.
+static void render(std::vector<size_t>& tiles, size_t target, bool top_up, size_t per_pass,
+                   size_t stop = SIZE_MAX) {
+
+    std::vector<size_t> first = tiles, goal;
+    size_t most = 0;
+    for(size_t s : tiles) {
+        goal.push_back(top_up ? std::max(target, s) : s + target);
+        most = std::max(most, goal.back() - s);
+    }
+    size_t passes = most / per_pass + !!(most % per_pass);
+    size_t total = std::min(stop, passes * tiles.size());
+    for(size_t work = 0; work < total; work++) {
+        size_t n = work / tiles.size(), t = work % tiles.size();
+        tiles[t] += Pathtracer::pass_samples(first[t], goal[t], n, per_pass);
+    }
+}
+
+// A render stopped after any number of passes, checkpointed and resumed ends
+// with every tile at exactly the sample count of one that wasn't stopped.
+static void resume_matches() {
+
+    const size_t n_tiles = 7;
+    for(size_t n_samples : {1, 16, 50, 64, 100}) {
+        size_t per_pass = std::max(size_t(1), n_samples / 16);
+        size_t passes = n_samples / per_pass + !!(n_samples % per_pass);
+
+        for(size_t stop = 0; stop <= passes * n_tiles; stop++) {
+            std::vector<size_t> tiles(n_tiles, 0);
+            render(tiles, n_samples, false, per_pass, stop);
+
+            // Resumed once, then again from a checkpoint of the resumed render
+            std::vector<size_t> twice = tiles;
+            render(tiles, n_samples, true, per_pass);
+            render(twice, n_samples, true, per_pass, stop / 2);
+            render(twice, n_samples, true, per_pass);
+
+            for(size_t t = 0; t < n_tiles; t++) {
+                CHECK(tiles[t] == n_samples);
+                CHECK(twice[t] == n_samples);
+            }
+        }
+    }
+}
+
+// Resuming a finished render takes no samples
+static void resume_finished() {
+    CHECK(Pathtracer::pass_samples(32, 32, 0, 2) == 0);
+    CHECK(Pathtracer::pass_samples(34, 32, 0, 2) == 0);
+}
+
+// A checkpoint of a 4x4 frame split into two bands, with a color layer and the
+// first-hit layers, the top band a pass ahead of the bottom one
+static Checkpoint two_bands() {
+    Checkpoint checkpoint;
+    checkpoint.header.hash = 0x1234;
+    checkpoint.header.w = checkpoint.header.h = 4;
+    checkpoint.header.layers = 0b111000;
+    checkpoint.header.layer_colors = 1;
+    checkpoint.header.seed = 7;
+    checkpoint.header.sequence = 1;
+    checkpoint.header.wavefront = 1;
+    checkpoint.header.noise_threshold = 0.05f;
+    for(uint64_t y : {0, 2}) {
+        Checkpoint::Tile& tile = checkpoint.tiles.emplace_back();
+        tile.y = y;
+        tile.w = 4;
+        tile.h = 2;
+        tile.samples = tile.layer_samples = y ? 4 : 6;
+        for(size_t i = 0; i < 8; i++) {
+            float v = (float)(y * 4 + i);
+            tile.sums.push_back(Spectrum(v, v + 0.25f, v + 0.5f));
+            tile.sums_sq.push_back(v * v);
+            tile.layer_sums.push_back(Spectrum(v / 2.0f));
+            tile.depth.push_back(v + 1.0f);
+            tile.object.push_back(3.0f);
+            tile.material.push_back(5.0f);
+        }
+    }
+    return checkpoint;
+}
+
+static std::string temp_file(const std::string& name) {
+    return (std::filesystem::temp_directory_path() / name).string();
+}
+
+// Saving and loading a checkpoint gives back the same tiles, and resuming from
+// them ends where a render that wasn't stopped would have
+static void checkpoint_round_trip() {
+
+    Checkpoint saved = two_bands();
+    std::string path = temp_file("cardinal3d_round_trip.ckpt");
+    CHECK(saved.save(path).empty());
+
+    Checkpoint loaded;
+    CHECK(loaded.load(path, saved.header, true).empty());
+    CHECK(loaded.header.tiles == 2);
+    CHECK(loaded.tiles.size() == saved.tiles.size());
+    for(size_t t = 0; t < std::min(loaded.tiles.size(), saved.tiles.size()); t++) {
+        const Checkpoint::Tile &a = loaded.tiles[t], &b = saved.tiles[t];
+        CHECK(a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h);
+        CHECK(a.samples == b.samples && a.layer_samples == b.layer_samples);
+        CHECK(a.sums == b.sums && a.sums_sq == b.sums_sq && a.layer_sums == b.layer_sums);
+        CHECK(a.depth == b.depth && a.object == b.object && a.material == b.material);
+    }
+
+    std::vector<size_t> tiles;
+    for(const Checkpoint::Tile& tile : loaded.tiles) tiles.push_back(tile.samples);
+    render(tiles, 8, true, 2);
+    for(size_t s : tiles) CHECK(s == 8);
+
+    std::filesystem::remove(path);
+}
+
+// Loading refuses a checkpoint saved with other settings or layers, a corrupt or
+// truncated one, and one overlapping a region already merged, leaving the
+// checkpoint it was loading into as it was
+static void checkpoint_refused() {
+
+    Checkpoint saved = two_bands();
+    std::string path = temp_file("cardinal3d_refused.ckpt");
+    CHECK(saved.save(path).empty());
+
+    auto refused = [&](const Checkpoint::Header& expected, bool first_hits,
+                       const std::vector<Checkpoint::Tile>& merged = {}) {
+        Checkpoint loaded;
+        bool ret = !loaded.load(path, expected, first_hits, merged).empty();
+        return ret && loaded.tiles.empty() && loaded.header.tiles == 0;
+    };
+
+    const Checkpoint::Header& header = saved.header;
+    auto changed = [&](auto edit) {
+        Checkpoint::Header ret = header;
+        edit(ret);
+        return ret;
+    };
+    CHECK(refused(changed([](auto& h) { h.w = 8; }), true));
+    CHECK(refused(changed([](auto& h) { h.hash ^= 1; }), true));
+    CHECK(refused(changed([](auto& h) { h.seed++; }), true));
+    CHECK(refused(changed([](auto& h) { h.sequence = 0; }), true));
+    CHECK(refused(changed([](auto& h) { h.wavefront = 0; }), true));
+    CHECK(refused(changed([](auto& h) { h.noise_threshold = 0.0f; }), true));
+    CHECK(refused(changed([](auto& h) { h.layer_colors = 2; }), true));
+    CHECK(refused(changed([](auto& h) { h.layers = 0; }), true));
+
+    // The second band overlaps one merged from another file, but not the first
+    Checkpoint::Tile band;
+    band.y = 3;
+    band.w = 4;
+    band.h = 1;
+    CHECK(refused(header, true, {band}));
+    band.y = 4;
+    CHECK(!refused(header, true, {band}));
+
+    // Cut short, the file lacks the bottom band's first-hit layers
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 4);
+    CHECK(refused(header, true));
+
+    Checkpoint overlapping = two_bands();
+    overlapping.tiles[1].y = 1;
+    CHECK(overlapping.save(path).empty());
+    CHECK(refused(header, true));
+
+    std::filesystem::remove(path);
+}
+
+int main() {
+    resume_matches();
+    resume_finished();
+    checkpoint_round_trip();
+    checkpoint_refused();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
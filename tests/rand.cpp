@@ -0,0 +1,88 @@
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "../src/util/rand.h"
+
+// A failed check prints where it was and fails the test
+#define CHECK(cond)                                                                                \
+    do {                                                                                           \
+        if(!(cond)) {                                                                              \
+            std::printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                   \
+            failed = true;                                                                         \
+        }                                                                                          \
+    } while(0)
+
+static bool failed = false;
+
+static const RNG::Sequence sequences[] = {RNG::Sequence::random, RNG::Sequence::sobol};
+
+// The first n draws of a sample
+static std::vector<float> draws(RNG::Sequence sequence, uint32_t seed, uint64_t pixel,
+                                uint32_t sample, size_t n = 12) {
+    RNG::begin_sample(sequence, seed, pixel, sample);
+    std::vector<float> ret;
+    for(size_t i = 0; i < n; i++) ret.push_back(RNG::unit());
+    return ret;
+}
+
+// A sample's draws depend only on its sequence, seed, pixel and index: not on
+// the thread drawing them or what it drew before, and saving and restoring the
+// state of one sample between draws of another carries on where it left off
+static void deterministic() {
+
+    for(RNG::Sequence sequence : sequences) {
+        std::vector<float> first = draws(sequence, 5, 1234, 17);
+        for(float u : first) CHECK(u >= 0.0f && u < 1.0f);
+
+        RNG::seed();
+        for(int i = 0; i < 100; i++) RNG::unit();
+        CHECK(draws(sequence, 5, 1234, 17) == first);
+
+        std::vector<float> other;
+        std::thread([&]() { other = draws(sequence, 5, 1234, 17); }).join();
+        CHECK(other == first);
+
+        RNG::begin_sample(sequence, 5, 1234, 17);
+        std::vector<float> interleaved;
+        for(size_t i = 0; i < first.size(); i++) {
+            interleaved.push_back(RNG::unit());
+            RNG::State state = RNG::save();
+            draws(sequence, 6, 99, 3);
+            RNG::restore(state);
+        }
+        CHECK(interleaved == first);
+
+        CHECK(draws(sequence, 6, 1234, 17) != first);
+        CHECK(draws(sequence, 5, 1235, 17) != first);
+        CHECK(draws(sequence, 5, 1234, 18) != first);
+    }
+    CHECK(draws(RNG::Sequence::random, 5, 1234, 17) != draws(RNG::Sequence::sobol, 5, 1234, 17));
+}
+
+// The first 2^k Sobol samples of a pixel fall one in each of the 2^k intervals
+// of either of its first two draws, and one in each square of a 2^(k/2) grid
+// over the pair, which random samples would only do by chance
+static void sobol_stratified() {
+
+    for(uint64_t pixel : {0, 1, 77}) {
+        for(size_t n : {4, 16, 64}) {
+            size_t side = n == 4 ? 2 : n == 16 ? 4 : 8;
+            std::vector<int> xs(n, 0), ys(n, 0), grid(n, 0);
+            for(uint32_t s = 0; s < n; s++) {
+                std::vector<float> u = draws(RNG::Sequence::sobol, 9, pixel, s, 2);
+                xs[(size_t)(u[0] * n)]++;
+                ys[(size_t)(u[1] * n)]++;
+                grid[(size_t)(u[1] * side) * side + (size_t)(u[0] * side)]++;
+            }
+            for(size_t i = 0; i < n; i++) CHECK(xs[i] == 1 && ys[i] == 1 && grid[i] == 1);
+        }
+    }
+}
+
+int main() {
+    deterministic();
+    sobol_stratified();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
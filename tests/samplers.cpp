@@ -0,0 +1,210 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <vector>
+
+#include <sf_libs/stb_image_write.h>
+
+#include "../src/rays/samplers.h"
+#include "../src/util/rand.h"
+
+using namespace Samplers;
+
+// A failed check prints where it was and fails the test
+#define CHECK(cond)                                                                                \
+    do {                                                                                           \
+        if(!(cond)) {                                                                              \
+            std::printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                   \
+            failed = true;                                                                         \
+        }                                                                                          \
+    } while(0)
+
+static bool failed = false;
+
+// Whether a count of n draws is within five standard deviations of pmf's share
+static bool near_expected(size_t count, size_t n, float pmf) {
+    float expected = pmf * n;
+    return std::abs(count - expected) <= 5.0f * std::sqrt(expected * (1.0f - pmf)) + 1.0f;
+}
+
+// The table gives each outcome its weight's share: the pmfs sum to one, the
+// halves of the entries that give an outcome add up to its pmf, outcomes with
+// zero weight are never drawn, and draws come out in proportion to the weights
+static void alias_matches_weights() {
+
+    std::vector<std::vector<float>> cases = {{1.0f},
+                                             {1.0f, 0.0f, 3.0f, 4.0f, 0.0f, 2.0f},
+                                             {0.0f, 0.0f, 5.0f},
+                                             {0.0f, 0.0f, 0.0f, 0.0f},
+                                             {}};
+    for(size_t i = 0; i < 37; i++) cases.back().push_back((float)((i * 7919) % 13));
+
+    uint32_t pixel = 0;
+    for(const std::vector<float>& weights : cases) {
+        size_t n = weights.size();
+        std::vector<Alias::Entry> table(n);
+        Alias::build(weights.data(), n, table.data());
+
+        double total = 0.0;
+        for(float w : weights) total += w;
+
+        float pmf_sum = 0.0f;
+        std::vector<float> mass(n, 0.0f);
+        for(size_t i = 0; i < n; i++) {
+            const Alias::Entry& entry = table[i];
+            float expected = total > 0.0 ? (float)(weights[i] / total) : 1.0f / n;
+            CHECK(std::abs(entry.pmf - expected) < 1e-6f);
+            CHECK(entry.prob >= 0.0f && entry.prob <= 1.0f && entry.alias < n);
+            if(entry.alias >= n) continue;
+            CHECK(entry.alias_pmf == table[entry.alias].pmf);
+            pmf_sum += entry.pmf;
+            mass[i] += entry.prob / n;
+            mass[entry.alias] += (1.0f - entry.prob) / n;
+        }
+        CHECK(std::abs(pmf_sum - 1.0f) < 1e-5f);
+        for(size_t i = 0; i < n; i++) CHECK(std::abs(mass[i] - table[i].pmf) < 1e-5f);
+
+        const size_t n_samples = 20000;
+        std::vector<size_t> counts(n, 0);
+        for(uint32_t s = 0; s < n_samples; s++) {
+            RNG::begin_sample(RNG::Sequence::random, 1, pixel, s);
+            float pmf = 0.0f;
+            size_t i = Alias::sample(table.data(), n, pmf);
+            CHECK(i < n);
+            if(i >= n) continue;
+            CHECK(pmf == table[i].pmf && pmf > 0.0f);
+            counts[i]++;
+        }
+        pixel++;
+        for(size_t i = 0; i < n; i++) CHECK(near_expected(counts[i], n_samples, table[i].pmf));
+    }
+}
+
+// A small environment map with a bright spot and a black pixel
+static HDR_Image environment() {
+    HDR_Image image(8, 4);
+    for(size_t y = 0; y < 4; y++) {
+        for(size_t x = 0; x < 8; x++) image.at(x, y) = Spectrum(0.1f * (x + 1), 0.2f, 0.05f * y);
+    }
+    image.at(5, 1) = Spectrum(20.0f);
+    image.at(2, 2) = Spectrum(0.0f);
+    return image;
+}
+
+// A direction drawn uniformly from the sphere, made by hand as the uniform
+// sphere sampler is left to students
+static Vec3 uniform_direction() {
+    float y = 1.0f - 2.0f * RNG::unit();
+    float r = std::sqrt(std::max(1.0f - y * y, 0.0f));
+    float phi = 2.0f * PI_F * RNG::unit();
+    return Vec3(r * std::cos(phi), y, r * std::sin(phi));
+}
+
+// Sampling the image gives the density pdf gives for the direction drawn, never
+// lands in a black pixel, and the density integrates to one over the sphere
+static void image_matches_pdf() {
+
+    HDR_Image image = environment();
+    Sphere::Image sampler(image);
+    CHECK(sampler.w == 8 && sampler.h == 4);
+
+    const size_t n_samples = 20000;
+    size_t black = 0;
+    for(uint32_t s = 0; s < n_samples; s++) {
+        RNG::begin_sample(RNG::Sequence::random, 2, 0, s);
+        float pdf = 0.0f;
+        Vec3 dir = sampler.sample(pdf);
+        CHECK(std::abs(dir.norm() - 1.0f) < 1e-4f);
+        float expected = sampler.pdf(dir);
+
+        // Near the poles, finding theta again from the direction loses precision
+        Vec2 uv = Sphere::Image::uv(dir);
+        float tolerance = uv.y > 0.01f && uv.y < 0.99f ? 1e-3f : 2e-2f;
+        CHECK(std::abs(pdf - expected) <= tolerance * expected);
+
+        size_t x = std::min((size_t)(uv.x * 8), size_t(7));
+        size_t y = std::min((size_t)(uv.y * 4), size_t(3));
+        if(x == 2 && y == 2) black++;
+    }
+    CHECK(black == 0);
+    CHECK(sampler.pdf(Sphere::Image::direction(Vec2(2.5f / 8.0f, 2.5f / 4.0f))) == 0.0f);
+
+    double integral = 0.0;
+    for(uint32_t s = 0; s < n_samples; s++) {
+        RNG::begin_sample(RNG::Sequence::sobol, 3, 0, s);
+        integral += sampler.pdf(uniform_direction()) * 4.0f * PI_F;
+    }
+    integral /= n_samples;
+    CHECK(std::abs(integral - 1.0) < 0.02);
+}
+
+static bool same_tables(const Sphere::Image& a, const Sphere::Image& b) {
+    auto same = [](const std::vector<Alias::Entry>& x, const std::vector<Alias::Entry>& y) {
+        if(x.size() != y.size()) return false;
+        for(size_t i = 0; i < x.size(); i++) {
+            if(x[i].prob != y[i].prob || x[i].alias != y[i].alias || x[i].pmf != y[i].pmf ||
+               x[i].alias_pmf != y[i].alias_pmf)
+                return false;
+        }
+        return true;
+    };
+    return a.w == b.w && a.h == b.h && same(a.marginal, b.marginal) &&
+           same(a.conditional, b.conditional);
+}
+
+// The same image, but not loaded from a file, so its tables are always built
+static HDR_Image unsaved(const HDR_Image& image) {
+    auto [w, h] = image.dimension();
+    HDR_Image ret(w, h);
+    for(size_t i = 0; i < w * h; i++) ret.at(i) = image.at(i);
+    return ret;
+}
+
+// Tables built for an image file are saved next to it, loaded for it while the
+// file is unchanged, and built again once it changes
+static void tables_cached() {
+
+    namespace fs = std::filesystem;
+    std::string path = (fs::temp_directory_path() / "cardinal3d_env.hdr").string();
+    std::string cache = path + ".alias";
+    fs::remove(cache);
+
+    auto write = [&path](const HDR_Image& image) {
+        auto [w, h] = image.dimension();
+        CHECK(stbi_write_hdr(path.c_str(), (int)w, (int)h, 3, (const float*)image.data()));
+    };
+
+    HDR_Image source = environment();
+    write(source);
+    HDR_Image loaded;
+    CHECK(loaded.load_from(path).empty());
+    Sphere::Image built(loaded);
+    CHECK(fs::exists(cache));
+    CHECK(same_tables(built, Sphere::Image(unsaved(loaded))));
+
+    // Tables that came from the cache are those of the file, not of the edit
+    HDR_Image edited = loaded.copy();
+    edited.at(0, 0) = Spectrum(50.0f);
+    CHECK(same_tables(Sphere::Image(edited), built));
+    CHECK(!same_tables(Sphere::Image(unsaved(edited)), built));
+
+    // Once the file changes, they are built again
+    write(edited);
+    fs::last_write_time(path, fs::last_write_time(path) + std::chrono::seconds(10));
+    HDR_Image reloaded;
+    CHECK(reloaded.load_from(path).empty());
+    Sphere::Image rebuilt(reloaded);
+    CHECK(same_tables(rebuilt, Sphere::Image(unsaved(reloaded))));
+    CHECK(!same_tables(rebuilt, built));
+
+    fs::remove(path);
+    fs::remove(cache);
+}
+
+int main() {
+    alias_matches_weights();
+    image_matches_pdf();
+    tables_cached();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}